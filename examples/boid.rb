@@ -230,7 +230,14 @@ end
 class Boids < Graphics::Simulation
   attr_accessor :boids, :body_img, :cmap, :visual_debug
 
+  ##
+  # The native flocking kernel and the packed positions and velocities
+  # it steps. Toggle with N to compare against the ruby rules above.
+
+  attr_accessor :flock, :positions, :velocities, :native
+
   alias :visual_debug? :visual_debug
+  alias :native? :native
 
   def initialize
     super 850, 850
@@ -240,6 +247,13 @@ class Boids < Graphics::Simulation
     self.boids = populate Boid
     register_bodies boids
 
+    self.flock = Graphics::Flock.new(cohesion:     Boid::PCT_DAMPENER,
+                                     too_close:    Boid::TOO_CLOSE,
+                                     max_velocity: Boid::MAX_VELOCITY)
+    self.positions  = V::Array.new boids.size
+    self.velocities = V::Array.new boids.size
+    self.native     = true
+
     self.body_img = sprite 20, 20 do
       circle 10, 10, 5, :white, :filled, :aa
     end
@@ -251,12 +265,42 @@ class Boids < Graphics::Simulation
     add_key_handler(:D) { self.visual_debug = ! visual_debug }
     add_key_handler(:B) { Boid.max_distance += 5 }
     add_key_handler(:S) { Boid.max_distance -= 5 }
+    add_key_handler(:N, on: :pressed) { self.native = ! native }
+  end
+
+  ##
+  # Load the bodies into the packed arrays when switching to native.
+
+  def native= bool
+    if bool then
+      boids.each_with_index do |b, i|
+        positions[i]  = b.position
+        velocities[i] = b.velocity
+      end
+    end
+
+    @native = bool
+  end
+
+  def update n
+    return super unless native?
+
+    flock.max_distance = Boid.max_distance
+    flock.step positions, velocities
+    positions.axpy! 1, velocities
+    positions.wrap! w, h
+
+    boids.each_with_index do |b, i|
+      p = positions[i]
+      b.x, b.y   = p.x, p.y
+      b.velocity = velocities[i]
+    end
   end
 
   def draw n
     super
 
-    debug "r = #{Boid.max_distance}" if visual_debug?
+    debug "r = #{Boid.max_distance} #{native? ? "native" : "ruby"}" if visual_debug?
     fps n
   end
 end
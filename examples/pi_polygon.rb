@@ -16,10 +16,7 @@ class Polygnome < Array
   end
 
   def draw
-    if size > 2
-      points = self << first
-      points.each_cons(2) { |a, b| @s.line a.x, a.y, b.x, b.y, :yellow }
-    end
+    @s.polygon(*self, :yellow) if size > 2
   end
 
   def add vertex
@@ -15,7 +15,7 @@ class Vant < Graphics::Body
   def initialize w
     super
     self.a = random_angle
-    self.s = w.renderer
+    self.s = w.canvas
 
     self.white = w.color[:white]
     self.black = w.color[:black]
@@ -26,6 +26,8 @@ class Vant < Graphics::Body
   end
 
   def draw
+    x, y = self.x.round % s.w, self.y.round % s.h # canvas doesn't clip reads
+
     if s[x, y] == white then
       s[x, y] = black
       turn 270
@@ -44,16 +46,16 @@ class Vants < Graphics::Drawing
   def initialize
     super 850, 850
 
+    shadow # ants read & write pixels, so keep them in memory
+
     self.vs = populate Vant
     register_bodies vs
   end
 
   def draw n
-    draw_on texture do
-      _bodies.each do |a|
-        a.each do |v|
-          v.draw
-        end
+    _bodies.each do |a|
+      a.each do |v|
+        v.draw
       end
     end
   end
@@ -20,4 +20,16 @@ have_library("SDL2_image", "IMG_Load")      or abort "Need sdl2_image"
 have_library("SDL2_ttf", "TTF_Init")        or abort "Need sdl2_ttf"
 have_library("SDL2_gfx", "hlineColor")      or abort "Need sdl2_gfx"
 
+have_header "ruby/io/buffer.h"   # Surface#pixels
+have_header "ruby/memory_view.h" # Surface as a memory view
+have_header "sys/mman.h"         # SDL::Bundle maps instead of reading
+have_header "ruby/ractor.h"      # declare the extension ractor safe
+
+# optional: lets SDL::TTF.lookup find fonts by family name
+have_library("fontconfig", "FcFontMatch") and
+  have_header "fontconfig/fontconfig.h"
+
+# optional: LZ4 compressed images in SDL::Bundle
+have_library("lz4", "LZ4_decompress_safe") and have_header "lz4.h"
+
 create_makefile "sdl/sdl"
@@ -1,12 +1,35 @@
 #include <SDL.h>
 #include <ruby.h>
 #include <ruby/intern.h>
+#include <ruby/thread.h>
+#include <ruby/util.h>
+#ifdef HAVE_RUBY_IO_BUFFER_H
+#include <ruby/io/buffer.h>
+#endif
+#ifdef HAVE_RUBY_MEMORY_VIEW_H
+#include <ruby/memory_view.h>
+#endif
+#ifdef HAVE_RUBY_RACTOR_H
+#include <ruby/ractor.h>
+#endif
 #include <SDL_ttf.h>
 #include <SDL_image.h>
 #include <SDL2_gfxPrimitives.h>
 #include <SDL2_rotozoom.h>
 #include <sge/sge_collision.h>
 #include <SDL_mixer.h>
+#ifdef HAVE_FONTCONFIG_FONTCONFIG_H
+#include <fontconfig/fontconfig.h>
+#endif
+#ifdef HAVE_LZ4_H
+#include <lz4.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 // https://github.com/google/protobuf/blob/master/ruby/ext/google/protobuf_c/defs.c
 
@@ -74,10 +97,22 @@ static VALUE eSDLError;
 static VALUE mKey;
 static VALUE mSDL;
 static VALUE mMouse;
+static VALUE cGraphics;
 
 typedef TTF_Font SDL_TTFFont;
 typedef Mix_Chunk SDL_Audio;
 typedef sge_cdata SDL_CollisionMap;
+typedef struct SDL_Recorder SDL_Recorder;
+typedef struct SDL_Framebuffer SDL_Framebuffer;
+typedef struct SDL_Loader SDL_Loader;
+typedef struct SDL_Bundle SDL_Bundle;
+typedef struct SDL_TextureCache SDL_TextureCache;
+typedef struct SDL_KeyBindings SDL_KeyBindings;
+typedef struct SDL_Trail SDL_Trail;
+typedef struct SDL_VArray SDL_VArray;
+typedef struct SDL_SPH SDL_SPH;
+typedef struct SDL_Flock SDL_Flock;
+typedef struct SDL_CellGrid SDL_CellGrid;
 
 static ID id_H;
 static ID id_W;
@@ -87,10 +122,17 @@ DEFINE_ID(format);
 DEFINE_ID(renderer);
 DEFINE_ID(window);
 DEFINE_ID(texture);
+DEFINE_ID(recorder);
+DEFINE_ID(field);
+DEFINE_ID(bundle);
+DEFINE_ID(textures);
+DEFINE_ID(stamps);
+DEFINE_ID(cached);
 DEFINE_ID(button);
 DEFINE_ID(mod);
 DEFINE_ID(press);
 DEFINE_ID(state);
+DEFINE_ID(target);
 DEFINE_ID(sym);
 DEFINE_ID(x);
 DEFINE_ID(xrel);
@@ -98,24 +140,58 @@ DEFINE_ID(y);
 DEFINE_ID(yrel);
 
 DEFINE_CLASS(Audio,        "SDL::Audio")
+DEFINE_CLASS(Bundle,       "SDL::Bundle")
 DEFINE_CLASS(Surface,      "SDL::Surface")
 DEFINE_CLASS(CollisionMap, "SDL::CollisionMap")
+DEFINE_CLASS(Framebuffer,  "SDL::Framebuffer")
+DEFINE_CLASS(KeyBindings,  "SDL::Key::Bindings")
+DEFINE_CLASS(Loader,       "SDL::Loader")
 DEFINE_CLASS(PixelFormat,  "SDL::PixelFormat")
+DEFINE_CLASS(Recorder,     "SDL::Recorder")
+DEFINE_CLASS(TextureCache, "SDL::TextureCache")
+DEFINE_CLASS(Trail,        "SDL::Trail")
+DEFINE_CLASS(VArray,       "V::Array")
+DEFINE_CLASS(SPH,          "Graphics::SPH")
+DEFINE_CLASS(Flock,        "Graphics::Flock")
+DEFINE_CLASS(CellGrid,     "Graphics::CellGrid")
 DEFINE_CLASS_0(TTFFont,    "SDL::TTFFont")
 DEFINE_CLASS_0(Renderer,   "SDL::Renderer") // TODO: I kinda want these hidden
 DEFINE_CLASS_0(Window,     "SDL::Window")   // TODO: I kinda want these hidden
-DEFINE_CLASS_0(Texture,    "SDL::Texture")  // TODO: I kinda want these hidden
 
-#define SDL_NUMEVENTS 0xFFFF // HACK
+// SDL::Texture wraps its size along with the texture, so memsize never
+// asks a texture whose renderer may already be gone.
+typedef struct {
+  SDL_Texture *texture;
+  size_t       bytes;
+} texture_ref;
+
+static void _Texture_mark(void*);
+static void _Texture_free(void*);
+static size_t _Texture_memsize(const void *);
+static VALUE cTexture;                  // TODO: I kinda want these hidden
+static const rb_data_type_t _Texture_type = {
+  "SDL::Texture",
+  { _Texture_mark, _Texture_free, _Texture_memsize, { NULL, NULL }, }, NULL, NULL,
+};
+static SDL_Texture* ruby_to_Texture(VALUE val) {
+  texture_ref* ref;
+  TypedData_Get_Struct(val, texture_ref, &_Texture_type, ref);
+  return ref->texture;
+}
+static VALUE _Texture_wrap(SDL_Texture *texture);
+
 typedef VALUE (*event_creator)(SDL_Event *);
-static event_creator event_creators[SDL_NUMEVENTS];
 
-static int is_quit = 0;
-static int key_state_len = 0;
-static Uint8* key_state = NULL;
-static SDL_Keymod mod_state;
+// Ractors share everything below, so it's either set once or atomic.
+static SDL_atomic_t quitting;           // set by sdl__quit at exit
+static SDL_mutex *collision_lock;       // sge keeps collision points in globals
+static VALUE surface_cache = Qnil;      // path => Surface, main ractor only
+
+#define is_quit SDL_AtomicGet(&quitting)
 
 void Init_sdl(void);
+static VALUE _Surface_wrap(SDL_Surface *surface);
+static VALUE _Surface_cache(VALUE key, VALUE surface);
 
 //// Misc / Utility functions:
 
@@ -126,6 +202,467 @@ static void rb_const_reset(VALUE mod, ID id, VALUE val) { // avoids warnings
 
 #define VALUE2COLOR(c) NUM2UINT(c)
 
+// Same layout Renderer#[] and #read_pixels hand back, on any endianness.
+static Uint32 rgba32(Uint8 r, Uint8 g, Uint8 b, Uint8 a) {
+  Uint8 bytes[4] = { r, g, b, a };
+  Uint32 pixel;
+
+  memcpy(&pixel, bytes, sizeof(pixel));
+
+  return pixel;
+}
+
+// Runs fn over [0, n) in chunks, one per thread (the caller's thread
+// included). Chunks are kept to a few hundred items or more, so small
+// jobs just run inline. fn must not touch ruby.
+
+typedef void (*parallel_fn)(void *ctx, int lo, int hi);
+
+typedef struct {
+  parallel_fn fn;
+  void       *ctx;
+  int         lo, hi;
+} parallel_chunk;
+
+#define PARALLEL_MAX   16
+#define PARALLEL_GRAIN 256
+
+static int _parallel_run(void *data) {
+  parallel_chunk *chunk = data;
+
+  chunk->fn(chunk->ctx, chunk->lo, chunk->hi);
+
+  return 0;
+}
+
+static void _parallel_for(int n, int threads, parallel_fn fn, void *ctx) {
+  if (threads > n / PARALLEL_GRAIN) threads = n / PARALLEL_GRAIN;
+  if (threads > PARALLEL_MAX)       threads = PARALLEL_MAX;
+
+  if (threads <= 1) {
+    fn(ctx, 0, n);
+    return;
+  }
+
+  parallel_chunk chunks[PARALLEL_MAX];
+  SDL_Thread    *workers[PARALLEL_MAX] = { NULL };
+
+  for (int t = 0; t < threads; t++) {
+    chunks[t].fn  = fn;
+    chunks[t].ctx = ctx;
+    chunks[t].lo  = (int)((long)n * t / threads);
+    chunks[t].hi  = (int)((long)n * (t + 1) / threads);
+  }
+
+  for (int t = 1; t < threads; t++) {
+    workers[t] = SDL_CreateThread(_parallel_run, "graphics-worker", &chunks[t]);
+    if (!workers[t])                    // out of threads? do it here
+      _parallel_run(&chunks[t]);
+  }
+
+  _parallel_run(&chunks[0]);
+
+  for (int t = 1; t < threads; t++)
+    if (workers[t])
+      SDL_WaitThread(workers[t], NULL);
+}
+
+// Work done without the GVL holds *busy while it runs, and anything
+// else that touches the same memory checks it first and raises, the
+// way rb_str_locktmp guards a string.
+
+typedef struct {
+  void *(*fn)(void *);
+  void  *data;
+  int   *busy;
+} busy_call;
+
+static void _busy_check(int busy, const char *name) {
+  if (busy)
+    rb_raise(rb_eRuntimeError, "can't modify %s; it's busy in another thread", name);
+}
+
+static VALUE _busy_run(VALUE data) {
+  busy_call *call = (busy_call*)data;
+
+  rb_thread_call_without_gvl(call->fn, call->data, NULL, NULL);
+
+  return Qnil;
+}
+
+static VALUE _busy_done(VALUE data) {
+  *((busy_call*)data)->busy = 0;
+
+  return Qnil;
+}
+
+static void _busy_without_gvl(int *busy, void *(*fn)(void *), void *data) {
+  busy_call call = { fn, data, busy };
+
+  *busy = 1;
+  rb_ensure(_busy_run, (VALUE)&call, _busy_done, (VALUE)&call);
+}
+
+// A uniform grid over a set of points, built with a counting sort so
+// the points in cell c are order[start[c]] ... order[start[c+1] - 1].
+// Cells are at least the size asked for, but grow if the points are so
+// spread out that the grid would dwarf the point count.
+
+typedef struct {
+  double x0, y0, size;
+  int    nx, ny;
+  int   *start;                         // nx * ny + 1
+  int   *order;                         // n
+  int   *cell_of;                       // n
+  long   start_capa, capa;
+} point_grid;
+
+static int _grid_coord(double v, double v0, double size, int n) {
+  double c = (v - v0) / size;
+
+  if (!(c >= 0)) return 0;              // also catches NaN
+  if (c >= n)    return n - 1;
+
+  return (int)c;
+}
+
+// x & y are read every stride doubles. Needs the GVL (it allocates).
+static void _grid_build(point_grid *grid,
+                        const double *x, const double *y, int stride,
+                        int n, double size) {
+  double x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+
+  for (int i = 0; i < n; i++) {
+    double px = x[i * stride], py = y[i * stride];
+
+    if (i == 0 || px < x0) x0 = px;
+    if (i == 0 || py < y0) y0 = py;
+    if (i == 0 || px > x1) x1 = px;
+    if (i == 0 || py > y1) y1 = py;
+  }
+
+  if (!(size > 0)) size = 1;
+
+  double w = x1 - x0, h = y1 - y0;
+
+  if (!(w < 1e9) || !(h < 1e9)) w = h = 0; // runaway points share cell 0
+
+  long nx, ny;
+
+  for (;;) {
+    nx = (long)(w / size) + 1;
+    ny = (long)(h / size) + 1;
+    if (nx * ny <= 4L * n + 64) break;
+    size *= 2;
+  }
+
+  long cells = nx * ny;
+
+  if (grid->start_capa < cells + 1) {
+    REALLOC_N(grid->start, int, cells + 1);
+    grid->start_capa = cells + 1;
+  }
+
+  if (grid->capa < n) {
+    REALLOC_N(grid->order,   int, n);
+    REALLOC_N(grid->cell_of, int, n);
+    grid->capa = n;
+  }
+
+  grid->x0   = x0;
+  grid->y0   = y0;
+  grid->size = size;
+  grid->nx   = (int)nx;
+  grid->ny   = (int)ny;
+
+  MEMZERO(grid->start, int, cells + 1);
+
+  for (int i = 0; i < n; i++) {
+    int cx = _grid_coord(x[i * stride], x0, size, grid->nx);
+    int cy = _grid_coord(y[i * stride], y0, size, grid->ny);
+    int c  = cy * grid->nx + cx;
+
+    grid->cell_of[i] = c;
+    grid->start[c + 1]++;
+  }
+
+  for (long c = 0; c < cells; c++)
+    grid->start[c + 1] += grid->start[c];
+
+  // start[c] doubles as the insertion point, then gets put back
+  for (int i = 0; i < n; i++)
+    grid->order[grid->start[grid->cell_of[i]]++] = i;
+
+  for (long c = cells; c > 0; c--)
+    grid->start[c] = grid->start[c - 1];
+  grid->start[0] = 0;
+}
+
+static void _grid_free(point_grid *grid) {
+  xfree(grid->start);
+  xfree(grid->order);
+  xfree(grid->cell_of);
+}
+
+static size_t _grid_memsize(const point_grid *grid) {
+  return (grid->start_capa + 2 * grid->capa) * sizeof(int);
+}
+
+// Calls body for each j in the 3x3 block of cells around point i.
+// Cells are at least as big as the search radius, so that's all of
+// the neighbors.
+#define GRID_EACH_NEIGHBOR(grid, i, j, ...)                             \
+  do {                                                                  \
+    int _c  = (grid)->cell_of[i];                                       \
+    int _cx = _c % (grid)->nx, _cy = _c / (grid)->nx;                   \
+    for (int _y = _cy - 1; _y <= _cy + 1; _y++) {                       \
+      if (_y < 0 || _y >= (grid)->ny) continue;                         \
+      for (int _x = _cx - 1; _x <= _cx + 1; _x++) {                     \
+        if (_x < 0 || _x >= (grid)->nx) continue;                       \
+        int _n = _y * (grid)->nx + _x;                                  \
+        for (int _k = (grid)->start[_n]; _k < (grid)->start[_n + 1]; _k++) { \
+          int j = (grid)->order[_k];                                    \
+          __VA_ARGS__;                                                  \
+        }                                                               \
+      }                                                                 \
+    }                                                                   \
+  } while (0)
+
+// Scanline flood fill. Each popped seed is grown into the whole run of
+// matching pixels on its row, filled, and the runs touching it above
+// and below go on an explicit stack instead of recursing. A bitmap of
+// visited pixels, kept only when the fill color would itself match,
+// means it can't be sent around in circles.
+//
+// Pixels match the seed exactly with no tolerance. With one, every
+// channel has to be within tolerance of the seed's: 1 & 2 byte pixels
+// look that up in a table made per fill, and 3 & 4 byte pixels pick
+// their channels out with the format's masks.
+
+typedef struct {
+  int x, y;
+} flood_seed;
+
+typedef struct {
+  Uint8       *pixels;
+  int          w, h, pitch, bpp;
+  Uint32       fill, target;
+  int          tolerance;
+  const Uint8 *lut;                     // pixel value => matches?, or NULL
+  Uint32       mask[4];                 // r, g, b, a
+  int          shift[4], loss[4];
+  Uint8        want[4];                 // the seed's channels
+  Uint8       *visited;                 // w * h bits
+  flood_seed  *stack;
+  long         capa;
+  long         filled;
+  int          x1, y1, x2, y2;          // bounding box of the fill
+  int          failed;                  // out of memory
+} flood_fill;
+
+#define FLOOD_STACK 1024
+
+static void _flood_masks(flood_fill *f, const Uint32 masks[4]) {
+  for (int i = 0; i < 4; i++) {
+    Uint32 m = masks[i];
+    int shift = 0, bits = 0;
+
+    if (m) {
+      while (!(m >> shift & 1)) shift++;
+      while (m >> (shift + bits) & 1) bits++;
+    }
+
+    f->mask[i]  = m;
+    f->shift[i] = shift;
+    f->loss[i]  = 8 - bits;
+  }
+}
+
+static inline Uint8 _flood_channel(const flood_fill *f, Uint32 p, int i) {
+  if (!f->mask[i]) return 255;          // no alpha is opaque
+
+  return (Uint8)(((p & f->mask[i]) >> f->shift[i]) << f->loss[i]);
+}
+
+static inline int _flood_match(const flood_fill *f, Uint32 p) {
+  if (!f->tolerance) return p == f->target;
+  if (f->lut)        return f->lut[p];
+
+  for (int i = 0; i < 4; i++)
+    if (abs(_flood_channel(f, p, i) - f->want[i]) > f->tolerance)
+      return 0;
+
+  return 1;
+}
+
+static inline int _flood_within(const Uint8 a[4], const Uint8 b[4], int tolerance) {
+  for (int i = 0; i < 4; i++)
+    if (abs(a[i] - b[i]) > tolerance)
+      return 0;
+
+  return 1;
+}
+
+#define FLOOD_GET1(row, x) ((Uint32)(row)[x])
+#define FLOOD_GET2(row, x) ((Uint32)((Uint16*)(row))[x])
+#define FLOOD_GET4(row, x) (((Uint32*)(row))[x])
+#define FLOOD_PUT1(row, x, c) ((row)[x] = (Uint8)(c))
+#define FLOOD_PUT2(row, x, c) (((Uint16*)(row))[x] = (Uint16)(c))
+#define FLOOD_PUT4(row, x, c) (((Uint32*)(row))[x] = (c))
+
+#if SDL_BYTEORDER == SDL_LIL_ENDIAN
+#define FLOOD_GET3(row, x)                                              \
+  ((Uint32)(row)[3*(x)] | (Uint32)(row)[3*(x)+1] << 8 | (Uint32)(row)[3*(x)+2] << 16)
+#define FLOOD_PUT3(row, x, c)                                           \
+  ((row)[3*(x)] = (Uint8)(c), (row)[3*(x)+1] = (Uint8)((c) >> 8),       \
+   (row)[3*(x)+2] = (Uint8)((c) >> 16))
+#else
+#define FLOOD_GET3(row, x)                                              \
+  ((Uint32)(row)[3*(x)] << 16 | (Uint32)(row)[3*(x)+1] << 8 | (Uint32)(row)[3*(x)+2])
+#define FLOOD_PUT3(row, x, c)                                           \
+  ((row)[3*(x)] = (Uint8)((c) >> 16), (row)[3*(x)+1] = (Uint8)((c) >> 8), \
+   (row)[3*(x)+2] = (Uint8)(c))
+#endif
+
+#define FLOOD_SEEN(f, x, y) ((f)->visited[((size_t)(y) * (f)->w + (x)) >> 3] >> (((size_t)(y) * (f)->w + (x)) & 7) & 1)
+#define FLOOD_MARK(f, x, y) ((f)->visited[((size_t)(y) * (f)->w + (x)) >> 3] |= 1 << (((size_t)(y) * (f)->w + (x)) & 7))
+
+#define FLOOD_PUSH(f, n, sx, sy)                                        \
+  do {                                                                  \
+    if ((n) == (f)->capa) {                                             \
+      flood_seed *_s = realloc((f)->stack, 2 * (f)->capa * sizeof(flood_seed)); \
+      if (!_s) { (f)->failed = 1; return; }                             \
+      (f)->stack = _s;                                                  \
+      (f)->capa *= 2;                                                   \
+    }                                                                   \
+    (f)->stack[n].x = (sx);                                             \
+    (f)->stack[n].y = (sy);                                             \
+    (n)++;                                                              \
+  } while (0)
+
+// Exact matches skip _flood_match, and without a visited bitmap the
+// checks against it go away too.
+#define FLOOD_OK(f, row, x, bpp)                                        \
+  ((exact ? FLOOD_GET##bpp(row, x) == target                            \
+          : _flood_match(f, FLOOD_GET##bpp(row, x))) &&                 \
+   !(track && FLOOD_SEEN(f, x, _y)))
+
+#define DEFINE_FLOOD_FILL(bpp)                                          \
+  static void _flood_fill##bpp(flood_fill *f, int sx, int sy) {         \
+    const int    exact  = !f->tolerance, track = f->visited != NULL;    \
+    const Uint32 target = f->target, fill = f->fill;                    \
+    long n = 0;                                                         \
+                                                                        \
+    FLOOD_PUSH(f, n, sx, sy);                                           \
+                                                                        \
+    while (n) {                                                         \
+      flood_seed s = f->stack[--n];                                     \
+      int _y = s.y, l = s.x, r = s.x;                                   \
+      Uint8 *row = f->pixels + (size_t)_y * f->pitch;                   \
+                                                                        \
+      if (!FLOOD_OK(f, row, l, bpp)) continue;                          \
+                                                                        \
+      while (l > 0        && FLOOD_OK(f, row, l - 1, bpp)) l--;         \
+      while (r < f->w - 1 && FLOOD_OK(f, row, r + 1, bpp)) r++;         \
+                                                                        \
+      for (int x = l; x <= r; x++)                                      \
+        FLOOD_PUT##bpp(row, x, fill);                                   \
+      if (track)                                                        \
+        for (int x = l; x <= r; x++)                                    \
+          FLOOD_MARK(f, x, _y);                                         \
+                                                                        \
+      f->filled += r - l + 1;                                           \
+      if (l < f->x1)   f->x1 = l;                                       \
+      if (r >= f->x2)  f->x2 = r + 1;                                   \
+      if (_y < f->y1)  f->y1 = _y;                                      \
+      if (_y >= f->y2) f->y2 = _y + 1;                                  \
+                                                                        \
+      for (int ny = s.y - 1; ny <= s.y + 1; ny += 2) {                  \
+        if (ny < 0 || ny >= f->h) continue;                             \
+                                                                        \
+        Uint8 *next = f->pixels + (size_t)ny * f->pitch;                \
+        int in_run = 0;                                                 \
+                                                                        \
+        _y = ny;                                                        \
+        for (int x = l; x <= r; x++) {                                  \
+          int ok = FLOOD_OK(f, next, x, bpp);                           \
+                                                                        \
+          if (ok && !in_run) FLOOD_PUSH(f, n, x, ny);                   \
+          in_run = ok;                                                  \
+        }                                                               \
+      }                                                                 \
+    }                                                                   \
+  }
+
+DEFINE_FLOOD_FILL(1)
+DEFINE_FLOOD_FILL(2)
+DEFINE_FLOOD_FILL(3)
+DEFINE_FLOOD_FILL(4)
+
+typedef struct {
+  flood_fill *f;
+  int         x, y;
+} flood_run;
+
+static void* _flood_fill_without_gvl(void *data) {
+  flood_run  *run = data;
+  flood_fill *f   = run->f;
+
+  switch (f->bpp) {
+  case 1: _flood_fill1(f, run->x, run->y); break;
+  case 2: _flood_fill2(f, run->x, run->y); break;
+  case 3: _flood_fill3(f, run->x, run->y); break;
+  case 4: _flood_fill4(f, run->x, run->y); break;
+  }
+
+  return NULL;
+}
+
+// Fills from x, y, which has to be in bounds. f needs its pixels,
+// sizes, colors, and matching set up. Returns the number of pixels
+// filled, or -1 if it ran out of memory. Doesn't raise, so callers
+// can unlock whatever they're filling first.
+
+static long _flood_fill(flood_fill *f, int x, int y) {
+  // filled pixels stop matching, unless the fill color matches too
+  int track  = _flood_match(f, f->fill);
+
+  f->visited = track ? calloc(((size_t)f->w * f->h + 7) / 8, 1) : NULL;
+  f->stack   = malloc(FLOOD_STACK * sizeof(flood_seed));
+  f->capa    = FLOOD_STACK;
+  f->filled  = 0;
+  f->failed  = (track && !f->visited) || !f->stack;
+  f->x1      = f->w;
+  f->y1      = f->h;
+  f->x2      = f->y2 = 0;
+
+  if (!f->failed) {
+    flood_run run = { f, x, y };
+
+    rb_thread_call_without_gvl(_flood_fill_without_gvl, &run, NULL, NULL);
+  }
+
+  free(f->stack);
+  free(f->visited);
+
+  return f->failed ? -1 : f->filled;
+}
+
+static int _flood_tolerance(VALUE opts) {
+  ID id = rb_intern("tolerance");
+  VALUE tolerance = Qundef;
+
+  if (!NIL_P(opts))
+    rb_get_kwargs(opts, &id, 0, 1, &tolerance);
+
+  int t = tolerance == Qundef ? 0 : NUM2INT(tolerance);
+
+  if (t < 0 || t > 255)
+    rb_raise(rb_eArgError, "tolerance must be 0-255, not %d", t);
+
+  return t;
+}
+
 //// SDL methods:
 
 static VALUE sdl_s_init(VALUE mod, VALUE flags) {
@@ -150,8 +687,7 @@ static VALUE sdl_s_init(VALUE mod, VALUE flags) {
 
 static void sdl__quit(VALUE v) {
   UNUSED(v);
-  if (is_quit) return;
-  is_quit = 1;
+  if (!SDL_AtomicCAS(&quitting, 0, 1)) return;
 
   TTF_Quit();
   SDL_Quit();
@@ -213,6 +749,363 @@ static VALUE Audio_play(VALUE self) {
   return Qnil;
 }
 
+//// SDL::Bundle methods:
+
+// A bundle is a header, the entries' data (each 64 byte aligned so
+// image pixels can be used in place), then an index. Everything is
+// little endian. See lib/graphics/bundle.rb for the writer.
+//
+//   header: "GFXBNDL\0" u32 version u32 count u64 index_offset
+//   index:  u16 name_len u8 kind u8 flags u32 w u32 h u32 reserved
+//           u64 offset u64 size u64 raw_size, then the name
+
+#define BUNDLE_MAGIC      "GFXBNDL"
+#define BUNDLE_VERSION    1
+#define BUNDLE_HEADER     24
+#define BUNDLE_RECORD     40
+#define BUNDLE_LZ4        1
+
+typedef enum {
+  BUNDLE_IMAGE = 1,
+  BUNDLE_MASK  = 2,
+  BUNDLE_FONT  = 3,
+  BUNDLE_SOUND = 4,
+} bundle_kind;
+
+typedef struct {
+  const char *name;
+  Uint16      name_len;
+  Uint8       kind, flags;
+  Uint32      w, h;
+  Uint64      offset, size, raw_size;
+} bundle_entry;
+
+struct SDL_Bundle {
+  Uint8        *data;
+  size_t        size;
+  int           mapped;                 // munmap, else xfree
+  Uint32        count;
+  bundle_entry *entries;
+};
+
+static void _Bundle_free(void* p) {
+  SDL_Bundle *bundle = p;
+
+  if (!bundle) return;
+
+#ifdef HAVE_SYS_MMAN_H
+  if (bundle->mapped)
+    munmap(bundle->data, bundle->size);
+  else
+#endif
+    xfree(bundle->data);
+
+  xfree(bundle->entries);
+  xfree(bundle);
+}
+
+static void _Bundle_mark(void* p) {
+  UNUSED(p);
+}
+
+static size_t _Bundle_memsize(const void *p) {
+  const SDL_Bundle *bundle = p;
+
+  if (!bundle) return 0;
+
+  // mapped pages belong to the page cache, not to us
+  return sizeof(SDL_Bundle) + bundle->count * sizeof(bundle_entry) +
+    (bundle->mapped ? 0 : bundle->size);
+}
+
+// Collision maps that point into a bundle rather than owning their bits.
+static void _Bundle_cmap_free(void* p) {
+  xfree(p);
+}
+
+static size_t _Bundle_cmap_memsize(const void *p) {
+  return p ? sizeof(sge_cdata) : 0;
+}
+
+static const rb_data_type_t _Bundle_cmap_type = {
+  "SDL::CollisionMap (bundled)",
+  { NULL, _Bundle_cmap_free, _Bundle_cmap_memsize, { NULL, NULL }, },
+  &_CollisionMap_type, NULL,
+};
+
+static Uint64 _Bundle_le(const Uint8 *p, int n) {
+  Uint64 v = 0;
+
+  while (n--)
+    v = (v << 8) | p[n];
+
+  return v;
+}
+
+static int _Bundle_parse(SDL_Bundle *bundle) {
+  const Uint8 *p = bundle->data;
+  size_t size    = bundle->size;
+
+  if (size < BUNDLE_HEADER || memcmp(p, BUNDLE_MAGIC, 8))
+    return 0;
+  if (_Bundle_le(p + 8, 4) != BUNDLE_VERSION)
+    return 0;
+
+  Uint32 count = (Uint32)_Bundle_le(p + 12, 4);
+  Uint64 pos   = _Bundle_le(p + 16, 8);
+
+  if (count > (size - BUNDLE_HEADER) / BUNDLE_RECORD)
+    return 0;
+
+  bundle->entries = ZALLOC_N(bundle_entry, count);
+
+  for (Uint32 i = 0; i < count; i++) {
+    bundle_entry *e = &bundle->entries[i];
+
+    if (pos > size || size - pos < BUNDLE_RECORD)
+      return 0;
+
+    const Uint8 *r = p + pos;
+
+    e->name_len = (Uint16)_Bundle_le(r, 2);
+    e->kind     = r[2];
+    e->flags    = r[3];
+    e->w        = (Uint32)_Bundle_le(r + 4, 4);
+    e->h        = (Uint32)_Bundle_le(r + 8, 4);
+    e->offset   = _Bundle_le(r + 16, 8);
+    e->size     = _Bundle_le(r + 24, 8);
+    e->raw_size = _Bundle_le(r + 32, 8);
+    e->name     = (const char*)r + BUNDLE_RECORD;
+
+    pos += BUNDLE_RECORD + e->name_len;
+
+    if (pos > size || e->offset > size || e->size > size - e->offset)
+      return 0;
+    if (e->size > INT_MAX || e->raw_size > INT_MAX)
+      return 0;
+
+    switch (e->kind) {
+    case BUNDLE_IMAGE:
+      if (e->w > 0x7fff || e->h > 0x7fff ||
+          e->raw_size != (Uint64)4 * e->w * e->h ||
+          (!(e->flags & BUNDLE_LZ4) && e->size != e->raw_size))
+        return 0;
+      if (!(e->flags & BUNDLE_LZ4) && (e->offset & 3))
+        return 0;
+      break;
+    case BUNDLE_MASK:
+      if (e->w > 0x7fff || e->h > 0x7fff ||
+          e->size < (Uint64)e->w * e->h / 8 + 2)
+        return 0;
+      break;
+    }
+
+    bundle->count = i + 1;
+  }
+
+  return 1;
+}
+
+static const bundle_entry *_Bundle_find(SDL_Bundle *bundle, bundle_kind kind,
+                                        VALUE name) {
+  ExportStringValue(name);
+
+  const char *s = RSTRING_PTR(name);
+  long len      = RSTRING_LEN(name);
+
+  for (Uint32 i = 0; i < bundle->count; i++) {
+    const bundle_entry *e = &bundle->entries[i];
+
+    if (e->kind == kind && e->name_len == len && !memcmp(e->name, s, len))
+      return e;
+  }
+
+  rb_raise(rb_eKeyError, "%"PRIsVALUE" isn't in the bundle", name);
+}
+
+static VALUE Bundle_s_open(VALUE klass, VALUE path) {
+  UNUSED(klass);
+  SDL_Bundle *bundle;
+
+  ExportStringValue(path);
+
+  VALUE vbundle = TypedData_Make_Struct(cBundle, SDL_Bundle, &_Bundle_type, bundle);
+
+#ifdef HAVE_SYS_MMAN_H
+  int fd = open(RSTRING_PTR(path), O_RDONLY);
+  struct stat st;
+
+  if (fd < 0)
+    rb_sys_fail_str(path);
+
+  if (fstat(fd, &st) || st.st_size < BUNDLE_HEADER) {
+    close(fd);
+    rb_raise(eSDLError, "%"PRIsVALUE" isn't a graphics bundle", path);
+  }
+
+  // Private and writable, so drawing on a bundled surface copies the
+  // page instead of faulting (or scribbling on the file).
+  void *data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (data == MAP_FAILED)
+    rb_sys_fail_str(path);
+
+  bundle->data   = data;
+  bundle->size   = st.st_size;
+  bundle->mapped = 1;
+#else
+  SDL_RWops *rw = SDL_RWFromFile(RSTRING_PTR(path), "rb");
+  if (!rw)
+    FAILURE("Bundle.open");
+
+  Sint64 size = SDL_RWsize(rw);
+  if (size < BUNDLE_HEADER) {
+    SDL_RWclose(rw);
+    rb_raise(eSDLError, "%"PRIsVALUE" isn't a graphics bundle", path);
+  }
+
+  bundle->data = ALLOC_N(Uint8, size);
+  bundle->size = size;
+
+  size_t n = SDL_RWread(rw, bundle->data, 1, size);
+  SDL_RWclose(rw);
+
+  if (n != (size_t)size)
+    FAILURE("Bundle.open");
+#endif
+
+  if (!_Bundle_parse(bundle))
+    rb_raise(eSDLError, "%"PRIsVALUE" isn't a graphics bundle", path);
+
+  return vbundle;
+}
+
+static VALUE Bundle_names(VALUE self) {
+  DEFINE_SELF(Bundle, bundle, self);
+
+  VALUE names = rb_ary_new();
+
+  for (Uint32 i = 0; i < bundle->count; i++) {
+    const bundle_entry *e = &bundle->entries[i];
+
+    if (e->kind == BUNDLE_IMAGE || e->kind == BUNDLE_FONT || e->kind == BUNDLE_SOUND)
+      rb_ary_push(names, rb_str_new(e->name, e->name_len));
+  }
+
+  return names;
+}
+
+static VALUE Bundle_image(VALUE self, VALUE name) {
+  DEFINE_SELF(Bundle, bundle, self);
+
+  const bundle_entry *e = _Bundle_find(bundle, BUNDLE_IMAGE, name);
+  Uint8 *data = bundle->data + e->offset;
+  SDL_Surface *surface;
+
+  if (e->flags & BUNDLE_LZ4) {
+#ifdef HAVE_LZ4_H
+    surface = SDL_CreateRGBSurfaceWithFormat(0, e->w, e->h, 32,
+                                             SDL_PIXELFORMAT_RGBA32);
+    if (!surface)
+      FAILURE("Bundle#image(CreateRGBSurfaceWithFormat)");
+
+    if (LZ4_decompress_safe((const char*)data, surface->pixels,
+                            (int)e->size, (int)e->raw_size) != (int)e->raw_size) {
+      SDL_FreeSurface(surface);
+      rb_raise(eSDLError, "%"PRIsVALUE" is corrupt", name);
+    }
+
+    return _Surface_wrap(surface);
+#else
+    rb_raise(eSDLError, "%"PRIsVALUE" is LZ4 compressed, but graphics was built without LZ4", name);
+#endif
+  }
+
+  // No decode and no copy: the pixels are the mapping.
+  surface = SDL_CreateRGBSurfaceWithFormatFrom(data, e->w, e->h, 32, 4 * e->w,
+                                               SDL_PIXELFORMAT_RGBA32);
+  if (!surface)
+    FAILURE("Bundle#image(CreateRGBSurfaceWithFormatFrom)");
+
+  VALUE vsurface = _Surface_wrap(surface);
+  rb_ivar_set(vsurface, id_iv_bundle, self);
+
+  return vsurface;
+}
+
+static VALUE Bundle_collision_map(VALUE self, VALUE name) {
+  DEFINE_SELF(Bundle, bundle, self);
+
+  const bundle_entry *e = _Bundle_find(bundle, BUNDLE_MASK, name);
+  sge_cdata *cdata = ALLOC(sge_cdata);
+
+  cdata->map = bundle->data + e->offset;
+  cdata->w   = e->w;
+  cdata->h   = e->h;
+
+  VALUE vcmap = TypedData_Wrap_Struct(cCollisionMap, &_Bundle_cmap_type, cdata);
+  rb_ivar_set(vcmap, id_iv_bundle, self);
+
+  return vcmap;
+}
+
+static VALUE Bundle_font(VALUE self, VALUE name, VALUE size) {
+  DEFINE_SELF(Bundle, bundle, self);
+
+  const bundle_entry *e = _Bundle_find(bundle, BUNDLE_FONT, name);
+
+  // SDL_ttf reads glyphs out of the file as it goes, so the font
+  // keeps the bundle alive.
+  SDL_RWops *rw = SDL_RWFromConstMem(bundle->data + e->offset, (int)e->size);
+  TTF_Font *font = rw ? TTF_OpenFontRW(rw, 1, NUM2UINT16(size)) : NULL;
+
+  if (!font)
+    TTF_FAILURE("Bundle#font");
+
+  VALUE vfont = TypedData_Wrap_Struct(cTTFFont, &_TTFFont_type, font);
+  rb_ivar_set(vfont, id_iv_bundle, self);
+
+  return vfont;
+}
+
+static VALUE Bundle_sound(VALUE self, VALUE name) {
+  DEFINE_SELF(Bundle, bundle, self);
+
+  const bundle_entry *e = _Bundle_find(bundle, BUNDLE_SOUND, name);
+
+  SDL_RWops *rw = SDL_RWFromConstMem(bundle->data + e->offset, (int)e->size);
+  Mix_Chunk *chunk = rw ? Mix_LoadWAV_RW(rw, 1) : NULL;
+
+  if (!chunk)
+    AUDIO_FAILURE("Bundle#sound");
+
+  return TypedData_Wrap_Struct(cAudio, &_Audio_type, chunk);
+}
+
+#ifdef HAVE_LZ4_H
+static VALUE Bundle_s_compress(VALUE klass, VALUE str) {
+  UNUSED(klass);
+
+  ExportStringValue(str);
+
+  if (RSTRING_LEN(str) > LZ4_MAX_INPUT_SIZE)
+    rb_raise(rb_eArgError, "too big to compress");
+
+  int len   = (int)RSTRING_LEN(str);
+  VALUE out = rb_str_new(NULL, LZ4_compressBound(len));
+  int n     = LZ4_compress_default(RSTRING_PTR(str), RSTRING_PTR(out),
+                                   len, (int)RSTRING_LEN(out));
+
+  if (n <= 0)
+    rb_raise(eSDLError, "LZ4 compression failed");
+
+  rb_str_set_len(out, n);
+
+  return out;
+}
+#endif
+
 //// SDL::CollisionMap methods:
 
 static void _CollisionMap_free(void* p) {
@@ -235,22 +1128,35 @@ static VALUE CollisionMap_check(VALUE cmap1, VALUE x1, VALUE y1,
   DEFINE_SELF(CollisionMap, cdata1, cmap1);
   DEFINE_SELF(CollisionMap, cdata2, cmap2);
 
-  if(!sge_cmcheck(cdata1, NUM2SINT16(x1), NUM2SINT16(y1),
-                  cdata2, NUM2SINT16(x2), NUM2SINT16(y2)))
+  Sint16 sx1 = NUM2SINT16(x1), sy1 = NUM2SINT16(y1);
+  Sint16 sx2 = NUM2SINT16(x2), sy2 = NUM2SINT16(y2);
+  Sint16 cx = 0, cy = 0;
+
+  SDL_LockMutex(collision_lock);
+  int hit = sge_cmcheck(cdata1, sx1, sy1, cdata2, sx2, sy2);
+  if (hit) {
+    cx = sge_get_cx();
+    cy = sge_get_cy();
+  }
+  SDL_UnlockMutex(collision_lock);
+
+  if (!hit)
     return Qnil;
 
-  return rb_ary_new3(2, INT2NUM(sge_get_cx()), INT2NUM(sge_get_cy()));
+  return rb_ary_new3(2, INT2NUM(cx), INT2NUM(cy));
 }
 
-//// SDL::Event methods:
+static VALUE CollisionMap_dump(VALUE self) {
+  DEFINE_SELF(CollisionMap, cdata, self);
 
-static VALUE Event_s_poll(VALUE self) {
-  UNUSED(self);
-  SDL_Event event;
+  size_t len = (size_t)cdata->w * cdata->h / 8 + 2; // see sge_make_cmap
 
-  return SDL_PollEvent(&event) == 1 ? event_creators[event.type](&event) : Qnil;
+  return rb_ary_new3(3, INT2NUM(cdata->w), INT2NUM(cdata->h),
+                     rb_str_new((const char*)cdata->map, len));
 }
 
+//// SDL::Event methods:
+
 static VALUE Event__null(SDL_Event *event) {
   UNUSED(event);
   return Qnil;
@@ -309,764 +1215,6124 @@ static VALUE Event__mouseup(SDL_Event *event) {
   return __new_mouse_event(cEventMouseup, event);
 }
 
-//// SDL::Key methods:
+// A switch instead of a table filled in by Init_sdl: no global state
+// to share between ractors.
+static event_creator _Event_creator(Uint32 type) {
+  switch (type) {
+  // case SDL_ACTIVEEVENT:     return Event__active;
+  case SDL_KEYDOWN:         return Event__keydown;
+  case SDL_KEYUP:           return Event__keyup;
+  case SDL_MOUSEMOTION:     return Event__mousemove;
+  case SDL_MOUSEBUTTONDOWN: return Event__mousedown;
+  case SDL_MOUSEBUTTONUP:   return Event__mouseup;
+  case SDL_QUIT:            return Event__quit;
+  // case SDL_SYSWMEVENT:      return Event__syswm;
+  // case SDL_VIDEORESIZE:     return Event__videoresize;
+  default:                  return Event__null;
+  }
+}
 
-static VALUE Key_s_press_p(VALUE mod, VALUE keycode_) {
-  UNUSED(mod);
+static VALUE Event_s_poll(VALUE self) {
+  UNUSED(self);
+  SDL_Event event;
+
+  return SDL_PollEvent(&event) == 1 ? _Event_creator(event.type)(&event) : Qnil;
+}
 
-  if (!key_state)
-    rb_raise(eSDLError,
-             "You should call SDL::Key#scan before calling SDL::Key#press?");
+static void _Event_push(VALUE events, SDL_Event *event) {
+  VALUE obj = _Event_creator(event->type)(event);
 
-  SDL_Keycode keycode   = NUM2INT(keycode_);
-  SDL_Scancode scancode = SDL_GetScancodeFromKey(keycode);
+  if (!NIL_P(obj))
+    rb_ary_push(events, rb_obj_freeze(obj));
+}
 
-  if (0 >= scancode || scancode >= key_state_len)
-    rb_raise(eSDLError, "%d (%d) is out of bounds: %d",
-             keycode, scancode, key_state_len);
+#define EVENT_BATCH 64
 
-  return INT2BOOL(key_state[scancode]);
+static VALUE Event_s_drain(int argc, VALUE *argv, VALUE self) {
+  UNUSED(self);
+  VALUE coalesce_;
+  SDL_Event batch[EVENT_BATCH];
+  SDL_Event motion;
+  int have_motion = 0;
+  int n;
+
+  rb_scan_args(argc, argv, "01", &coalesce_);
+
+  int coalesce = NIL_P(coalesce_) || RTEST(coalesce_);
+  VALUE events = rb_ary_new();
+
+  SDL_PumpEvents();
+
+  while ((n = SDL_PeepEvents(batch, EVENT_BATCH, SDL_GETEVENT,
+                             SDL_FIRSTEVENT, SDL_LASTEVENT)) > 0) {
+    for (int i = 0; i < n; i++) {
+      SDL_Event *event = &batch[i];
+
+      // A run of motion events becomes the last one, moved by all of them.
+      if (coalesce && event->type == SDL_MOUSEMOTION) {
+        if (have_motion &&
+            motion.motion.windowID == event->motion.windowID &&
+            motion.motion.which    == event->motion.which) {
+          int xrel = motion.motion.xrel + event->motion.xrel;
+          int yrel = motion.motion.yrel + event->motion.yrel;
+
+          motion = *event;
+          motion.motion.xrel = xrel;
+          motion.motion.yrel = yrel;
+        } else {
+          if (have_motion) _Event_push(events, &motion);
+          motion      = *event;
+          have_motion = 1;
+        }
+        continue;
+      }
+
+      if (have_motion) {
+        _Event_push(events, &motion);
+        have_motion = 0;
+      }
+
+      _Event_push(events, event);
+    }
+  }
+
+  if (have_motion)
+    _Event_push(events, &motion);
+
+  if (n < 0)
+    FAILURE("Event.drain");
+
+  return events;
 }
 
-static VALUE Key_s_scan(VALUE mod) {
-  UNUSED(mod);
+//// SDL::Framebuffer methods:
+
+// A CPU-side canvas backed by a streaming texture. Writes only touch
+// memory; the rectangle around everything changed goes up in one
+// texture update per draw.
+//
+// Cells are either RGBA32 pixels or, for indexed framebuffers, 8 or 16
+// bit palette indices that get expanded through the palette as they
+// are uploaded. Swapping the palette re-expands everything, so palette
+// animation costs one upload and no drawing.
+
+struct SDL_Framebuffer {
+  VALUE        renderer;                // keeps the texture's renderer alive
+  SDL_Texture *texture;
+  void        *cells;                   // w * h cells of cell_size bytes
+  Uint32      *palette;                 // 1 << bits colors, or NULL
+  int          w, h;
+  int          bits;                    // 0 for RGBA32, 8 or 16 for indexed
+  int          dirty_x1, dirty_y1;      // [x1, x2) x [y1, y2) needs uploading
+  int          dirty_x2, dirty_y2;
+};
+
+#define FB_CELL_SIZE(fb) ((fb)->bits ? (size_t)(fb)->bits / 8 : sizeof(Uint32))
+#define FB_ROW(fb, y)    ((Uint8*)(fb)->cells + (size_t)(y) * (fb)->w * FB_CELL_SIZE(fb))
+
+static void _Framebuffer_free(void* p) {
+  SDL_Framebuffer *fb = p;
+
+  if (!fb) return;
+
+  if (!is_quit && fb->texture)
+    SDL_DestroyTexture(fb->texture);
+
+  xfree(fb->cells);
+  xfree(fb->palette);
+  xfree(fb);
+}
 
-  key_state = (Uint8 *) SDL_GetKeyboardState(&key_state_len);
-  mod_state = SDL_GetModState();
+static void _Framebuffer_mark(void* p) {
+  SDL_Framebuffer *fb = p;
 
-  return Qnil;
+  if (fb) rb_gc_mark(fb->renderer);
 }
 
-//// SDL::Mouse methods:
+static size_t _Framebuffer_memsize(const void *p) {
+  const SDL_Framebuffer *fb = p;
 
-static VALUE Mouse_s_state(VALUE mod) {
-  UNUSED(mod);
+  if (!fb) return 0;
 
-  int x,y;
-  Uint8 result = SDL_GetMouseState(&x, &y);
+  return (sizeof(SDL_Framebuffer)
+          + FB_CELL_SIZE(fb) * fb->w * fb->h
+          + (fb->bits ? sizeof(Uint32) << fb->bits : 0));
+}
 
-  return rb_ary_new3(5,
-                     INT2FIX(x),
-                     INT2FIX(y),
-                     INT2BOOL(result&SDL_BUTTON_LMASK),
-                     INT2BOOL(result&SDL_BUTTON_MMASK),
-                     INT2BOOL(result&SDL_BUTTON_RMASK));
+static void _Framebuffer_dirty(SDL_Framebuffer *fb,
+                              int x1, int y1, int x2, int y2) {
+  if (x1 < fb->dirty_x1) fb->dirty_x1 = x1;
+  if (y1 < fb->dirty_y1) fb->dirty_y1 = y1;
+  if (x2 > fb->dirty_x2) fb->dirty_x2 = x2;
+  if (y2 > fb->dirty_y2) fb->dirty_y2 = y2;
 }
 
+static void _Framebuffer_dirty_all(SDL_Framebuffer *fb) {
+  _Framebuffer_dirty(fb, 0, 0, fb->w, fb->h);
+}
 
-//// SDL::PixelFormat methods:
+static void _Framebuffer_expand8(const Uint8 *src, Uint32 *dst, int n,
+                                 const Uint32 *lut) {
+  int i = 0;
 
-static void _PixelFormat_free(void* p) {
-  if (is_quit) return;
-  if (!p) return;
-
-  SDL_FreeFormat(p);
+  for (; i + 4 <= n; i += 4) {
+    dst[i+0] = lut[src[i+0]];
+    dst[i+1] = lut[src[i+1]];
+    dst[i+2] = lut[src[i+2]];
+    dst[i+3] = lut[src[i+3]];
+  }
+  for (; i < n; i++)
+    dst[i] = lut[src[i]];
 }
 
-static void _PixelFormat_mark(void* p) {
-  UNUSED(p);
-}
+static void _Framebuffer_expand16(const Uint16 *src, Uint32 *dst, int n,
+                                  const Uint32 *lut) {
+  int i = 0;
 
-static size_t _PixelFormat_memsize(const void *p) {
-  return p ? sizeof(struct SDL_PixelFormat) : 0;
+  for (; i + 4 <= n; i += 4) {
+    dst[i+0] = lut[src[i+0]];
+    dst[i+1] = lut[src[i+1]];
+    dst[i+2] = lut[src[i+2]];
+    dst[i+3] = lut[src[i+3]];
+  }
+  for (; i < n; i++)
+    dst[i] = lut[src[i]];
 }
 
-static VALUE PixelFormat_map_rgba(VALUE self, VALUE r, VALUE g, VALUE b, VALUE a) {
-  DEFINE_SELF(PixelFormat, format, self);
+static void _Framebuffer_upload(SDL_Framebuffer *fb) {
+  if (fb->dirty_x1 >= fb->dirty_x2 || fb->dirty_y1 >= fb->dirty_y2) return;
 
-  return UINT2NUM(SDL_MapRGBA(format,
-                              NUM2UINT8(r), NUM2UINT8(g),
-                              NUM2UINT8(b), NUM2UINT8(a)));
-}
+  int x1 = fb->dirty_x1, y1 = fb->dirty_y1;
+  SDL_Rect rect = { x1, y1, fb->dirty_x2 - x1, fb->dirty_y2 - y1 };
+  size_t skip = FB_CELL_SIZE(fb) * x1;
 
-static VALUE PixelFormat_get_rgba(VALUE self, VALUE pixel) {
-  DEFINE_SELF(PixelFormat, format, self);
-  Uint8 r, g, b, a;
+  if (!fb->bits) {
+    if (SDL_UpdateTexture(fb->texture, &rect, FB_ROW(fb, y1) + skip,
+                          (int)sizeof(Uint32) * fb->w))
+      FAILURE("Framebuffer#upload");
+  } else {
+    void *dst;
+    int pitch;
 
-  SDL_GetRGBA(NUM2UINT(pixel), format, &r, &g, &b, &a);
+    if (SDL_LockTexture(fb->texture, &rect, &dst, &pitch))
+      FAILURE("Framebuffer#upload(LockTexture)");
 
-  return rb_ary_new3(4, UINT2NUM(r), UINT2NUM(g), UINT2NUM(b), UINT2NUM(a));
+    for (int y = y1; y < fb->dirty_y2; y++) {
+      Uint32 *out = (Uint32*)((Uint8*)dst + (size_t)(y - y1) * pitch);
+      Uint8  *in  = FB_ROW(fb, y) + skip;
+
+      if (fb->bits == 8)
+        _Framebuffer_expand8(in, out, rect.w, fb->palette);
+      else
+        _Framebuffer_expand16((Uint16*)in, out, rect.w, fb->palette);
+    }
+
+    SDL_UnlockTexture(fb->texture);
+  }
+
+  fb->dirty_x1 = fb->w;
+  fb->dirty_y1 = fb->h;
+  fb->dirty_x2 = fb->dirty_y2 = 0;
 }
 
-//// SDL::Screen methods:
+static VALUE _Framebuffer_new(VALUE renderer_, VALUE w_, VALUE h_, int bits) {
+  DEFINE_SELF(Renderer, renderer, renderer_);
+  SDL_Framebuffer *fb;
 
-static VALUE Screen_s_open(VALUE klass, VALUE w_, VALUE h_, VALUE bpp_, VALUE flags_) {
-  UNUSED(klass);
+  int w = NUM2INT(w_);
+  int h = NUM2INT(h_);
 
-  int w        = NUM2INT(w_);
-  int h        = NUM2INT(h_);
-  int bpp      = NUM2INT(bpp_);
-  Uint32 flags = NUM2UINT32(flags_);
+  if (w <= 0 || h <= 0)
+    rb_raise(rb_eArgError, "bad framebuffer size %dx%d", w, h);
 
-  if (!bpp) bpp = 32; // TODO: remove bpp option and always be 32?
+  VALUE vfb = TypedData_Make_Struct(cFramebuffer, SDL_Framebuffer,
+                                    &_Framebuffer_type, fb);
 
-  SDL_Window *window =
-    SDL_CreateWindow("", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
-                     w, h,
-                     flags);
-  if (!window) FAILURE("Screen.open(CreateWindow)");
+  fb->renderer = renderer_;
+  fb->w        = w;
+  fb->h        = h;
+  fb->bits     = bits;
+  fb->dirty_x1 = fb->dirty_y1 = 0;
+  fb->dirty_x2 = w;
+  fb->dirty_y2 = h;
+  fb->cells    = ruby_xcalloc((size_t)w * h, FB_CELL_SIZE(fb));
+  if (bits)
+    fb->palette = ZALLOC_N(Uint32, (size_t)1 << bits);
 
-  SDL_Renderer *renderer =
-    SDL_CreateRenderer(window, -1,
-                       SDL_RENDERER_PRESENTVSYNC|SDL_RENDERER_ACCELERATED);
-  if (!renderer) FAILURE("Screen.open(CreateRenderer)");
+  fb->texture  = SDL_CreateTexture(renderer,
+                                   SDL_PIXELFORMAT_RGBA32,
+                                   SDL_TEXTUREACCESS_STREAMING,
+                                   w, h);
+  if (!fb->texture)
+    FAILURE("Renderer#new_framebuffer(CreateTexture)");
 
-  // bumps the refcount and returns the same thing
-  SDL_PixelFormat *format = SDL_AllocFormat(SDL_PIXELFORMAT_RGBA32);
-  if (!format)
-    rb_raise(eSDLError, "SDL_AllocFormat freaked out.");
+  if (SDL_SetTextureScaleMode(fb->texture, SDL_ScaleModeNearest))
+    FAILURE("Renderer#new_framebuffer(SetTextureScaleMode)");
 
-  VALUE vrenderer = TypedData_Wrap_Struct(cRenderer, &_Renderer_type, renderer);
-  VALUE vwindow   = TypedData_Wrap_Struct(cWindow,   &_Window_type,   window);
-  VALUE vformat   = TypedData_Wrap_Struct(cPixelFormat, &_PixelFormat_type, format);
+  if (SDL_SetTextureBlendMode(fb->texture, SDL_BLENDMODE_BLEND))
+    FAILURE("Renderer#new_framebuffer(SetTextureBlendMode)");
 
-  rb_ivar_set(vrenderer, id_iv_window,  vwindow);
-  rb_ivar_set(vrenderer, id_iv_format,  vformat);
+  return vfb;
+}
 
-  return vrenderer;
+static VALUE Renderer_new_framebuffer(VALUE self, VALUE w, VALUE h) {
+  return _Framebuffer_new(self, w, h, 0);
 }
 
-static VALUE Renderer_new_texture(VALUE self) {
+static VALUE Renderer_new_indexed_framebuffer(VALUE self,
+                                              VALUE w, VALUE h,
+                                              VALUE bits_) {
+  int bits = NUM2INT(bits_);
+
+  if (bits != 8 && bits != 16)
+    rb_raise(rb_eArgError, "indexed framebuffers are 8 or 16 bits, not %d", bits);
+
+  return _Framebuffer_new(self, w, h, bits);
+}
+
+static VALUE Renderer_draw_framebuffer(VALUE self, VALUE fb_, VALUE flip) {
   DEFINE_SELF(Renderer, renderer, self);
+  DEFINE_SELF(Framebuffer, fb, fb_);
 
-  int w, h;
-  if (SDL_GetRendererOutputSize(renderer, &w, &h))
-    FAILURE("Renderer#new_texture(GetRendererOutputSize");
+  _Framebuffer_upload(fb);
 
-  SDL_Texture *texture = SDL_CreateTexture(renderer,
-                                           SDL_PIXELFORMAT_RGBA32,
-                                           SDL_TEXTUREACCESS_TARGET,
-                                           w, h);
-  if (!texture)
-    FAILURE("Renderer#new_texture(CreateTexture)");
+  if (SDL_RenderCopyEx(renderer, fb->texture, NULL, NULL, 0, NULL,
+                       RTEST(flip) ? SDL_FLIP_VERTICAL : SDL_FLIP_NONE))
+    FAILURE("Renderer#draw_framebuffer");
 
-  return TypedData_Wrap_Struct(cTexture, &_Texture_type, texture);
+  return Qnil;
 }
 
+// Only what changed since the last upload, 1:1 at the same place on
+// the target, so the rest of the target keeps whatever was drawn there.
 
-static VALUE Renderer_present(VALUE self) {
+static VALUE Renderer_draw_framebuffer_changes(VALUE self, VALUE fb_) {
   DEFINE_SELF(Renderer, renderer, self);
+  DEFINE_SELF(Framebuffer, fb, fb_);
 
-  SDL_RenderPresent(renderer);
+  if (fb->dirty_x1 >= fb->dirty_x2 || fb->dirty_y1 >= fb->dirty_y2)
+    return Qnil;
+
+  SDL_Rect rect = { fb->dirty_x1, fb->dirty_y1,
+                    fb->dirty_x2 - fb->dirty_x1, fb->dirty_y2 - fb->dirty_y1 };
+
+  _Framebuffer_upload(fb);
+
+  if (SDL_RenderCopy(renderer, fb->texture, &rect, &rect))
+    FAILURE("Renderer#draw_framebuffer_changes");
 
   return Qnil;
 }
 
-//// SDL::Surface methods:
+static VALUE Framebuffer_w(VALUE self) {
+  DEFINE_SELF(Framebuffer, fb, self);
 
-static void _Surface_free(void* surface) {
-  if (is_quit) return;
-  if (surface) SDL_FreeSurface(surface);
+  return INT2NUM(fb->w);
 }
 
-static void _Surface_mark(void* surface) {
-  UNUSED(surface);
+static VALUE Framebuffer_h(VALUE self) {
+  DEFINE_SELF(Framebuffer, fb, self);
+
+  return INT2NUM(fb->h);
 }
 
-static size_t _Surface_memsize(const void *p) {
-  return p ? sizeof(struct SDL_Surface) : 0;
+static VALUE Framebuffer_bits(VALUE self) {
+  DEFINE_SELF(Framebuffer, fb, self);
+
+  return INT2NUM(fb->bits ? fb->bits : 32);
 }
 
-static VALUE Surface_s_load(VALUE klass, VALUE path) {
-  UNUSED(klass);
-  SDL_Surface *surface;
+// Cells hold a color, or a palette index for indexed framebuffers.
 
-  ExportStringValue(path);
+static VALUE Framebuffer_index(VALUE self, VALUE x_, VALUE y_) {
+  DEFINE_SELF(Framebuffer, fb, self);
 
-  surface = IMG_Load(RSTRING_PTR(path));
+  int x = NUM2INT(x_);
+  int y = NUM2INT(y_);
 
-  if (!surface)
-    rb_raise(eSDLError, "Couldn't load file %s : %s",
-             RSTRING_PTR(path),
-             SDL_GetError());
+  if (x < 0 || y < 0 || x >= fb->w || y >= fb->h)
+    rb_raise(rb_eIndexError, "%d, %d is outside of %dx%d", x, y, fb->w, fb->h);
 
-  return TypedData_Wrap_Struct(cSurface, &_Surface_type, surface);
+  switch (fb->bits) {
+  case 8:  return UINT2NUM(((Uint8*) FB_ROW(fb, y))[x]);
+  case 16: return UINT2NUM(((Uint16*)FB_ROW(fb, y))[x]);
+  default: return UINT2NUM(((Uint32*)FB_ROW(fb, y))[x]);
+  }
 }
 
-#define DEFINE_WRAP12(name)                                \
-  void wrap_##name(SDL_Surface* a,                         \
-                   Sint16 b, Sint16 c, Sint16 d, Sint16 e, \
-                   Sint16 f, Sint16 g, Sint16 h, Sint16 i, \
-                   int j,                                  \
-                   Uint32 k, Uint8 l) { name(a, b, c, d, e, f, g, h, i, j, k); }
-#define DEFINE_WRAP7(name)                                 \
-  void wrap_##name(SDL_Surface* a,                         \
-                   Sint16 b, Sint16 c, Sint16 d, Sint16 e, \
-                   Uint32 f, Uint8 g) { name(a, b, c, d, e, f); }
-#define DEFINE_WRAP6(name)                                 \
-  void wrap_##name(SDL_Surface* a,                         \
-                   Sint16 b, Sint16 c, Sint16 d,           \
-                   Uint32 e, Uint8 f) { name(a, b, c, d, e); }
+// Like drawing off the edge of the window, out of bounds writes are
+// silently dropped.
 
-#define IDX1(a)                                 !!(a)
-#define IDX2(a, b)                 (!!(a))<<1 | !!(b)
-#define IDX3(a, b, c) (!!(a))<<2 | (!!(b))<<1 | !!(c)
+static VALUE Framebuffer_index_eq(VALUE self, VALUE x_, VALUE y_, VALUE cell) {
+  DEFINE_SELF(Framebuffer, fb, self);
 
-typedef int (*f_rxyxyc)(SDL_Renderer*,
-                        Sint16, Sint16, Sint16, Sint16,
-                        Uint32);
-typedef int (*f_rxyrc)(SDL_Renderer*,
-                        Sint16, Sint16, Sint16,
-                        Uint32);
+  int x = NUM2INT(x_);
+  int y = NUM2INT(y_);
+  Uint32 c = NUM2UINT(cell);
 
-// TODO: ? maybe ?
-// int  hlineColor                  (SDL_Renderer *renderer, Sint16 x1, Sint16 x2, Sint16 y, Uint32 color)
-// int  vlineColor                  (SDL_Renderer *renderer, Sint16 x, Sint16 y1, Sint16 y2, Uint32 color)
-// int  roundedRectangleColor       (SDL_Renderer *renderer, Sint16 x1, Sint16 y1, Sint16 x2, Sint16 y2, Sint16 rad, Uint32 color)
-// int  roundedBoxColor             (SDL_Renderer *renderer, Sint16 x1, Sint16 y1, Sint16 x2, Sint16 y2, Sint16 rad, Uint32 color)
-// int  thickLineColor              (SDL_Renderer *renderer, Sint16 x1, Sint16 y1, Sint16 x2, Sint16 y2, Uint8 width, Uint32 color)
-// int  arcColor                    (SDL_Renderer *renderer, Sint16 x, Sint16 y, Sint16 rad, Sint16 start, Sint16 end, Uint32 color)
-// int  pieColor                    (SDL_Renderer *renderer, Sint16 x, Sint16 y, Sint16 rad, Sint16 start, Sint16 end, Uint32 color)
-// int  filledPieColor              (SDL_Renderer *renderer, Sint16 x, Sint16 y, Sint16 rad, Sint16 start, Sint16 end, Uint32 color)
-// int  trigonColor                 (SDL_Renderer *renderer, Sint16 x1, Sint16 y1, Sint16 x2, Sint16 y2, Sint16 x3, Sint16 y3, Uint32 color)
-// int  aatrigonColor               (SDL_Renderer *renderer, Sint16 x1, Sint16 y1, Sint16 x2, Sint16 y2, Sint16 x3, Sint16 y3, Uint32 color)
-// int  filledTrigonColor           (SDL_Renderer *renderer, Sint16 x1, Sint16 y1, Sint16 x2, Sint16 y2, Sint16 x3, Sint16 y3, Uint32 color)
-// int  polygonColor                (SDL_Renderer *renderer, const Sint16 *vx, const Sint16 *vy, int n, Uint32 color)
-// int  aapolygonColor              (SDL_Renderer *renderer, const Sint16 *vx, const Sint16 *vy, int n, Uint32 color)
-// int  filledPolygonColor          (SDL_Renderer *renderer, const Sint16 *vx, const Sint16 *vy, int n, Uint32 color)
-// int  texturedPolygon             (SDL_Renderer *renderer, const Sint16 *vx, const Sint16 *vy, int n, SDL_Surface *texture, int texture_dx, int texture_dy)
-// void gfxPrimitivesSetFont        (const void *fontdata, Uint32 cw, Uint32 ch)
-// void gfxPrimitivesSetFontRotation(Uint32 rotation)
-// int  characterColor              (SDL_Renderer *renderer, Sint16 x, Sint16 y, char c, Uint32 color)
-// int  stringColor                 (SDL_Renderer *renderer, Sint16 x, Sint16 y, const char *s, Uint32 color)
+  if (x < 0 || y < 0 || x >= fb->w || y >= fb->h)
+    return cell;
 
-static VALUE Renderer_draw_bezier(VALUE self,
-                                  VALUE xs_,
-                                  VALUE ys_,
-                                  VALUE steps_,
-                                  VALUE color_) {
-  DEFINE_SELF(Renderer, renderer, self);
+  switch (fb->bits) {
+  case 8:  ((Uint8*) FB_ROW(fb, y))[x] = (Uint8)c;  break;
+  case 16: ((Uint16*)FB_ROW(fb, y))[x] = (Uint16)c; break;
+  default: ((Uint32*)FB_ROW(fb, y))[x] = c;         break;
+  }
 
-  int xlen = RARRAY_LENINT(xs_);
-  int ylen = RARRAY_LENINT(ys_);
+  _Framebuffer_dirty(fb, x, y, x + 1, y + 1);
 
-  if (xlen != ylen)
-    rb_raise(rb_eArgError, "xs & ys are different length");
+  return cell;
+}
 
-  Sint16 *xs = malloc(xlen*sizeof(Sint16));
+static VALUE Framebuffer_fill_rect(VALUE self,
+                                   VALUE x_, VALUE y_,
+                                   VALUE w_, VALUE h_,
+                                   VALUE cell) {
+  DEFINE_SELF(Framebuffer, fb, self);
 
-  for (int i = 0; i < xlen; i++) {
-    xs[i] = NUM2SINT16(RARRAY_AREF(xs_, i));
-  }
+  int x1 = NUM2INT(x_),      y1 = NUM2INT(y_);
+  int x2 = x1 + NUM2INT(w_), y2 = y1 + NUM2INT(h_);
+  Uint32 c = NUM2UINT(cell);
 
-  Sint16 *ys = malloc(ylen*sizeof(Sint16));
-  for (int i = 0; i < ylen; i++) {
-    ys[i] = NUM2SINT16(RARRAY_AREF(ys_, i));
-  }
+  if (x1 < 0) x1 = 0;
+  if (y1 < 0) y1 = 0;
+  if (x2 > fb->w) x2 = fb->w;
+  if (y2 > fb->h) y2 = fb->h;
 
-  int steps = NUM2INT(steps_);
-  Uint32 color = VALUE2COLOR(color_);
+  if (x1 >= x2 || y1 >= y2)
+    return Qnil;
 
-  if (bezierColor(renderer, xs, ys, xlen, steps, color))
-    FAILURE("draw_bezier");
+  for (int y = y1; y < y2; y++) {
+    switch (fb->bits) {
+    case 8:
+      memset((Uint8*)FB_ROW(fb, y) + x1, (Uint8)c, x2 - x1);
+      break;
+    case 16: {
+      Uint16 *row = (Uint16*)FB_ROW(fb, y);
+      for (int x = x1; x < x2; x++) row[x] = (Uint16)c;
+      break;
+    }
+    default: {
+      Uint32 *row = (Uint32*)FB_ROW(fb, y);
+      for (int x = x1; x < x2; x++) row[x] = c;
+      break;
+    }
+    }
+  }
 
-  free(xs);
-  free(ys);
+  _Framebuffer_dirty(fb, x1, y1, x2, y2);
 
   return Qnil;
 }
 
-int aafilledCircleColor(SDL_Renderer * renderer, Sint16 x, Sint16 y, Sint16 rad, Uint32 color) {
-  int result = 0;
-  result |= filledCircleColor(renderer, x, y, rad, color);
-  result |= aacircleColor(renderer, x, y, rad, color);
-  return result;
+static VALUE Framebuffer_clear(VALUE self, VALUE cell) {
+  DEFINE_SELF(Framebuffer, fb, self);
+
+  return Framebuffer_fill_rect(self, INT2FIX(0), INT2FIX(0),
+                               INT2NUM(fb->w), INT2NUM(fb->h), cell);
 }
 
-static f_rxyrc f_circle[] = { &circleColor,
-                              &filledCircleColor,
-                              &aacircleColor,
-                              &aafilledCircleColor };
+// write(cells, row = 0)
+//
+// Copies packed cells (RGBA32, or 8/16 bit indices) in starting at
+// +row+. Anything past the bottom of the framebuffer is ignored.
 
-static VALUE Renderer_draw_circle(VALUE self,
-                                  VALUE x,  VALUE y,
-                                  VALUE r,
-                                  VALUE c,
-                                  VALUE aa, VALUE f) {
-  DEFINE_SELF(Renderer, renderer, self);
+static VALUE Framebuffer_write(int argc, VALUE *argv, VALUE self) {
+  DEFINE_SELF(Framebuffer, fb, self);
+  VALUE data, row_;
 
-  Uint8 idx = IDX2(RTEST(aa), RTEST(f));
+  rb_scan_args(argc, argv, "11", &data, &row_);
+  StringValue(data);
 
-  f_circle[idx](renderer,
-                NUM2SINT16(x), NUM2SINT16(y),
-                NUM2SINT16(r),
-                NUM2UINT(c));
+  int row = NIL_P(row_) ? 0 : NUM2INT(row_);
 
-  return Qnil;
-}
+  if (row < 0 || row >= fb->h)
+    rb_raise(rb_eIndexError, "row %d is outside of 0...%d", row, fb->h);
 
-int aafilledEllipseColor(SDL_Renderer * renderer, Sint16 x, Sint16 y, Sint16 rx, Sint16 ry, Uint32 color) {
-  int result = 0;
-  result |= filledEllipseColor(renderer, x, y, rx, ry, color);
-  result |= aaellipseColor(renderer, x, y, rx, ry, color);
-  return result;
+  size_t pitch = FB_CELL_SIZE(fb) * fb->w;
+  size_t room  = pitch * (fb->h - row);
+  size_t len   = RSTRING_LEN(data);
+
+  if (len > room) len = room;
+
+  memcpy(FB_ROW(fb, row), RSTRING_PTR(data), len);
+  _Framebuffer_dirty(fb, 0, row, fb->w, row + (int)((len + pitch - 1) / pitch));
+
+  return self;
 }
 
-static f_rxyxyc f_ellipse[] = { &ellipseColor,
-                                &filledEllipseColor,
-                                &aaellipseColor,
-                                &aafilledEllipseColor };
+// palette = colors
+//
+// Sets the colors of an indexed framebuffer from an array of colors
+// or a packed string of Uint32s. Unset entries are transparent.
 
-static VALUE Renderer_draw_ellipse(VALUE self,
-                                   VALUE x,  VALUE y,
-                                   VALUE rx, VALUE ry,
-                                   VALUE c,
-                                   VALUE aa, VALUE f) {
-  DEFINE_SELF(Renderer, renderer, self);
+static VALUE Framebuffer_palette_eq(VALUE self, VALUE colors) {
+  DEFINE_SELF(Framebuffer, fb, self);
 
-  Uint8 idx = IDX2(RTEST(aa), RTEST(f));
+  if (!fb->bits)
+    rb_raise(eSDLError, "Framebuffer#palette= needs an indexed framebuffer");
 
-  f_ellipse[idx](renderer,
-                 NUM2SINT16(x),
-                 NUM2SINT16(y),
-                 NUM2SINT16(rx),
-                 NUM2SINT16(ry),
-                 NUM2UINT(c));
+  size_t max = (size_t)1 << fb->bits;
 
-  return Qnil;
+  MEMZERO(fb->palette, Uint32, max);
+
+  if (RB_TYPE_P(colors, T_STRING)) {
+    size_t n = RSTRING_LEN(colors) / sizeof(Uint32);
+    MEMCPY(fb->palette, RSTRING_PTR(colors), Uint32, n < max ? n : max);
+  } else {
+    Check_Type(colors, T_ARRAY);
+
+    long n = RARRAY_LEN(colors);
+    for (long i = 0; i < n && (size_t)i < max; i++)
+      fb->palette[i] = VALUE2COLOR(RARRAY_AREF(colors, i));
+  }
+
+  _Framebuffer_dirty_all(fb);
+
+  return colors;
 }
 
-static f_rxyxyc f_line[] = { &lineColor,
-                             &aalineColor };
+static VALUE Framebuffer_palette(VALUE self) {
+  DEFINE_SELF(Framebuffer, fb, self);
 
-static VALUE Renderer_draw_line(VALUE self,
-                                VALUE x1, VALUE y1,
-                                VALUE x2, VALUE y2,
-                                VALUE c,
-                                VALUE aa) {
-  DEFINE_SELF(Renderer, renderer, self);
+  if (!fb->bits)
+    return Qnil;
 
-  Uint8 idx = IDX1(RTEST(aa));
+  size_t max = (size_t)1 << fb->bits;
+  VALUE ary = rb_ary_new_capa((long)max);
 
-  f_line[idx](renderer,
-              NUM2SINT16(x1),
-              NUM2SINT16(y1),
-              NUM2SINT16(x2),
-              NUM2SINT16(y2),
-              VALUE2COLOR(c));
+  for (size_t i = 0; i < max; i++)
+    rb_ary_push(ary, UINT2NUM(fb->palette[i]));
 
-  return Qnil;
+  return ary;
 }
 
-static f_rxyxyc f_rect[] = { &rectangleColor,
-                             &boxColor };
+// flood_fill(x, y, cell, tolerance: 0)
+//
+// Fills the cells connected to x, y that match it with cell. For
+// indexed framebuffers, tolerance compares the palette's colors.
+// Returns the number of cells filled.
 
-static VALUE Renderer_draw_rect(VALUE self,
-                                VALUE x_, VALUE y_,
-                                VALUE w_, VALUE h_,
-                                VALUE c,
-                                VALUE f) {
-  DEFINE_SELF(Renderer, renderer, self);
+static VALUE Framebuffer_flood_fill(int argc, VALUE *argv, VALUE self) {
+  DEFINE_SELF(Framebuffer, fb, self);
+  VALUE x_, y_, cell, opts, tmp = 0;
 
-  Sint16 x1 = NUM2SINT16(x_);
-  Sint16 y1 = NUM2SINT16(y_);
-  Sint16 x2 = NUM2SINT16(w_) + x1;
-  Sint16 y2 = NUM2SINT16(h_) + y1;
-  Uint8 idx = IDX1(RTEST(f));
+  rb_scan_args(argc, argv, "3:", &x_, &y_, &cell, &opts);
 
-  f_rect[idx](renderer, x1, y1, x2, y2, NUM2UINT(c));
+  int x = NUM2INT(x_);
+  int y = NUM2INT(y_);
+  flood_fill f = { 0 };
 
-  return Qnil;
+  f.fill      = NUM2UINT(cell);
+  f.tolerance = _flood_tolerance(opts);
+
+  // A wider index would be truncated when stored, never match what the
+  // fill compares against, and read past the end of the palette.
+  if (fb->bits && f.fill >> fb->bits)
+    rb_raise(rb_eRangeError, "%u is not a %d bit palette index", f.fill, fb->bits);
+
+  if (x < 0 || y < 0 || x >= fb->w || y >= fb->h)
+    return INT2FIX(0);
+
+  f.pixels = fb->cells;
+  f.w      = fb->w;
+  f.h      = fb->h;
+  f.bpp    = (int)FB_CELL_SIZE(fb);
+  f.pitch  = f.bpp * fb->w;
+
+  Uint8 *row = FB_ROW(fb, y);
+
+  switch (fb->bits) {
+  case 8:  f.target = FLOOD_GET1(row, x); break;
+  case 16: f.target = FLOOD_GET2(row, x); break;
+  default: f.target = FLOOD_GET4(row, x); break;
+  }
+
+  if (f.tolerance && fb->bits) {
+    size_t n  = (size_t)1 << fb->bits;
+    Uint8 *lut = ALLOCV(tmp, n);
+    Uint8 want[4], c[4];
+
+    memcpy(want, &fb->palette[f.target], sizeof(want));
+
+    for (size_t i = 0; i < n; i++) {
+      memcpy(c, &fb->palette[i], sizeof(c));
+      lut[i] = (Uint8)_flood_within(c, want, f.tolerance);
+    }
+
+    f.lut = lut;
+  } else if (f.tolerance) {
+    Uint32 masks[4];
+    int bpp;
+
+    SDL_PixelFormatEnumToMasks(SDL_PIXELFORMAT_RGBA32, &bpp,
+                               &masks[0], &masks[1], &masks[2], &masks[3]);
+    _flood_masks(&f, masks);
+
+    for (int i = 0; i < 4; i++)
+      f.want[i] = _flood_channel(&f, f.target, i);
+  }
+
+  long filled = _flood_fill(&f, x, y);
+
+  if (tmp) ALLOCV_END(tmp);
+
+  if (filled < 0)
+    rb_memerror();
+
+  if (filled)
+    _Framebuffer_dirty(fb, f.x1, f.y1, f.x2, f.y2);
+
+  return LONG2NUM(filled);
 }
 
-static VALUE Renderer_clear(VALUE self, VALUE color) {
-  DEFINE_SELF(Renderer, renderer, self);
-  DEFINE_SELF(PixelFormat, format, rb_ivar_get(self, id_iv_format));
+static VALUE Framebuffer_upload(VALUE self) {
+  DEFINE_SELF(Framebuffer, fb, self);
 
-  Uint8 r, g, b, a;
-  SDL_GetRGBA(NUM2UINT(color), format, &r, &g, &b, &a);
+  _Framebuffer_upload(fb);
 
-  SDL_SetRenderDrawColor(renderer, r, g, b, a);
+  return self;
+}
 
-  if (SDL_RenderClear(renderer))
-    FAILURE("Renderer#clear");
+#ifdef HAVE_RUBY_IO_BUFFER_H
+typedef struct {
+  SDL_Framebuffer *fb;
+  VALUE buffer;
+} framebuffer_cells;
 
-  return Qnil;
+static VALUE _Framebuffer_cells_yield(VALUE data) {
+  framebuffer_cells *args = (framebuffer_cells*)data;
+
+  return rb_yield(args->buffer);
 }
 
-static VALUE Renderer_copy_texture(VALUE self, VALUE texture_) {
-  DEFINE_SELF(Renderer, renderer, self);
-  DEFINE_SELF(Texture,  texture,  texture_);
+static VALUE _Framebuffer_cells_release(VALUE data) {
+  framebuffer_cells *args = (framebuffer_cells*)data;
 
-  if (SDL_RenderCopy(renderer, texture, NULL, NULL))
-    FAILURE("Renderer#copy_texture");
+  rb_io_buffer_free(args->buffer);
+  _Framebuffer_dirty_all(args->fb);
 
   return Qnil;
 }
 
-static VALUE Renderer_fast_rect(VALUE self,
+// Yields an IO::Buffer over all the cells, row by row. Everything is
+// uploaded on the next draw.
+
+static VALUE Framebuffer_pixels(VALUE self) {
+  DEFINE_SELF(Framebuffer, fb, self);
+  framebuffer_cells args = { fb, Qnil };
+
+  rb_need_block();
+
+  args.buffer = rb_io_buffer_new(fb->cells,
+                                 FB_CELL_SIZE(fb) * fb->w * fb->h,
+                                 RB_IO_BUFFER_EXTERNAL);
+
+  return rb_ensure(_Framebuffer_cells_yield,   (VALUE)&args,
+                   _Framebuffer_cells_release, (VALUE)&args);
+}
+#else
+static VALUE Framebuffer_pixels(VALUE self) {
+  UNUSED(self);
+  rb_raise(rb_eNotImpError, "Framebuffer#pixels needs IO::Buffer (ruby 3.1+)");
+  return Qnil;
+}
+#endif
+
+//// Scalar fields:
+
+// Colormaps ported from Graphics::Rainbow, one color per degree.
+
+#define COLORMAP_SIZE 361
+
+static Uint32 colormap_hue[COLORMAP_SIZE];
+static Uint32 colormap_greyscale[COLORMAP_SIZE];
+static Uint32 colormap_cubehelix[COLORMAP_SIZE];
+
+static Uint8 _clamp_u8(double d) {
+  return d < 0 ? 0 : d > 255 ? 255 : (Uint8)d;
+}
+
+static void _init_colormaps(void) {
+  for (int d = 0; d < COLORMAP_SIZE; d++) {
+    // Graphics::Hue
+    Uint8 hi = 255;
+    Uint8 lo = (Uint8)floor((1 - fabs(fmod(d / 60.0, 2) - 1)) * 255);
+
+    colormap_hue[d] = (d <=  60 ? rgba32(hi, lo,  0, 255) :
+                       d <= 120 ? rgba32(lo, hi,  0, 255) :
+                       d <= 180 ? rgba32( 0, hi, lo, 255) :
+                       d <= 240 ? rgba32( 0, lo, hi, 255) :
+                       d <= 300 ? rgba32(lo,  0, hi, 255) :
+                                  rgba32(hi,  0, lo, 255));
+
+    // Graphics::Greyscale
+    Uint8 grey = (Uint8)floor(d / 360.0 * 255.0);
+
+    colormap_greyscale[d] = rgba32(grey, grey, grey, 255);
+
+    // Graphics::Cubehelix: start 0.5, rotations -1.5, saturation 1.2, gamma 1
+    double fract = d / 360.0;
+    double amp   = 1.2 * fract * (1 - fract) / 2.0;
+    double angle = 2 * M_PI * (0.5 / 3.0 + 1.0 - 1.5 * fract);
+    double c = cos(angle), s = sin(angle);
+
+    colormap_cubehelix[d] =
+      rgba32(_clamp_u8(round((fract + amp * (-0.14861 * c + 1.78277 * s)) * 255)),
+             _clamp_u8(round((fract + amp * (-0.29227 * c - 0.90649 * s)) * 255)),
+             _clamp_u8(round((fract + amp * ( 1.97294 * c)) * 255)),
+             255);
+  }
+}
+
+// Min and max of a field, skipping NaNs. Four lanes keep the
+// comparisons independent so the compiler can pipeline or vectorize.
+
+#define DEFINE_FIELD_KERNELS(type)                                           \
+  static void _field_range_##type(const type *v, size_t n,                   \
+                                  double *min, double *max) {                \
+    type lo[4] = { INFINITY,  INFINITY,  INFINITY,  INFINITY };              \
+    type hi[4] = { -INFINITY, -INFINITY, -INFINITY, -INFINITY };             \
+    size_t i = 0;                                                            \
+                                                                             \
+    for (; i + 4 <= n; i += 4)                                               \
+      for (int j = 0; j < 4; j++) {                                          \
+        type x = v[i+j];                                                     \
+        lo[j] = x < lo[j] ? x : lo[j];                                       \
+        hi[j] = x > hi[j] ? x : hi[j];                                       \
+      }                                                                      \
+    for (; i < n; i++) {                                                     \
+      lo[0] = v[i] < lo[0] ? v[i] : lo[0];                                   \
+      hi[0] = v[i] > hi[0] ? v[i] : hi[0];                                   \
+    }                                                                        \
+                                                                             \
+    *min = fmin(fmin(lo[0], lo[1]), fmin(lo[2], lo[3]));                     \
+    *max = fmax(fmax(hi[0], hi[1]), fmax(hi[2], hi[3]));                     \
+  }                                                                          \
+                                                                             \
+  static void _field_map_##type(const type *v, size_t n, Uint32 *out,        \
+                                double min, double max,                      \
+                                const Uint32 *lut, int lut_size) {           \
+    type scale = (type)((lut_size - 1) / (max > min ? max - min : 1));       \
+    type base  = (type)min;                                                  \
+    type top   = (type)(lut_size - 1);                                       \
+                                                                             \
+    for (size_t i = 0; i < n; i++) {                                         \
+      type t = (v[i] - base) * scale;                                        \
+      t = t > 0 ? t : 0;  /* also catches NaN */                             \
+      t = t < top ? t : top;                                                 \
+      out[i] = lut[(int)t];                                                  \
+    }                                                                        \
+  }
+
+DEFINE_FIELD_KERNELS(float)
+DEFINE_FIELD_KERNELS(double)
+
+// draw_field(values, w, h, colormap: :hue, min: nil, max: nil, flip: false)
+//
+// Draws a packed float32 or float64 grid of w * h values scaled to
+// fill the output. Values are normalized from min..max (the field's
+// own range when not given) and looked up in the colormap: :hue,
+// :greyscale, :cubehelix, or an array of colors. The grid is colored
+// at its own size and upscaled bilinearly by the texture sampler.
+
+static VALUE Renderer_draw_field(int argc, VALUE *argv, VALUE self) {
+  VALUE values, w_, h_, opts;
+  VALUE vals[4];
+  ID keys[4] = { rb_intern("colormap"), rb_intern("min"), rb_intern("max"),
+                 rb_intern("flip") };
+
+  rb_scan_args(argc, argv, "3:", &values, &w_, &h_, &opts);
+  rb_get_kwargs(opts, keys, 0, 4, vals);
+  StringValue(values);
+
+  int w = NUM2INT(w_);
+  int h = NUM2INT(h_);
+  size_t n   = (size_t)w * h;
+  size_t len = RSTRING_LEN(values);
+  int wide;
+
+  if (len == n * sizeof(float))
+    wide = 0;
+  else if (len == n * sizeof(double))
+    wide = 1;
+  else
+    rb_raise(rb_eArgError, "%zu bytes isn't %dx%d float32s or float64s", len, w, h);
+
+  VALUE cmap = vals[0] == Qundef ? ID2SYM(rb_intern("hue")) : vals[0];
+  const Uint32 *lut;
+  Uint32 *custom = NULL;
+  VALUE custom_v = 0;
+  int lut_size = COLORMAP_SIZE;
+
+  if (RB_TYPE_P(cmap, T_ARRAY)) {
+    lut_size = RARRAY_LENINT(cmap);
+    if (lut_size < 1)
+      rb_raise(rb_eArgError, "empty colormap");
+    custom = ALLOCV_N(Uint32, custom_v, lut_size);
+    for (int i = 0; i < lut_size; i++)
+      custom[i] = VALUE2COLOR(RARRAY_AREF(cmap, i));
+    lut = custom;
+  } else if (SYM2ID(cmap) == rb_intern("hue")) {
+    lut = colormap_hue;
+  } else if (SYM2ID(cmap) == rb_intern("greyscale") ||
+             SYM2ID(cmap) == rb_intern("grayscale")) {
+    lut = colormap_greyscale;
+  } else if (SYM2ID(cmap) == rb_intern("cubehelix")) {
+    lut = colormap_cubehelix;
+  } else {
+    rb_raise(rb_eArgError, "unknown colormap: %"PRIsVALUE, cmap);
+  }
+
+  const char *data = RSTRING_PTR(values);
+  int has_min = vals[1] != Qundef && !NIL_P(vals[1]);
+  int has_max = vals[2] != Qundef && !NIL_P(vals[2]);
+  double min = 0, max = 0;
+
+  if (!has_min || !has_max) {           // only scan for what's missing
+    if (wide)
+      _field_range_double((const double*)data, n, &min, &max);
+    else
+      _field_range_float((const float*)data, n, &min, &max);
+  }
+
+  if (has_min) min = NUM2DBL(vals[1]);
+  if (has_max) max = NUM2DBL(vals[2]);
+
+  // Reuse the field's texture from frame to frame.
+  VALUE vfb = rb_attr_get(self, id_iv_field);
+  SDL_Framebuffer *fb = RTEST(vfb) ? ruby_to_Framebuffer(vfb) : NULL;
+
+  if (!fb || fb->w != w || fb->h != h) {
+    vfb = _Framebuffer_new(self, w_, h_, 0);
+    fb  = ruby_to_Framebuffer(vfb);
+
+    if (SDL_SetTextureScaleMode(fb->texture, SDL_ScaleModeLinear))
+      FAILURE("Renderer#draw_field(SetTextureScaleMode)");
+
+    rb_ivar_set(self, id_iv_field, vfb);
+  }
+
+  if (wide)
+    _field_map_double((const double*)data, n, fb->cells, min, max, lut, lut_size);
+  else
+    _field_map_float((const float*)data, n, fb->cells, min, max, lut, lut_size);
+
+  if (custom) ALLOCV_END(custom_v);
+
+  _Framebuffer_dirty_all(fb);
+
+  VALUE flip = vals[3] == Qundef ? Qfalse : vals[3];
+
+  return Renderer_draw_framebuffer(self, vfb, flip);
+}
+
+//// SDL::Key methods:
+
+// SDL's keyboard state array is live and lives as long as SDL does,
+// so there's no need to hang on to it between scan and press?. It's
+// updated whenever events are pumped, which scan leaves to the event
+// loop as it always has.
+static VALUE Key_s_press_p(VALUE mod, VALUE keycode_) {
+  UNUSED(mod);
+
+  int key_state_len;
+  const Uint8 *key_state = SDL_GetKeyboardState(&key_state_len);
+
+  SDL_Keycode keycode   = NUM2INT(keycode_);
+  SDL_Scancode scancode = SDL_GetScancodeFromKey(keycode);
+
+  if (0 >= scancode || scancode >= key_state_len)
+    rb_raise(eSDLError, "%d (%d) is out of bounds: %d",
+             keycode, scancode, key_state_len);
+
+  return INT2BOOL(key_state[scancode]);
+}
+
+static VALUE Key_s_scan(VALUE mod) {
+  UNUSED(mod);
+
+  return Qnil;
+}
+
+//// SDL::Key::Bindings methods:
+
+// Handlers bound to keys, checked against an edge-detected copy of the
+// keyboard state. update only looks at the keys that are down (or just
+// came up), so it costs O(pressed keys), not O(bindings). Handlers come
+// back newest binding first, like the old key_handler list. Keycodes
+// without a scancode can be bound but never fire.
+
+#define KEY_WORDS ((SDL_NUM_SCANCODES + 63) / 64)
+
+enum { KEY_HELD = 1, KEY_PRESSED = 2, KEY_RELEASED = 4 };
+
+typedef struct {
+  VALUE  handler;                       // handed back by update
+  SDL_Keycode keycode;
+  int    scancode;                      // SDL_SCANCODE_UNKNOWN if unmapped
+  int    next;                          // next binding for scancode, or -1
+  Uint16 mod;                           // modifiers that must be down
+  Uint8  on;                            // KEY_HELD, KEY_PRESSED, ...
+} key_binding;
+
+struct SDL_KeyBindings {
+  Uint64       down[KEY_WORDS];         // as of the last update
+  Uint64       pressed[KEY_WORDS];      // went down at the last update
+  Uint64       released[KEY_WORDS];     // went up at the last update
+  int          first[SDL_NUM_SCANCODES]; // newest binding, or -1
+  key_binding *bindings;
+  int         *hits;                    // scratch for update, capa long
+  int          n, capa;
+};
+
+static void _KeyBindings_free(void* p) {
+  SDL_KeyBindings *keys = p;
+
+  if (!keys) return;
+
+  xfree(keys->bindings);
+  xfree(keys->hits);
+  xfree(keys);
+}
+
+static void _KeyBindings_mark(void* p) {
+  SDL_KeyBindings *keys = p;
+
+  for (int i = 0; i < keys->n; i++)
+    rb_gc_mark(keys->bindings[i].handler);
+}
+
+static size_t _KeyBindings_memsize(const void *p) {
+  const SDL_KeyBindings *keys = p;
+
+  return keys ? sizeof(SDL_KeyBindings) +
+    keys->capa * (sizeof(key_binding) + sizeof(int)) : 0;
+}
+
+static VALUE KeyBindings_s_allocate(VALUE klass) {
+  SDL_KeyBindings *keys;
+  VALUE self = TypedData_Make_Struct(klass, SDL_KeyBindings,
+                                     &_KeyBindings_type, keys);
+
+  for (int i = 0; i < SDL_NUM_SCANCODES; i++)
+    keys->first[i] = -1;
+
+  return self;
+}
+
+static int _KeyBindings_scancode(SDL_Keycode keycode) {
+  int scancode = (int)SDL_GetScancodeFromKey(keycode);
+
+  if (scancode <= 0 || scancode >= SDL_NUM_SCANCODES)
+    return SDL_SCANCODE_UNKNOWN;
+
+  return scancode;
+}
+
+static int _KeyBindings_newest_first(const void *a, const void *b) {
+  return *(const int*)b - *(const int*)a;
+}
+
+static void _KeyBindings_relink(SDL_KeyBindings *keys) {
+  for (int i = 0; i < SDL_NUM_SCANCODES; i++)
+    keys->first[i] = -1;
+
+  for (int i = 0; i < keys->n; i++) {
+    key_binding *b = &keys->bindings[i];
+
+    b->next = keys->first[b->scancode];
+    keys->first[b->scancode] = i;
+  }
+}
+
+// Each modifier group in mask (eg KMOD_CTRL) needs either side down.
+// Anything else in mask (eg KMOD_CAPS) has to be on as given.
+static int _KeyBindings_mods_match(Uint16 mods, Uint16 mask) {
+  static const Uint16 groups[] = { KMOD_SHIFT, KMOD_CTRL, KMOD_ALT, KMOD_GUI };
+  Uint16 rest = mask;
+
+  for (size_t i = 0; i < sizeof(groups) / sizeof(*groups); i++) {
+    Uint16 want = mask & groups[i];
+
+    if (want && !(mods & want)) return 0;
+    rest &= ~groups[i];
+  }
+
+  return (mods & rest) == rest;
+}
+
+static VALUE KeyBindings_bind(int argc, VALUE *argv, VALUE self) {
+  DEFINE_SELF(KeyBindings, keys, self);
+  VALUE keycode, handler, opts;
+  VALUE vals[2] = { Qundef, Qundef };
+  ID ids[] = { rb_intern("on"), rb_intern("mod") };
+
+  rb_scan_args(argc, argv, "2:", &keycode, &handler, &opts);
+  if (!NIL_P(opts))
+    rb_get_kwargs(opts, ids, 0, 2, vals);
+
+  SDL_Keycode sym = NUM2INT(keycode);
+  int scancode    = _KeyBindings_scancode(sym);
+  Uint8 on        = KEY_HELD;
+
+  if (vals[0] != Qundef) {
+    ID edge = SYM2ID(vals[0]);
+
+    if (edge == rb_intern("held"))
+      on = KEY_HELD;
+    else if (edge == rb_intern("pressed"))
+      on = KEY_PRESSED;
+    else if (edge == rb_intern("released"))
+      on = KEY_RELEASED;
+    else
+      rb_raise(rb_eArgError, "unknown key edge: %"PRIsVALUE, vals[0]);
+  }
+
+  if (keys->n == keys->capa) {
+    keys->capa = keys->capa ? 2 * keys->capa : 16;
+    REALLOC_N(keys->bindings, key_binding, keys->capa);
+    REALLOC_N(keys->hits, int, keys->capa);
+  }
+
+  key_binding *b = &keys->bindings[keys->n];
+
+  b->handler  = handler;
+  b->keycode  = sym;
+  b->scancode = scancode;
+  b->mod      = vals[1] == Qundef ? 0 : NUM2UINT16(vals[1]);
+  b->on       = on;
+  b->next     = keys->first[scancode];
+
+  keys->first[scancode] = keys->n++;
+
+  return handler;
+}
+
+// Drop bindings for keycode (or every key, if nil) and, if given,
+// only the ones for handler.
+static VALUE KeyBindings_unbind(int argc, VALUE *argv, VALUE self) {
+  DEFINE_SELF(KeyBindings, keys, self);
+  VALUE keycode, handler;
+
+  rb_scan_args(argc, argv, "11", &keycode, &handler);
+
+  int all = NIL_P(keycode);
+  SDL_Keycode sym = all ? 0 : NUM2INT(keycode);
+  int n = 0;
+
+  for (int i = 0; i < keys->n; i++) {
+    key_binding *b = &keys->bindings[i];
+
+    int hit = (all || b->keycode == sym) &&
+              (argc < 2 || rb_equal(b->handler, handler));
+
+    if (!hit)
+      keys->bindings[n++] = *b;
+  }
+
+  keys->n = n;
+  _KeyBindings_relink(keys);
+
+  return self;
+}
+
+static VALUE KeyBindings_update(VALUE self) {
+  DEFINE_SELF(KeyBindings, keys, self);
+
+  int len;
+  const Uint8 *state = SDL_GetKeyboardState(&len);
+  Uint64 now[KEY_WORDS] = { 0 };
+
+  if (len > SDL_NUM_SCANCODES) len = SDL_NUM_SCANCODES;
+
+  for (int i = 1; i < len; i++)         // 0 is SDL_SCANCODE_UNKNOWN
+    if (state[i])
+      now[i / 64] |= (Uint64)1 << (i % 64);
+
+  for (int w = 0; w < KEY_WORDS; w++) {
+    keys->pressed[w]  =  now[w] & ~keys->down[w];
+    keys->released[w] = ~now[w] &  keys->down[w];
+    keys->down[w]     =  now[w];
+  }
+
+  Uint16 mods  = SDL_GetModState();
+  VALUE  fired = rb_ary_new();
+  int   *hits  = keys->hits;
+  int    n     = 0;
+
+  for (int w = 0; w < KEY_WORDS; w++) {
+    Uint64 active = keys->down[w] | keys->released[w];
+
+    for (int bit = 0; active; bit++, active >>= 1) {
+      if (!(active & 1)) continue;
+
+      int    scancode = w * 64 + bit;
+      Uint64 mask     = (Uint64)1 << bit;
+      int    edges    = ((keys->down[w]     & mask) ? KEY_HELD     : 0) |
+                        ((keys->pressed[w]  & mask) ? KEY_PRESSED  : 0) |
+                        ((keys->released[w] & mask) ? KEY_RELEASED : 0);
+
+      for (int i = keys->first[scancode]; i >= 0; i = keys->bindings[i].next) {
+        key_binding *b = &keys->bindings[i];
+
+        if ((b->on & edges) && _KeyBindings_mods_match(mods, b->mod))
+          hits[n++] = i;
+      }
+    }
+  }
+
+  if (n)
+    qsort(hits, n, sizeof(*hits), _KeyBindings_newest_first);
+
+  for (int i = 0; i < n; i++)
+    rb_ary_push(fired, keys->bindings[hits[i]].handler);
+
+  return fired;
+}
+
+static VALUE _KeyBindings_test(VALUE self, VALUE keycode, int which) {
+  DEFINE_SELF(KeyBindings, keys, self);
+
+  int scancode = _KeyBindings_scancode(NUM2INT(keycode));
+  const Uint64 *bits = which == KEY_PRESSED  ? keys->pressed
+                     : which == KEY_RELEASED ? keys->released
+                     : keys->down;
+
+  return INT2BOOL(bits[scancode / 64] & ((Uint64)1 << (scancode % 64)));
+}
+
+static VALUE KeyBindings_held_p(VALUE self, VALUE keycode) {
+  return _KeyBindings_test(self, keycode, KEY_HELD);
+}
+
+static VALUE KeyBindings_pressed_p(VALUE self, VALUE keycode) {
+  return _KeyBindings_test(self, keycode, KEY_PRESSED);
+}
+
+static VALUE KeyBindings_released_p(VALUE self, VALUE keycode) {
+  return _KeyBindings_test(self, keycode, KEY_RELEASED);
+}
+
+static VALUE KeyBindings_size(VALUE self) {
+  DEFINE_SELF(KeyBindings, keys, self);
+
+  return INT2NUM(keys->n);
+}
+
+//// SDL::Loader methods:
+
+struct SDL_Loader {
+  SDL_mutex    *lock;
+  SDL_cond     *done;                   // a file finished loading
+  SDL_Thread  **threads;
+  int           n_threads;
+  SDL_atomic_t  next;                   // next path for a worker to claim
+  SDL_atomic_t  cancelled;
+
+  int           count;
+  char        **paths;
+  SDL_Surface **surfaces;               // decoded but not yet wrapped
+  char        **errors;                 // SDL_strdup'd, NULL on success
+  Uint8        *finished;               // 0 loading, 1 finished, 2 collected
+  int           n_finished;
+  int           n_cached;               // already in Surface.cache
+  int           woken;                  // interrupted while waiting
+
+  VALUE         names;                  // paths as given, parallel to paths
+  VALUE         results;                // path => Surface, collected so far
+  VALUE         pending;                // collected surfaces without a texture
+  VALUE         aliases;                // [path, path loaded as] for other spellings
+};
+
+static SDL_Texture *_Surface_texture(VALUE renderer, VALUE surface);
+static int _Surface_textured_p(VALUE surface);
+
+static void _Loader_cancel(SDL_Loader *loader) {
+  SDL_AtomicSet(&loader->cancelled, 1);
+
+  for (int i = 0; i < loader->n_threads; i++)
+    if (loader->threads[i]) SDL_WaitThread(loader->threads[i], NULL);
+
+  loader->n_threads = 0;
+}
+
+static void _Loader_free(void* p) {
+  SDL_Loader *loader = p;
+
+  if (!loader) return;
+
+  _Loader_cancel(loader);
+
+  for (int i = 0; i < loader->count; i++) {
+    if (loader->surfaces[i] && !is_quit) SDL_FreeSurface(loader->surfaces[i]);
+    SDL_free(loader->errors[i]);
+    xfree(loader->paths[i]);
+  }
+
+  xfree(loader->paths);
+  xfree(loader->surfaces);
+  xfree(loader->errors);
+  xfree(loader->finished);
+  xfree(loader->threads);
+
+  if (loader->done) SDL_DestroyCond(loader->done);
+  if (loader->lock) SDL_DestroyMutex(loader->lock);
+
+  xfree(loader);
+}
+
+static void _Loader_mark(void* p) {
+  SDL_Loader *loader = p;
+
+  rb_gc_mark(loader->names);
+  rb_gc_mark(loader->results);
+  rb_gc_mark(loader->pending);
+  rb_gc_mark(loader->aliases);
+}
+
+static size_t _Loader_memsize(const void *p) {
+  const SDL_Loader *loader = p;
+
+  if (!loader) return 0;
+
+  return sizeof(SDL_Loader) +
+    (size_t)loader->count * (sizeof(char*) * 2 + sizeof(SDL_Surface*) + 1);
+}
+
+// Runs without the GVL: only SDL and plain malloc from here.
+static int _Loader_work(void *data) {
+  SDL_Loader *loader = data;
+
+  while (!SDL_AtomicGet(&loader->cancelled)) {
+    int i = SDL_AtomicAdd(&loader->next, 1);
+    if (i >= loader->count) break;
+
+    char *error = NULL;
+    SDL_Surface *surface = IMG_Load(loader->paths[i]);
+
+    // Convert now so the first blit doesn't have to.
+    if (surface && surface->format->format != SDL_PIXELFORMAT_RGBA32) {
+      SDL_Surface *converted =
+        SDL_ConvertSurfaceFormat(surface, SDL_PIXELFORMAT_RGBA32, 0);
+      SDL_FreeSurface(surface);
+      surface = converted;
+    }
+
+    if (!surface)
+      error = SDL_strdup(SDL_GetError());
+
+    SDL_LockMutex(loader->lock);
+    loader->surfaces[i] = surface;
+    loader->errors[i]   = error;
+    loader->finished[i] = 1;
+    loader->n_finished++;
+    SDL_CondBroadcast(loader->done);
+    SDL_UnlockMutex(loader->lock);
+  }
+
+  return 0;
+}
+
+// Returns non-NULL once everything's loaded, NULL if woken by an
+// interrupt first.
+static void *_Loader_wait_without_gvl(void *data) {
+  SDL_Loader *loader = data;
+
+  SDL_LockMutex(loader->lock);
+  while (loader->n_finished < loader->count && !loader->woken)
+    SDL_CondWait(loader->done, loader->lock);
+
+  int done = loader->n_finished == loader->count;
+
+  loader->woken = 0;
+  SDL_UnlockMutex(loader->lock);
+
+  return done ? loader : NULL;
+}
+
+static void _Loader_unblock(void *data) {
+  SDL_Loader *loader = data;
+
+  SDL_LockMutex(loader->lock);
+  loader->woken = 1;
+  SDL_CondBroadcast(loader->done);
+  SDL_UnlockMutex(loader->lock);
+}
+
+// Wrap whatever the workers have finished. Returns the index of the
+// first failed path, or -1.
+static int _Loader_collect(SDL_Loader *loader) {
+  int failed = -1;
+
+  for (int i = 0; i < loader->count; i++) {
+    SDL_LockMutex(loader->lock);
+    int ready = loader->finished[i] == 1;
+    int error = loader->finished[i] && loader->errors[i];
+    SDL_Surface *result = loader->surfaces[i];
+    if (ready) {
+      loader->finished[i] = 2;
+      loader->surfaces[i] = NULL;
+    }
+    SDL_UnlockMutex(loader->lock);
+
+    if (error && failed < 0)
+      failed = i;
+
+    if (!ready || !result) continue;
+
+    VALUE path    = RARRAY_AREF(loader->names, i);
+    VALUE surface = _Surface_wrap(result);
+
+    _Surface_cache(rb_str_new_cstr(loader->paths[i]), surface);
+    rb_hash_aset(loader->results, path, surface);
+    rb_ary_push(loader->pending, surface);
+  }
+
+  for (long i = 0; i < RARRAY_LEN(loader->aliases); i++) {
+    VALUE pair    = RARRAY_AREF(loader->aliases, i);
+    VALUE surface = rb_hash_lookup(loader->results, RARRAY_AREF(pair, 1));
+
+    if (!NIL_P(surface))
+      rb_hash_aset(loader->results, RARRAY_AREF(pair, 0), surface);
+  }
+
+  return failed;
+}
+
+static VALUE Loader_done_p(VALUE self) {
+  DEFINE_SELF(Loader, loader, self);
+
+  SDL_LockMutex(loader->lock);
+  int done = loader->n_finished == loader->count;
+  SDL_UnlockMutex(loader->lock);
+
+  return INT2BOOL(done);
+}
+
+static VALUE Loader_loaded(VALUE self) {
+  DEFINE_SELF(Loader, loader, self);
+
+  SDL_LockMutex(loader->lock);
+  int n = loader->n_finished;
+  SDL_UnlockMutex(loader->lock);
+
+  return INT2NUM(loader->n_cached + n);
+}
+
+static VALUE Loader_size(VALUE self) {
+  DEFINE_SELF(Loader, loader, self);
+
+  return INT2NUM(loader->n_cached + loader->count);
+}
+
+static VALUE Loader_index(VALUE self, VALUE path) {
+  DEFINE_SELF(Loader, loader, self);
+
+  _Loader_collect(loader);
+
+  return rb_hash_lookup(loader->results, path);
+}
+
+static VALUE Loader_wait(VALUE self) {
+  DEFINE_SELF(Loader, loader, self);
+
+  while (!rb_thread_call_without_gvl(_Loader_wait_without_gvl, loader,
+                                     _Loader_unblock, loader))
+    rb_thread_check_ints();
+
+  int failed = _Loader_collect(loader);
+
+  if (failed >= 0)
+    rb_raise(eSDLError, "Couldn't load file %s : %s",
+             loader->paths[failed],
+             loader->errors[failed]);
+
+  return loader->results;
+}
+
+static VALUE Loader_upload(int argc, VALUE *argv, VALUE self) {
+  DEFINE_SELF(Loader, loader, self);
+  VALUE vrenderer, max_;
+
+  rb_scan_args(argc, argv, "11", &vrenderer, &max_);
+
+  long max = NIL_P(max_) ? LONG_MAX : NUM2LONG(max_);
+  long n   = 0;
+
+  _Loader_collect(loader);
+
+  while (n < max && RARRAY_LEN(loader->pending)) {
+    _Surface_texture(vrenderer, rb_ary_shift(loader->pending));
+    n++;
+  }
+
+  return LONG2NUM(n);
+}
+
+//// SDL::Mouse methods:
+
+static VALUE Mouse_s_state(VALUE mod) {
+  UNUSED(mod);
+
+  int x,y;
+  Uint8 result = SDL_GetMouseState(&x, &y);
+
+  return rb_ary_new3(5,
+                     INT2FIX(x),
+                     INT2FIX(y),
+                     INT2BOOL(result&SDL_BUTTON_LMASK),
+                     INT2BOOL(result&SDL_BUTTON_MMASK),
+                     INT2BOOL(result&SDL_BUTTON_RMASK));
+}
+
+
+//// SDL::PixelFormat methods:
+
+static void _PixelFormat_free(void* p) {
+  if (is_quit) return;
+  if (!p) return;
+
+  SDL_FreeFormat(p);
+}
+
+static void _PixelFormat_mark(void* p) {
+  UNUSED(p);
+}
+
+static size_t _PixelFormat_memsize(const void *p) {
+  return p ? sizeof(struct SDL_PixelFormat) : 0;
+}
+
+static VALUE PixelFormat_map_rgba(VALUE self, VALUE r, VALUE g, VALUE b, VALUE a) {
+  DEFINE_SELF(PixelFormat, format, self);
+
+  return UINT2NUM(SDL_MapRGBA(format,
+                              NUM2UINT8(r), NUM2UINT8(g),
+                              NUM2UINT8(b), NUM2UINT8(a)));
+}
+
+// The color ramps simulations used to register up front: gray, red,
+// green, blue, cyan, magenta and yellow, as 00..99 or 000..255.
+
+static const struct { const char *name; Uint8 r, g, b; } color_ramps[] = {
+  { "gray",    1, 1, 1 },
+  { "red",     1, 0, 0 },
+  { "green",   0, 1, 0 },
+  { "blue",    0, 0, 1 },
+  { "cyan",    0, 1, 1 },
+  { "magenta", 1, 0, 1 },
+  { "yellow",  1, 1, 0 },
+};
+
+// lookup(name) -> color or nil
+//
+// Computes a ramp color like :gray42 or :red128 from its name.
+
+static VALUE PixelFormat_lookup(VALUE self, VALUE name) {
+  DEFINE_SELF(PixelFormat, format, self);
+
+  if (SYMBOL_P(name))
+    name = rb_sym2str(name);
+  else
+    StringValue(name);
+
+  const char *s = RSTRING_PTR(name);
+  long len = RSTRING_LEN(name);
+
+  for (size_t i = 0; i < sizeof(color_ramps) / sizeof(color_ramps[0]); i++) {
+    long plen = (long)strlen(color_ramps[i].name);
+    long ndigits = len - plen;
+
+    if ((ndigits != 2 && ndigits != 3) ||
+        strncmp(s, color_ramps[i].name, plen))
+      continue;
+
+    int n = 0;
+    for (const char *d = s + plen; d < s + len; d++) {
+      if (*d < '0' || *d > '9') return Qnil;
+      n = n * 10 + (*d - '0');
+    }
+
+    Uint8 m;
+    if (ndigits == 2)
+      m = (Uint8)(int)(255 * (n / 100.0));
+    else if (n < 256)
+      m = (Uint8)(int)(256 * n / 255.0); // 255 -> 256 wraps to 0, as before
+    else
+      return Qnil;
+
+    return UINT2NUM(SDL_MapRGBA(format,
+                                color_ramps[i].r * m,
+                                color_ramps[i].g * m,
+                                color_ramps[i].b * m,
+                                255));
+  }
+
+  return Qnil;
+}
+
+static VALUE PixelFormat_get_rgba(VALUE self, VALUE pixel) {
+  DEFINE_SELF(PixelFormat, format, self);
+  Uint8 r, g, b, a;
+
+  SDL_GetRGBA(NUM2UINT(pixel), format, &r, &g, &b, &a);
+
+  return rb_ary_new3(4, UINT2NUM(r), UINT2NUM(g), UINT2NUM(b), UINT2NUM(a));
+}
+
+//// SDL::Recorder methods:
+
+// Frames are read back on the render thread into a fixed pool of
+// buffers and handed to a pool of encoder threads. Nothing on the
+// encoder side touches ruby.
+
+typedef enum { RECORD_PNG, RECORD_Y4M, RECORD_RAW } record_format;
+
+struct SDL_Recorder {
+  SDL_mutex   *lock;
+  SDL_cond    *ready;                   // frame queued, or stopping
+  SDL_cond    *freed;                   // slot released, or frame written
+  SDL_Thread **threads;
+  int          n_threads;
+
+  Uint8      **slots;                   // depth buffers of h * pitch bytes
+  Uint32      *seqs;                    // frame number held by each slot
+  int         *free_slots;
+  int          n_free;
+  int         *queue;                   // ring of filled slots, oldest first
+  int          q_head;
+  int          q_len;
+  int          depth;
+
+  int           w, h, pitch, fps;
+  record_format format;
+  int           block;
+  int           stopped;
+  int           woken;                  // interrupted while waiting on a slot
+  char         *path;
+  FILE         *out;
+
+  Uint32 captured;
+  Uint32 dropped;
+  Uint32 written;
+  Uint32 failed;
+};
+
+static void _Recorder_stop(SDL_Recorder *rec);
+
+static void _Recorder_free(void* p) {
+  SDL_Recorder *rec = p;
+
+  if (!rec) return;
+
+  _Recorder_stop(rec);
+
+  for (int i = 0; i < rec->depth; i++)
+    xfree(rec->slots[i]);
+
+  xfree(rec->slots);
+  xfree(rec->seqs);
+  xfree(rec->free_slots);
+  xfree(rec->queue);
+  xfree(rec->threads);
+  xfree(rec->path);
+
+  if (rec->freed) SDL_DestroyCond(rec->freed);
+  if (rec->ready) SDL_DestroyCond(rec->ready);
+  if (rec->lock)  SDL_DestroyMutex(rec->lock);
+
+  xfree(rec);
+}
+
+static void _Recorder_mark(void* p) {
+  UNUSED(p);
+}
+
+static size_t _Recorder_memsize(const void *p) {
+  const SDL_Recorder *rec = p;
+
+  if (!rec) return 0;
+
+  return sizeof(SDL_Recorder) + (size_t)rec->depth * rec->h * rec->pitch;
+}
+
+// BT.601, studio swing, 4:4:4 planes.
+static void _Recorder_to_yuv(const SDL_Recorder *rec, const Uint8 *src, Uint8 *dst) {
+  size_t n = (size_t)rec->w * rec->h;
+  Uint8 *ys = dst, *us = dst + n, *vs = dst + 2 * n;
+
+  for (size_t i = 0; i < n; i++, src += 4) {
+    int r = src[0], g = src[1], b = src[2];
+
+    ys[i] = (Uint8)((( 66 * r + 129 * g +  25 * b + 128) >> 8) +  16);
+    us[i] = (Uint8)(((-38 * r -  74 * g + 112 * b + 128) >> 8) + 128);
+    vs[i] = (Uint8)(((112 * r -  94 * g -  18 * b + 128) >> 8) + 128);
+  }
+}
+
+static int _Recorder_encode_png(SDL_Recorder *rec, int slot) {
+  char path[PATH_MAX];
+  int ok = 0;
+
+  snprintf(path, sizeof(path), "%s%06u.png", rec->path, rec->seqs[slot]);
+
+  SDL_Surface *frame =
+    SDL_CreateRGBSurfaceWithFormatFrom(rec->slots[slot], rec->w, rec->h, 32,
+                                       rec->pitch, SDL_PIXELFORMAT_RGBA32);
+
+  if (frame) {
+    ok = IMG_SavePNG(frame, path) == 0;
+    SDL_FreeSurface(frame);
+  }
+
+  return ok;
+}
+
+// Stream formats have to land in order, so wait for our turn. A NULL
+// data still takes its turn so later frames don't wait forever.
+static int _Recorder_write_stream(SDL_Recorder *rec, int slot, const Uint8 *data) {
+  size_t plane = (size_t)rec->w * rec->h;
+  size_t size  = rec->format == RECORD_Y4M ? 3 * plane : 4 * plane;
+  int ok = data != NULL;
+
+  SDL_LockMutex(rec->lock);
+  while (rec->written + rec->failed != rec->seqs[slot])
+    SDL_CondWait(rec->freed, rec->lock);
+
+  if (ok && rec->format == RECORD_Y4M)
+    ok = fputs("FRAME\n", rec->out) >= 0;
+  if (ok)
+    ok = fwrite(data, 1, size, rec->out) == size;
+
+  if (ok)
+    rec->written++;
+  else
+    rec->failed++;
+  SDL_CondBroadcast(rec->freed);
+  SDL_UnlockMutex(rec->lock);
+
+  return ok;
+}
+
+static int _Recorder_work(void *data) {
+  SDL_Recorder *rec = data;
+  Uint8 *yuv = NULL;
+
+  if (rec->format == RECORD_Y4M)
+    yuv = malloc((size_t)3 * rec->w * rec->h);
+
+  for (;;) {
+    SDL_LockMutex(rec->lock);
+    while (!rec->q_len && !rec->stopped)
+      SDL_CondWait(rec->ready, rec->lock);
+
+    if (!rec->q_len) {                  // stopped and drained
+      SDL_UnlockMutex(rec->lock);
+      break;
+    }
+
+    int slot = rec->queue[rec->q_head];
+    rec->q_head = (rec->q_head + 1) % rec->depth;
+    rec->q_len--;
+    SDL_UnlockMutex(rec->lock);
+
+    int ok = 1;
+
+    switch (rec->format) {
+    case RECORD_PNG:
+      ok = _Recorder_encode_png(rec, slot);
+      break;
+    case RECORD_Y4M:
+      if (yuv) _Recorder_to_yuv(rec, rec->slots[slot], yuv);
+      _Recorder_write_stream(rec, slot, yuv);
+      break;
+    case RECORD_RAW:
+      _Recorder_write_stream(rec, slot, rec->slots[slot]);
+      break;
+    }
+
+    SDL_LockMutex(rec->lock);
+    if (rec->format == RECORD_PNG) {
+      if (ok)
+        rec->written++;
+      else
+        rec->failed++;
+    }
+    rec->free_slots[rec->n_free++] = slot;
+    SDL_CondBroadcast(rec->freed);
+    SDL_UnlockMutex(rec->lock);
+  }
+
+  free(yuv);
+
+  return 0;
+}
+
+// Safe to call more than once, and on a recorder that failed to start
+// after opening its file.
+static void _Recorder_stop(SDL_Recorder *rec) {
+  if (rec->lock) {
+    SDL_LockMutex(rec->lock);
+    rec->stopped = 1;
+    SDL_CondBroadcast(rec->ready);
+    SDL_UnlockMutex(rec->lock);
+  }
+
+  for (int i = 0; i < rec->n_threads; i++) {
+    if (rec->threads[i]) SDL_WaitThread(rec->threads[i], NULL);
+    rec->threads[i] = NULL;
+  }
+
+  if (rec->out) {
+    fclose(rec->out);
+    rec->out = NULL;
+  }
+}
+
+static void *_Recorder_stop_without_gvl(void *rec) {
+  _Recorder_stop(rec);
+  return NULL;
+}
+
+// Returns non-NULL once there's a free slot or the recorder stopped,
+// NULL if woken by an interrupt first.
+static void *_Recorder_wait_for_slot(void *data) {
+  SDL_Recorder *rec = data;
+
+  SDL_LockMutex(rec->lock);
+  while (!rec->n_free && !rec->stopped && !rec->woken)
+    SDL_CondWait(rec->freed, rec->lock);
+
+  int done = rec->n_free || rec->stopped;
+
+  rec->woken = 0;
+  SDL_UnlockMutex(rec->lock);
+
+  return done ? rec : NULL;
+}
+
+// Any interrupt (^C, a trap, Thread#wakeup) just wakes the waiter. The
+// capture handles it and goes back to waiting if it's still alive.
+static void _Recorder_unblock(void *data) {
+  SDL_Recorder *rec = data;
+
+  SDL_LockMutex(rec->lock);
+  rec->woken = 1;
+  SDL_CondBroadcast(rec->freed);
+  SDL_UnlockMutex(rec->lock);
+}
+
+static void _Recorder_capture(SDL_Recorder *rec, SDL_Renderer *renderer) {
+  if (rec->stopped) return;
+
+  if (rec->block)
+    while (!rb_thread_call_without_gvl(_Recorder_wait_for_slot, rec,
+                                       _Recorder_unblock, rec))
+      rb_thread_check_ints();
+
+  SDL_LockMutex(rec->lock);
+
+  if (!rec->n_free || rec->stopped) {
+    if (!rec->stopped) rec->dropped++;
+    SDL_UnlockMutex(rec->lock);
+    return;
+  }
+
+  int slot = rec->free_slots[--rec->n_free];
+  SDL_UnlockMutex(rec->lock);
+
+  SDL_Rect rect = { 0, 0, rec->w, rec->h };
+
+  if (SDL_RenderReadPixels(renderer, &rect, SDL_PIXELFORMAT_RGBA32,
+                           rec->slots[slot], rec->pitch)) {
+    SDL_LockMutex(rec->lock);
+    rec->free_slots[rec->n_free++] = slot;
+    SDL_UnlockMutex(rec->lock);
+    FAILURE("Recorder#capture");
+  }
+
+  SDL_LockMutex(rec->lock);
+  rec->seqs[slot] = rec->captured++;
+  rec->queue[(rec->q_head + rec->q_len) % rec->depth] = slot;
+  rec->q_len++;
+  SDL_CondSignal(rec->ready);
+  SDL_UnlockMutex(rec->lock);
+}
+
+static VALUE Recorder_stop(VALUE self) {
+  DEFINE_SELF(Recorder, rec, self);
+
+  rb_thread_call_without_gvl(_Recorder_stop_without_gvl, rec, NULL, NULL);
+
+  return self;
+}
+
+static VALUE Recorder_frames(VALUE self) {
+  DEFINE_SELF(Recorder, rec, self);
+
+  return UINT2NUM(rec->written);
+}
+
+static VALUE Recorder_dropped(VALUE self) {
+  DEFINE_SELF(Recorder, rec, self);
+
+  return UINT2NUM(rec->dropped);
+}
+
+static VALUE Recorder_failed(VALUE self) {
+  DEFINE_SELF(Recorder, rec, self);
+
+  return UINT2NUM(rec->failed);
+}
+
+//// SDL::Screen methods:
+
+static VALUE Screen_s_open(VALUE klass, VALUE w_, VALUE h_, VALUE bpp_, VALUE flags_) {
+  UNUSED(klass);
+
+  int w        = NUM2INT(w_);
+  int h        = NUM2INT(h_);
+  int bpp      = NUM2INT(bpp_);
+  Uint32 flags = NUM2UINT32(flags_);
+
+  if (!bpp) bpp = 32; // TODO: remove bpp option and always be 32?
+
+  SDL_Window *window =
+    SDL_CreateWindow("", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
+                     w, h,
+                     flags);
+  if (!window) FAILURE("Screen.open(CreateWindow)");
+
+  SDL_Renderer *renderer =
+    SDL_CreateRenderer(window, -1,
+                       SDL_RENDERER_PRESENTVSYNC|SDL_RENDERER_ACCELERATED);
+  if (!renderer) FAILURE("Screen.open(CreateRenderer)");
+
+  // bumps the refcount and returns the same thing
+  SDL_PixelFormat *format = SDL_AllocFormat(SDL_PIXELFORMAT_RGBA32);
+  if (!format)
+    rb_raise(eSDLError, "SDL_AllocFormat freaked out.");
+
+  VALUE vrenderer = TypedData_Wrap_Struct(cRenderer, &_Renderer_type, renderer);
+  VALUE vwindow   = TypedData_Wrap_Struct(cWindow,   &_Window_type,   window);
+  VALUE vformat   = TypedData_Wrap_Struct(cPixelFormat, &_PixelFormat_type, format);
+
+  rb_ivar_set(vrenderer, id_iv_window,  vwindow);
+  rb_ivar_set(vrenderer, id_iv_format,  vformat);
+
+  return vrenderer;
+}
+
+static VALUE Renderer_new_texture(VALUE self) {
+  DEFINE_SELF(Renderer, renderer, self);
+
+  int w, h;
+  if (SDL_GetRendererOutputSize(renderer, &w, &h))
+    FAILURE("Renderer#new_texture(GetRendererOutputSize");
+
+  SDL_Texture *texture = SDL_CreateTexture(renderer,
+                                           SDL_PIXELFORMAT_RGBA32,
+                                           SDL_TEXTUREACCESS_TARGET,
+                                           w, h);
+  if (!texture)
+    FAILURE("Renderer#new_texture(CreateTexture)");
+
+  return _Texture_wrap(texture);
+}
+
+
+static VALUE Renderer_present(VALUE self) {
+  DEFINE_SELF(Renderer, renderer, self);
+  VALUE vrec = rb_attr_get(self, id_iv_recorder);
+
+  if (RTEST(vrec))
+    _Recorder_capture(ruby_to_Recorder(vrec), renderer);
+
+  SDL_RenderPresent(renderer);
+
+  return Qnil;
+}
+
+//// SDL::Surface methods:
+
+// Pixels we own; SDL_PREALLOC pixels (eg a bundle's) belong to someone else.
+static size_t _Surface_bytes(const SDL_Surface *surface) {
+  if (surface->flags & SDL_PREALLOC) return 0;
+
+  return (size_t)surface->pitch * surface->h;
+}
+
+// Every surface handed to ruby goes through here so the GC knows
+// about the pixels and not just the struct.
+static VALUE _Surface_wrap(SDL_Surface *surface) {
+  rb_gc_adjust_memory_usage((ssize_t)_Surface_bytes(surface));
+
+  return TypedData_Wrap_Struct(cSurface, &_Surface_type, surface);
+}
+
+static void _Surface_free(void* surface) {
+  if (is_quit) return;
+  if (!surface) return;
+
+  rb_gc_adjust_memory_usage(-(ssize_t)_Surface_bytes(surface));
+  SDL_FreeSurface(surface);
+}
+
+static void _Surface_mark(void* surface) {
+  UNUSED(surface);
+}
+
+static size_t _Surface_memsize(const void *p) {
+  return p ? sizeof(struct SDL_Surface) + _Surface_bytes(p) : 0;
+}
+
+static VALUE Surface_s_load(VALUE klass, VALUE path) {
+  UNUSED(klass);
+  SDL_Surface *surface;
+
+  ExportStringValue(path);
+
+  surface = IMG_Load(RSTRING_PTR(path));
+
+  if (!surface)
+    rb_raise(eSDLError, "Couldn't load file %s : %s",
+             RSTRING_PTR(path),
+             SDL_GetError());
+
+  return _Surface_wrap(surface);
+}
+
+static VALUE Surface_s_load_async(int argc, VALUE *argv, VALUE klass) {
+  UNUSED(klass);
+  VALUE paths, opts;
+  VALUE threads_ = Qundef;
+  ID keys[] = { rb_intern("threads") };
+
+  rb_scan_args(argc, argv, "1:", &paths, &opts);
+  if (!NIL_P(opts))
+    rb_get_kwargs(opts, keys, 0, 1, &threads_);
+
+  paths = rb_Array(paths);
+  long len = RARRAY_LEN(paths);
+  int nthreads = threads_ == Qundef ? SDL_GetCPUCount() : NUM2INT(threads_);
+
+  SDL_Loader *loader;
+  VALUE vloader = TypedData_Make_Struct(cLoader, SDL_Loader, &_Loader_type, loader);
+
+  loader->names    = rb_ary_new();
+  loader->results  = rb_hash_new();
+  loader->pending  = rb_ary_new();
+  loader->aliases  = rb_ary_new();
+  loader->paths    = ZALLOC_N(char*, len);
+  loader->surfaces = ZALLOC_N(SDL_Surface*, len);
+  loader->errors   = ZALLOC_N(char*, len);
+  loader->finished = ZALLOC_N(Uint8, len);
+
+  // Anything cached or asked for twice, however it's spelled, is only
+  // loaded once. seen maps each expanded path to the path it was first
+  // asked for as.
+  VALUE seen = rb_hash_new();
+
+  for (long i = 0; i < len; i++) {
+    VALUE path  = rb_str_to_str(RARRAY_AREF(paths, i));
+    VALUE key   = rb_file_expand_path(path, Qnil);
+    VALUE first = rb_hash_lookup(seen, key);
+
+    if (!NIL_P(first)) {
+      if (!RTEST(rb_str_equal(first, path)))
+        rb_ary_push(loader->aliases, rb_assoc_new(path, first));
+      continue;
+    }
+    rb_hash_aset(seen, key, path);
+
+    VALUE cached = rb_hash_lookup(surface_cache, key);
+    if (!NIL_P(cached)) {
+      rb_hash_aset(loader->results, path, cached);
+      if (!_Surface_textured_p(cached))
+        rb_ary_push(loader->pending, cached);
+      loader->n_cached++;
+      continue;
+    }
+
+    rb_ary_push(loader->names, path);
+    loader->paths[loader->count++] = ruby_strdup(StringValueCStr(key));
+  }
+
+  if (nthreads < 1) nthreads = 1;
+  if (nthreads > loader->count) nthreads = loader->count;
+
+  loader->threads = ZALLOC_N(SDL_Thread*, nthreads);
+  loader->lock    = SDL_CreateMutex();
+  loader->done    = SDL_CreateCond();
+  if (!loader->lock || !loader->done)
+    FAILURE("Surface.load_async(CreateMutex)");
+
+  for (int i = 0; i < nthreads; i++) {
+    loader->threads[i] = SDL_CreateThread(_Loader_work, "loader", loader);
+    if (!loader->threads[i])
+      FAILURE("Surface.load_async(CreateThread)");
+    loader->n_threads = i + 1;
+  }
+
+  return vloader;
+}
+
+static VALUE Surface_s_cache(VALUE klass) {
+  UNUSED(klass);
+
+  return surface_cache;
+}
+
+// Surfaces in the cache are shared by everyone who loads that path, so
+// they're marked read only. See _Surface_check_cached.
+static VALUE _Surface_cache(VALUE key, VALUE surface) {
+  rb_ivar_set(surface, id_iv_cached, Qtrue);
+  rb_hash_aset(surface_cache, key, surface);
+
+  return surface;
+}
+
+// cached(path)
+//
+// Loads path once and returns the shared, read only surface for it
+// from then on. Paths are expanded, so "a.png" and "./a.png" are the
+// same image.
+
+static VALUE Surface_s_cached(VALUE klass, VALUE path) {
+  VALUE key     = rb_file_expand_path(path, Qnil);
+  VALUE surface = rb_hash_lookup(surface_cache, key);
+
+  if (NIL_P(surface))
+    surface = _Surface_cache(key, Surface_s_load(klass, key));
+
+  return surface;
+}
+
+// Empties the cache. Surfaces still in use stay read only.
+
+static VALUE Surface_s_clear_cache(VALUE klass) {
+  UNUSED(klass);
+
+  return rb_hash_clear(surface_cache);
+}
+
+#define DEFINE_WRAP12(name)                                \
+  void wrap_##name(SDL_Surface* a,                         \
+                   Sint16 b, Sint16 c, Sint16 d, Sint16 e, \
+                   Sint16 f, Sint16 g, Sint16 h, Sint16 i, \
+                   int j,                                  \
+                   Uint32 k, Uint8 l) { name(a, b, c, d, e, f, g, h, i, j, k); }
+#define DEFINE_WRAP7(name)                                 \
+  void wrap_##name(SDL_Surface* a,                         \
+                   Sint16 b, Sint16 c, Sint16 d, Sint16 e, \
+                   Uint32 f, Uint8 g) { name(a, b, c, d, e, f); }
+#define DEFINE_WRAP6(name)                                 \
+  void wrap_##name(SDL_Surface* a,                         \
+                   Sint16 b, Sint16 c, Sint16 d,           \
+                   Uint32 e, Uint8 f) { name(a, b, c, d, e); }
+
+#define IDX1(a)                                 !!(a)
+#define IDX2(a, b)                 (!!(a))<<1 | !!(b)
+#define IDX3(a, b, c) (!!(a))<<2 | (!!(b))<<1 | !!(c)
+
+typedef int (*f_rxyxyc)(SDL_Renderer*,
+                        Sint16, Sint16, Sint16, Sint16,
+                        Uint32);
+typedef int (*f_rxyrc)(SDL_Renderer*,
+                        Sint16, Sint16, Sint16,
+                        Uint32);
+
+// TODO: ? maybe ?
+// int  hlineColor                  (SDL_Renderer *renderer, Sint16 x1, Sint16 x2, Sint16 y, Uint32 color)
+// int  vlineColor                  (SDL_Renderer *renderer, Sint16 x, Sint16 y1, Sint16 y2, Uint32 color)
+// int  roundedBoxColor             (SDL_Renderer *renderer, Sint16 x1, Sint16 y1, Sint16 x2, Sint16 y2, Sint16 rad, Uint32 color)
+// int  pieColor                    (SDL_Renderer *renderer, Sint16 x, Sint16 y, Sint16 rad, Sint16 start, Sint16 end, Uint32 color)
+// int  filledPieColor              (SDL_Renderer *renderer, Sint16 x, Sint16 y, Sint16 rad, Sint16 start, Sint16 end, Uint32 color)
+// int  trigonColor                 (SDL_Renderer *renderer, Sint16 x1, Sint16 y1, Sint16 x2, Sint16 y2, Sint16 x3, Sint16 y3, Uint32 color)
+// int  aatrigonColor               (SDL_Renderer *renderer, Sint16 x1, Sint16 y1, Sint16 x2, Sint16 y2, Sint16 x3, Sint16 y3, Uint32 color)
+// int  filledTrigonColor           (SDL_Renderer *renderer, Sint16 x1, Sint16 y1, Sint16 x2, Sint16 y2, Sint16 x3, Sint16 y3, Uint32 color)
+// int  texturedPolygon             (SDL_Renderer *renderer, const Sint16 *vx, const Sint16 *vy, int n, SDL_Surface *texture, int texture_dx, int texture_dy)
+// void gfxPrimitivesSetFont        (const void *fontdata, Uint32 cw, Uint32 ch)
+// void gfxPrimitivesSetFontRotation(Uint32 rotation)
+// int  characterColor              (SDL_Renderer *renderer, Sint16 x, Sint16 y, char c, Uint32 color)
+// int  stringColor                 (SDL_Renderer *renderer, Sint16 x, Sint16 y, const char *s, Uint32 color)
+
+// Sets the draw color (and blending, like SDL2_gfx does) for the
+// plain SDL line drawing calls.
+static int _Renderer_draw_color(SDL_Renderer *renderer, SDL_Color c) {
+  return (SDL_SetRenderDrawBlendMode(renderer, c.a == 255 ? SDL_BLENDMODE_NONE
+                                                          : SDL_BLENDMODE_BLEND) ||
+          SDL_SetRenderDrawColor(renderer, c.r, c.g, c.b, c.a));
+}
+
+// Bezier curves of any degree, flattened by recursive subdivision
+// until every control point is within tolerance pixels of the chord.
+// Points go into a fixed buffer that's drawn whenever it fills up,
+// so nothing is allocated however long the curve is. A single curve
+// with more control points than subdivision handles is sampled
+// evenly instead, see _curve_sample.
+//
+// Without aa the points are one polyline. With aa each point gets a
+// vertex on the curve and one a pixel out either side, faded to
+// clear, and the whole strip is one geometry call.
+
+#define CURVE_MAX_DEGREE 15
+#define CURVE_MAX_DEPTH  16
+#define CURVE_MAX_STEPS  4096
+#define CURVE_CHUNK      128
+
+typedef struct {
+  double x, y;
+} curve_point;
+
+typedef struct {
+  SDL_Renderer *renderer;
+  SDL_Color     color;
+  int           aa;
+  double        tolerance2;
+  int           n, failed;
+  SDL_FPoint    pts[CURVE_CHUNK];
+  SDL_Vertex    verts[3 * CURVE_CHUNK];
+  int           indices[12 * (CURVE_CHUNK - 1)];
+} curve_sink;
+
+static void _curve_strip(curve_sink *s) {
+  SDL_Color clear = s->color;
+  int n = s->n;
+
+  clear.a = 0;
+
+  for (int i = 0; i < n; i++) {
+    SDL_FPoint a = s->pts[i > 0 ? i - 1 : 0];
+    SDL_FPoint b = s->pts[i < n - 1 ? i + 1 : n - 1];
+    float dx = b.x - a.x, dy = b.y - a.y;
+    float len = SDL_sqrtf(dx * dx + dy * dy);
+    float nx = len > 0 ? -dy / len : 0;
+    float ny = len > 0 ?  dx / len : 0;
+    SDL_Vertex *v = &s->verts[3 * i];
+
+    v[0].position = (SDL_FPoint) { s->pts[i].x + nx, s->pts[i].y + ny };
+    v[1].position = s->pts[i];
+    v[2].position = (SDL_FPoint) { s->pts[i].x - nx, s->pts[i].y - ny };
+    v[0].color = v[2].color = clear;
+    v[1].color = s->color;
+    v[0].tex_coord = v[1].tex_coord = v[2].tex_coord = (SDL_FPoint) { 0, 0 };
+  }
+
+  int *idx = s->indices;
+
+  for (int i = 0; i < n - 1; i++) {
+    int a = 3 * i, b = 3 * (i + 1);
+
+    for (int side = 0; side < 2; side++, a++, b++) {
+      *idx++ = a; *idx++ = a + 1; *idx++ = b;
+      *idx++ = b; *idx++ = a + 1; *idx++ = b + 1;
+    }
+  }
+
+  // Untextured geometry blends with the draw blend mode, which an
+  // opaque draw color leaves at NONE, and the fringe has to fade.
+  if (SDL_SetRenderDrawBlendMode(s->renderer, SDL_BLENDMODE_BLEND) ||
+      SDL_RenderGeometry(s->renderer, NULL, s->verts, 3 * n,
+                         s->indices, 12 * (n - 1)))
+    s->failed = 1;
+}
+
+static void _curve_flush(curve_sink *s) {
+  if (s->n < 2) return;
+
+  if (s->aa)
+    _curve_strip(s);
+  else if (SDL_RenderDrawLinesF(s->renderer, s->pts, s->n))
+    s->failed = 1;
+
+  s->pts[0] = s->pts[s->n - 1];         // the next chunk picks up here
+  s->n = 1;
+}
+
+static void _curve_emit(curve_sink *s, curve_point p) {
+  if (s->n == CURVE_CHUNK)
+    _curve_flush(s);
+
+  s->pts[s->n++] = (SDL_FPoint) { (float)p.x, (float)p.y };
+}
+
+static int _curve_flat(const curve_sink *s, const curve_point *cp, int degree) {
+  double dx = cp[degree].x - cp[0].x, dy = cp[degree].y - cp[0].y;
+  double len2 = dx * dx + dy * dy;
+
+  for (int i = 1; i < degree; i++) {
+    double px = cp[i].x - cp[0].x, py = cp[i].y - cp[0].y;
+
+    // distance to the chord itself, not the line through it, so a
+    // control point out past either end doesn't count as flat
+    if (len2 > 1e-12) {
+      double t = (px * dx + py * dy) / len2;
+
+      if (t < 0) t = 0;
+      if (t > 1) t = 1;
+
+      px -= t * dx;
+      py -= t * dy;
+    }
+
+    if (px * px + py * py > s->tolerance2) return 0;
+  }
+
+  return 1;
+}
+
+// Emits everything after cp[0].
+static void _curve_flatten(curve_sink *s, const curve_point *cp, int degree,
+                           int depth) {
+  if (depth >= CURVE_MAX_DEPTH || _curve_flat(s, cp, degree)) {
+    _curve_emit(s, cp[degree]);
+    return;
+  }
+
+  curve_point tmp[CURVE_MAX_DEGREE + 1];
+  curve_point left[CURVE_MAX_DEGREE + 1], right[CURVE_MAX_DEGREE + 1];
+
+  memcpy(tmp, cp, (degree + 1) * sizeof(curve_point));
+
+  left[0]       = tmp[0];
+  right[degree] = tmp[degree];
+
+  for (int k = 1; k <= degree; k++) {   // de Casteljau at t = 1/2
+    for (int i = 0; i <= degree - k; i++) {
+      tmp[i].x = (tmp[i].x + tmp[i + 1].x) / 2;
+      tmp[i].y = (tmp[i].y + tmp[i + 1].y) / 2;
+    }
+
+    left[k]           = tmp[0];
+    right[degree - k] = tmp[degree - k];
+  }
+
+  _curve_flatten(s, left,  degree, depth + 1);
+  _curve_flatten(s, right, degree, depth + 1);
+}
+
+// points is a flat array of x, y numbers or a string of packed
+// float64s.
+static curve_point _curve_point(VALUE points, long i, int flip, double h);
+
+// Emits everything after the first of n points. For a degree d curve
+// the chords of k even steps are within
+// d(d-1)/8 * max |P[i] - 2P[i+1] + P[i+2]| / k^2 of it, so k is picked
+// to keep that under tolerance.
+static void _curve_sample(curve_sink *s, VALUE points, long n,
+                          int flip, double h) {
+  VALUE tmp;
+  curve_point *cp   = ALLOCV_N(curve_point, tmp, 2 * n);
+  curve_point *work = cp + n;
+  double d2 = 0;
+
+  for (long i = 0; i < n; i++)
+    cp[i] = _curve_point(points, i, flip, h);
+
+  for (long i = 0; i + 2 < n; i++) {
+    double x = cp[i].x - 2 * cp[i + 1].x + cp[i + 2].x;
+    double y = cp[i].y - 2 * cp[i + 1].y + cp[i + 2].y;
+
+    if (x * x + y * y > d2) d2 = x * x + y * y;
+  }
+
+  double d     = (double)(n - 1);
+  double bound = d * (d - 1) / 8 * sqrt(d2);
+  double steps = ceil(sqrt(bound / sqrt(s->tolerance2)));
+
+  if (steps < 1)               steps = 1;
+  if (steps > CURVE_MAX_STEPS) steps = CURVE_MAX_STEPS;
+
+  for (long k = 1; k <= (long)steps; k++) {
+    double t = k / steps;
+
+    memcpy(work, cp, n * sizeof(curve_point));
+
+    for (long j = 1; j < n; j++)        // de Casteljau at t
+      for (long i = 0; i < n - j; i++) {
+        work[i].x += (work[i + 1].x - work[i].x) * t;
+        work[i].y += (work[i + 1].y - work[i].y) * t;
+      }
+
+    _curve_emit(s, work[0]);
+  }
+
+  ALLOCV_END(tmp);
+}
+
+static curve_point _curve_point(VALUE points, long i, int flip, double h) {
+  curve_point p;
+
+  if (RB_TYPE_P(points, T_STRING)) {
+    memcpy(&p, RSTRING_PTR(points) + i * sizeof(p), sizeof(p));
+  } else {
+    p.x = NUM2DBL(RARRAY_AREF(points, 2 * i));
+    p.y = NUM2DBL(RARRAY_AREF(points, 2 * i + 1));
+  }
+
+  if (flip) p.y = h - p.y;
+
+  return p;
+}
+
+// The number of points in a flat array or packed string of them.
+static long _curve_length(VALUE points) {
+  if (RB_TYPE_P(points, T_STRING)) {
+    if (RSTRING_LEN(points) % sizeof(curve_point))
+      rb_raise(rb_eArgError, "%ld bytes isn't packed x, y float64s",
+               RSTRING_LEN(points));
+    return RSTRING_LEN(points) / (long)sizeof(curve_point);
+  }
+
+  Check_Type(points, T_ARRAY);
+  if (RARRAY_LEN(points) % 2)
+    rb_raise(rb_eArgError, "odd number of coordinates");
+
+  return RARRAY_LEN(points) / 2;
+}
+
+// draw_bezier(points, color, degree: nil, h: nil, aa: false, tolerance: 0.25)
+//
+// points is x0, y0, x1, y1, ... as an array or packed float64s. With
+// no degree they're the control points of one curve, however many
+// there are. With one, they are a path of curves of that degree (up
+// to 15), each starting where the last one ended: 1 + degree * curves
+// points. Points are flipped about h unless it's nil. Curves are
+// flattened to within tolerance pixels.
+
+static VALUE Renderer_draw_bezier(int argc, VALUE *argv, VALUE self) {
+  DEFINE_SELF(Renderer, renderer, self);
+  VALUE points, color_, opts;
+  VALUE vals[4];
+  ID keys[4] = { rb_intern("degree"), rb_intern("h"), rb_intern("aa"),
+                 rb_intern("tolerance") };
+
+  rb_scan_args(argc, argv, "2:", &points, &color_, &opts);
+  rb_get_kwargs(opts, keys, 0, 4, vals);
+
+  long n = _curve_length(points);
+
+  if (n < 2) return Qnil;
+
+  int  single = vals[0] == Qundef || NIL_P(vals[0]);
+  long degree = single ? n - 1 : NUM2LONG(vals[0]);
+
+  if (degree < 1 || (degree > CURVE_MAX_DEGREE && !single))
+    rb_raise(rb_eArgError, "degree must be 1-%d, not %ld", CURVE_MAX_DEGREE, degree);
+  if ((n - 1) % degree)
+    rb_raise(rb_eArgError, "%ld points isn't a path of degree %ld curves", n, degree);
+
+  int    flip = vals[1] != Qundef && !NIL_P(vals[1]);
+  double h    = flip ? NUM2DBL(vals[1]) : 0;
+  double tol  = vals[3] == Qundef ? 0.25 : NUM2DBL(vals[3]);
+
+  if (!(tol > 0))
+    rb_raise(rb_eArgError, "tolerance must be positive");
+
+  Uint32 color = VALUE2COLOR(color_);
+  curve_sink sink, *s = &sink;
+
+  s->renderer   = renderer;
+  s->aa         = vals[2] != Qundef && RTEST(vals[2]);
+  s->tolerance2 = tol * tol;
+  s->n          = 0;
+  s->failed     = 0;
+  memcpy(&s->color, &color, sizeof(s->color)); // same byte order SDL2_gfx uses
+
+  if (!s->aa && _Renderer_draw_color(renderer, s->color))
+    FAILURE("Renderer#draw_bezier");
+
+  curve_point cp[CURVE_MAX_DEGREE + 1];
+
+  cp[0] = _curve_point(points, 0, flip, h);
+  _curve_emit(s, cp[0]);
+
+  if (degree > CURVE_MAX_DEGREE) {
+    _curve_sample(s, points, n, flip, h);
+  } else {
+    for (long i = 0; i + degree < n; i += degree) {
+      cp[0] = _curve_point(points, i, flip, h);
+
+      for (int k = 1; k <= degree; k++)
+        cp[k] = _curve_point(points, i + k, flip, h);
+
+      _curve_flatten(s, cp, (int)degree, 0);
+    }
+  }
+
+  _curve_flush(s);
+
+  if (s->failed)
+    FAILURE("Renderer#draw_bezier");
+
+  return Qnil;
+}
+
+// Small circles & ellipses are drawn from stamps, see below.
+
+enum { STAMP_CIRCLE, STAMP_ELLIPSE };
+
+#define STAMP_MAX_RADIUS 32
+
+// @stamps is false once they're turned off, see Renderer#stamps=.
+static int _Renderer_stamps_fit(VALUE self, int rx, int ry) {
+  return (rx >= 0 && rx <= STAMP_MAX_RADIUS &&
+          ry >= 0 && ry <= STAMP_MAX_RADIUS &&
+          rb_attr_get(self, id_iv_stamps) != Qfalse);
+}
+
+static int _Renderer_stamp(VALUE self, int shape, int rx, int ry,
+                           int aa, int fill, const SDL_Point *centers, long n,
+                           const Uint32 *colors, Uint32 color);
+
+int aafilledCircleColor(SDL_Renderer * renderer, Sint16 x, Sint16 y, Sint16 rad, Uint32 color) {
+  int result = 0;
+  result |= filledCircleColor(renderer, x, y, rad, color);
+  result |= aacircleColor(renderer, x, y, rad, color);
+  return result;
+}
+
+static f_rxyrc f_circle[] = { &circleColor,
+                              &filledCircleColor,
+                              &aacircleColor,
+                              &aafilledCircleColor };
+
+static VALUE Renderer_draw_circle(VALUE self,
+                                  VALUE x,  VALUE y,
+                                  VALUE r,
+                                  VALUE c,
+                                  VALUE aa, VALUE f) {
+  DEFINE_SELF(Renderer, renderer, self);
+
+  Uint8 idx = IDX2(RTEST(aa), RTEST(f));
+  SDL_Point center = { NUM2SINT16(x), NUM2SINT16(y) };
+  Sint16 rad = NUM2SINT16(r);
+
+  if (_Renderer_stamps_fit(self, rad, rad)) {
+    if (_Renderer_stamp(self, STAMP_CIRCLE, rad, rad, RTEST(aa), RTEST(f),
+                        &center, 1, NULL, NUM2UINT(c)))
+      FAILURE("Renderer#draw_circle");
+    return Qnil;
+  }
+
+  f_circle[idx](renderer,
+                center.x, center.y,
+                rad,
+                NUM2UINT(c));
+
+  return Qnil;
+}
+
+int aafilledEllipseColor(SDL_Renderer * renderer, Sint16 x, Sint16 y, Sint16 rx, Sint16 ry, Uint32 color) {
+  int result = 0;
+  result |= filledEllipseColor(renderer, x, y, rx, ry, color);
+  result |= aaellipseColor(renderer, x, y, rx, ry, color);
+  return result;
+}
+
+static f_rxyxyc f_ellipse[] = { &ellipseColor,
+                                &filledEllipseColor,
+                                &aaellipseColor,
+                                &aafilledEllipseColor };
+
+static VALUE Renderer_draw_ellipse(VALUE self,
+                                   VALUE x,  VALUE y,
+                                   VALUE rx, VALUE ry,
+                                   VALUE c,
+                                   VALUE aa, VALUE f) {
+  DEFINE_SELF(Renderer, renderer, self);
+
+  Uint8 idx = IDX2(RTEST(aa), RTEST(f));
+  SDL_Point center = { NUM2SINT16(x), NUM2SINT16(y) };
+  Sint16 w = NUM2SINT16(rx), h = NUM2SINT16(ry);
+
+  if (_Renderer_stamps_fit(self, w, h)) {
+    if (_Renderer_stamp(self, STAMP_ELLIPSE, w, h, RTEST(aa), RTEST(f),
+                        &center, 1, NULL, NUM2UINT(c)))
+      FAILURE("Renderer#draw_ellipse");
+    return Qnil;
+  }
+
+  f_ellipse[idx](renderer,
+                 center.x,
+                 center.y,
+                 w,
+                 h,
+                 NUM2UINT(c));
+
+  return Qnil;
+}
+
+static f_rxyxyc f_line[] = { &lineColor,
+                             &aalineColor };
+
+static VALUE Renderer_draw_line(VALUE self,
+                                VALUE x1, VALUE y1,
+                                VALUE x2, VALUE y2,
+                                VALUE c,
+                                VALUE aa) {
+  DEFINE_SELF(Renderer, renderer, self);
+
+  Uint8 idx = IDX1(RTEST(aa));
+
+  f_line[idx](renderer,
+              NUM2SINT16(x1),
+              NUM2SINT16(y1),
+              NUM2SINT16(x2),
+              NUM2SINT16(y2),
+              VALUE2COLOR(c));
+
+  return Qnil;
+}
+
+// Ear clipping: a simple polygon of n points becomes n - 2 triangles.
+// Each pass clips a convex corner with no other point inside it. If
+// there isn't one (self-intersecting or degenerate polygons), it
+// clips a corner anyway, so it always finishes.
+//
+// It's O(n^2) or worse, so draw_polygon caches triangulations by
+// vertex data: static shapes only pay for it once.
+
+static double _polygon_cross(SDL_FPoint a, SDL_FPoint b, SDL_FPoint c) {
+  return ((double)b.x - a.x) * ((double)c.y - a.y) -
+         ((double)b.y - a.y) * ((double)c.x - a.x);
+}
+
+// scratch is 2 * n ints, tris 3 * (n - 2).
+static void _polygon_triangulate(const SDL_FPoint *pts, int n,
+                                 int *scratch, int *tris) {
+  int *prev = scratch, *next = scratch + n;
+  double area = 0;
+
+  for (int i = 0; i < n; i++) {
+    const SDL_FPoint *a = &pts[i], *b = &pts[(i + 1) % n];
+    area += (double)a->x * b->y - (double)b->x * a->y;
+    prev[i] = (i + n - 1) % n;
+    next[i] = (i + 1) % n;
+  }
+
+  double s = area < 0 ? -1 : 1;         // either winding works
+  int left = n, i = 0, misses = 0;
+
+  while (left > 3) {
+    int a = prev[i], b = i, c = next[i];
+    int ear = s * _polygon_cross(pts[a], pts[b], pts[c]) > 0;
+
+    for (int j = next[c]; ear && j != a; j = next[j]) {
+      SDL_FPoint p = pts[j];
+
+      if ((p.x == pts[a].x && p.y == pts[a].y) ||
+          (p.x == pts[c].x && p.y == pts[c].y))
+        continue;                       // touching isn't inside
+
+      ear = !(s * _polygon_cross(pts[a], pts[b], p) >= 0 &&
+              s * _polygon_cross(pts[b], pts[c], p) >= 0 &&
+              s * _polygon_cross(pts[c], pts[a], p) >= 0);
+    }
+
+    if (ear || misses > left) {
+      *tris++ = a;
+      *tris++ = b;
+      *tris++ = c;
+      next[a] = c;
+      prev[c] = a;
+      left--;
+      i = c;
+      misses = 0;
+    } else {
+      i = next[i];
+      misses++;
+    }
+  }
+
+  *tris++ = prev[i];
+  *tris++ = i;
+  *tris++ = next[i];
+}
+
+// A small direct mapped cache of triangulations, shared by every
+// renderer (the triangles only depend on the points). Entries are
+// malloced so nothing ruby happens under the lock.
+
+#define POLYGON_CACHE_SIZE 256
+
+typedef struct {
+  st_index_t  hash;
+  int         n;
+  SDL_FPoint *pts;
+  int        *tris;
+} polygon_entry;
+
+static polygon_entry polygon_cache[POLYGON_CACHE_SIZE];
+static SDL_mutex    *polygon_lock;
+
+static void _polygon_triangles(const SDL_FPoint *pts, int n,
+                               int *scratch, int *tris) {
+  size_t bytes  = n * sizeof(SDL_FPoint);
+  size_t nidx   = 3 * (size_t)(n - 2);
+  st_index_t hash = rb_memhash(pts, (long)bytes);
+  polygon_entry *e = &polygon_cache[hash % POLYGON_CACHE_SIZE];
+
+  SDL_LockMutex(polygon_lock);
+
+  if (e->pts && e->hash == hash && e->n == n && !memcmp(e->pts, pts, bytes)) {
+    memcpy(tris, e->tris, nidx * sizeof(int));
+    SDL_UnlockMutex(polygon_lock);
+    return;
+  }
+
+  _polygon_triangulate(pts, n, scratch, tris);
+
+  SDL_FPoint *copy = malloc(bytes);
+  int *idx         = malloc(nidx * sizeof(int));
+
+  if (copy && idx) {
+    free(e->pts);
+    free(e->tris);
+
+    memcpy(copy, pts, bytes);
+    memcpy(idx, tris, nidx * sizeof(int));
+
+    e->hash = hash;
+    e->n    = n;
+    e->pts  = copy;
+    e->tris = idx;
+  } else {                              // just don't cache it
+    free(copy);
+    free(idx);
+  }
+
+  SDL_UnlockMutex(polygon_lock);
+}
+
+// xs & ys are each an array of numbers or a string of packed float64s
+// (Array#pack("d*")). Returns the point count. pts has room for one
+// more point, to close the outline.
+static int _polygon_points(VALUE xs, VALUE ys, SDL_FPoint **pts, VALUE *tmp) {
+  long n;
+
+  if (RB_TYPE_P(xs, T_STRING) && RB_TYPE_P(ys, T_STRING)) {
+    if (RSTRING_LEN(xs) != RSTRING_LEN(ys))
+      rb_raise(rb_eArgError, "xs & ys are different length");
+    if (RSTRING_LEN(xs) % sizeof(double))
+      rb_raise(rb_eArgError, "%ld bytes isn't packed float64s", RSTRING_LEN(xs));
+
+    n = RSTRING_LEN(xs) / (long)sizeof(double);
+    *pts = ALLOCV_N(SDL_FPoint, *tmp, n + 1);
+
+    const char *px = RSTRING_PTR(xs), *py = RSTRING_PTR(ys);
+
+    for (long i = 0; i < n; i++) {
+      double x, y;
+
+      memcpy(&x, px + i * sizeof(double), sizeof(double)); // maybe unaligned
+      memcpy(&y, py + i * sizeof(double), sizeof(double));
+
+      (*pts)[i].x = (float)x;
+      (*pts)[i].y = (float)y;
+    }
+  } else {
+    Check_Type(xs, T_ARRAY);
+    Check_Type(ys, T_ARRAY);
+
+    if (RARRAY_LEN(xs) != RARRAY_LEN(ys))
+      rb_raise(rb_eArgError, "xs & ys are different length");
+
+    n = RARRAY_LEN(xs);
+    *pts = ALLOCV_N(SDL_FPoint, *tmp, n + 1);
+
+    for (long i = 0; i < n; i++) {
+      (*pts)[i].x = (float)NUM2DBL(RARRAY_AREF(xs, i));
+      (*pts)[i].y = (float)NUM2DBL(RARRAY_AREF(ys, i));
+    }
+  }
+
+  if (n > INT_MAX / 3)
+    rb_raise(rb_eArgError, "too many points: %ld", n);
+
+  return (int)n;
+}
+
+// draw_polygon(xs, ys, color, fill: false, aa: false)
+//
+// Fills are triangulated and drawn in one geometry call. Outlines are
+// one polyline, or with aa, SDL2_gfx's anti-aliased polygon (which an
+// aa fill also gets around its edge).
+
+static VALUE Renderer_draw_polygon(int argc, VALUE *argv, VALUE self) {
+  DEFINE_SELF(Renderer, renderer, self);
+  VALUE xs, ys, color_, opts;
+  VALUE vals[2];
+  ID keys[2] = { rb_intern("fill"), rb_intern("aa") };
+
+  rb_scan_args(argc, argv, "3:", &xs, &ys, &color_, &opts);
+  rb_get_kwargs(opts, keys, 0, 2, vals);
+
+  int fill = vals[0] != Qundef && RTEST(vals[0]);
+  int aa   = vals[1] != Qundef && RTEST(vals[1]);
+
+  Uint32 color = VALUE2COLOR(color_);
+  SDL_Color c;
+  memcpy(&c, &color, sizeof(c));        // same byte order SDL2_gfx uses
+
+  VALUE pts_v = 0;
+  SDL_FPoint *pts;
+  int n = _polygon_points(xs, ys, &pts, &pts_v);
+
+  if (n < 2) {
+    ALLOCV_END(pts_v);
+    return Qnil;
+  }
+
+  if (fill && n >= 3) {
+    VALUE verts_v, idx_v;
+    SDL_Vertex *verts = ALLOCV_N(SDL_Vertex, verts_v, n);
+    int *idx = ALLOCV_N(int, idx_v, 3 * (size_t)(n - 2) + 2 * (size_t)n);
+
+    for (int i = 0; i < n; i++) {
+      verts[i].position  = pts[i];
+      verts[i].color     = c;
+      verts[i].tex_coord = (SDL_FPoint) { 0, 0 };
+    }
+
+    int *tris = idx, *scratch = idx + 3 * (n - 2);
+
+    if (n == 3) {
+      tris[0] = 0; tris[1] = 1; tris[2] = 2;
+    } else {
+      _polygon_triangles(pts, n, scratch, tris);
+    }
+
+    int bad = SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND) ||
+              SDL_RenderGeometry(renderer, NULL, verts, n, tris, 3 * (n - 2));
+
+    ALLOCV_END(verts_v);
+    ALLOCV_END(idx_v);
+
+    if (bad) {
+      ALLOCV_END(pts_v);
+      FAILURE("Renderer#draw_polygon");
+    }
+  }
+
+  int bad = 0;
+
+  if (aa) {
+    VALUE v_v;
+    Sint16 *vx = ALLOCV_N(Sint16, v_v, 2 * (size_t)n), *vy = vx + n;
+
+    for (int i = 0; i < n; i++) {
+      vx[i] = (Sint16)lrintf(pts[i].x);
+      vy[i] = (Sint16)lrintf(pts[i].y);
+    }
+
+    bad = aapolygonColor(renderer, vx, vy, n, color);
+
+    ALLOCV_END(v_v);
+  } else if (!fill) {
+    pts[n] = pts[0];
+
+    bad = (_Renderer_draw_color(renderer, c) ||
+           SDL_RenderDrawLinesF(renderer, pts, n + 1));
+  }
+
+  ALLOCV_END(pts_v);
+
+  if (bad)
+    FAILURE("Renderer#draw_polygon");
+
+  return Qnil;
+}
+
+// Strokes: polylines, arcs and rounded rects of any width, drawn as
+// one triangle strip. The strip is a list of stations, each a left
+// and right point across the line. Straight joins and miters are one
+// station. Bevels and round joins swing the outside edge around the
+// corner while the inside stays put, so nothing overlaps and
+// translucent strokes blend evenly.
+//
+// With aa, each station also gets a vertex a pixel further out on
+// either side, along that side's outward normal, faded to clear, and
+// butt & square caps get a faded station past the end. A 1px line has
+// no core at all (l == r), just the two fringes.
+
+enum { STROKE_BUTT, STROKE_SQUARE, STROKE_ROUND, STROKE_MITER, STROKE_BEVEL };
+
+static const char *stroke_names[] = { "butt", "square", "round", "miter", "bevel" };
+
+#define STROKE_TOLERANCE 0.25           // pixels off the true curve
+
+typedef struct {
+  SDL_FPoint l, r;
+  SDL_FPoint nl, nr;                    // unit normals out of each side, for the fringe
+  int        fade;
+} stroke_station;
+
+typedef struct {
+  double          hw, fringe, miter_limit, step;
+  int             join, cap;
+  SDL_Color       color;
+  stroke_station *st;
+  int             n;
+} stroke_state;
+
+// Parses a cap (butt..round) or join (round..bevel).
+static int _stroke_kind(VALUE v, int dflt, int lo, int hi, const char *what) {
+  if (v == Qundef || NIL_P(v)) return dflt;
+
+  if (SYMBOL_P(v)) {
+    ID id = SYM2ID(v);
+
+    for (int i = lo; i <= hi; i++)
+      if (id == rb_intern(stroke_names[i])) return i;
+  }
+
+  rb_raise(rb_eArgError, "unknown %s: %"PRIsVALUE, what, v);
+}
+
+// The angle per step that keeps a circle of radius r within tolerance.
+static double _stroke_step(double r) {
+  return r > STROKE_TOLERANCE ? 2 * acos(1 - STROKE_TOLERANCE / r) : M_PI / 2;
+}
+
+static void _stroke_add(stroke_state *s,
+                        curve_point l, curve_point nl,
+                        curve_point r, curve_point nr, int fade) {
+  stroke_station *st = &s->st[s->n++];
+
+  st->l    = (SDL_FPoint) { (float)l.x,  (float)l.y };
+  st->r    = (SDL_FPoint) { (float)r.x,  (float)r.y };
+  st->nl   = (SDL_FPoint) { (float)nl.x, (float)nl.y };
+  st->nr   = (SDL_FPoint) { (float)nr.x, (float)nr.y };
+  st->fade = fade;
+}
+
+// A station straight across p, d pixels either side along v (a unit
+// vector).
+static void _stroke_across(stroke_state *s, curve_point p,
+                           curve_point v, double d, int fade) {
+  curve_point l = { p.x + v.x * d, p.y + v.y * d };
+  curve_point r = { p.x - v.x * d, p.y - v.y * d };
+
+  _stroke_add(s, l, v, r, (curve_point) { -v.x, -v.y }, fade);
+}
+
+static curve_point _stroke_dir(curve_point a, curve_point b, double *len) {
+  double dx = b.x - a.x, dy = b.y - a.y;
+
+  *len = sqrt(dx * dx + dy * dy);
+
+  return (curve_point) { dx / *len, dy / *len };
+}
+
+// Caps the end at p, heading along d. The start comes in from the
+// cap, the end goes out to it.
+static void _stroke_cap(stroke_state *s, curve_point p, curve_point d, int end) {
+  double hw = s->hw;
+  curve_point n = { -d.y, d.x };
+  curve_point e = end ? d : (curve_point) { -d.x, -d.y };
+
+  if (s->cap == STROKE_ROUND) {
+    int k = (int)ceil(M_PI / 2 / s->step);
+
+    for (int i = 0; i <= k; i++) {
+      double phi = M_PI / 2 * (end ? k - i : i) / k;
+      double out = cos(phi), side = sin(phi);
+      curve_point nl = { e.x * out + n.x * side, e.y * out + n.y * side };
+      curve_point nr = { e.x * out - n.x * side, e.y * out - n.y * side };
+      curve_point l  = { p.x + nl.x * hw, p.y + nl.y * hw };
+      curve_point r  = { p.x + nr.x * hw, p.y + nr.y * hw };
+
+      _stroke_add(s, l, nl, r, nr, 0);
+    }
+
+    return;
+  }
+
+  double ext = s->cap == STROKE_SQUARE ? hw : 0;
+  curve_point q    = { p.x + e.x * ext, p.y + e.y * ext };
+  curve_point fade = { q.x + e.x * s->fringe, q.y + e.y * s->fringe };
+
+  if (s->fringe > 0 && !end) _stroke_across(s, fade, n, hw, 1);
+  _stroke_across(s, q, n, hw, 0);
+  if (s->fringe > 0 && end)  _stroke_across(s, fade, n, hw, 1);
+}
+
+// Joins the segment coming into p along d0 to the one leaving along d1.
+static void _stroke_join(stroke_state *s, curve_point p,
+                         curve_point d0, double len0,
+                         curve_point d1, double len1) {
+  double hw    = s->hw;
+  curve_point n0 = { -d0.y, d0.x }, n1 = { -d1.y, d1.x };
+  double cross = d0.x * d1.y - d0.y * d1.x;
+  double dot   = d0.x * d1.x + d0.y * d1.y;
+
+  if (fabs(cross) < 1e-9 && dot > 0) {  // straight on
+    _stroke_across(s, p, n0, hw, 0);
+    return;
+  }
+
+  curve_point m = { n0.x + n1.x, n0.y + n1.y };
+  double mlen  = sqrt(m.x * m.x + m.y * m.y);
+  double cos_h = mlen / 2;              // between m and either normal
+  double miter = 0;
+  int    tight = 1;                     // inner corner overshoots a segment
+
+  if (cos_h > 1e-6) {
+    m.x /= mlen;
+    m.y /= mlen;
+    miter = hw / cos_h;
+
+    double back = hw * sqrt(1 - cos_h * cos_h) / cos_h;
+
+    tight = back > len0 || back > len1;
+  }
+
+  int join = s->join;
+
+  if (join == STROKE_MITER && (tight || miter > s->miter_limit * hw))
+    join = STROKE_BEVEL;
+
+  if (join == STROKE_MITER) {
+    _stroke_across(s, p, m, miter, 0);
+    return;
+  }
+
+  double turn = atan2(cross, dot);
+  double side = turn >= 0 ? 1 : -1;     // the inside is on the left
+  int k = join == STROKE_ROUND ? (int)ceil(fabs(turn) / s->step) : 1;
+
+  if (k < 1) k = 1;
+
+  for (int i = 0; i <= k; i++) {
+    double a = turn * i / k, ca = cos(a), sa = sin(a);
+    curve_point o = { -side * (n0.x * ca - n0.y * sa),
+                      -side * (n0.x * sa + n0.y * ca) };
+    curve_point outer = { p.x + o.x * hw, p.y + o.y * hw };
+    curve_point ni    = !tight ? m : i == k ? n1 : n0;
+    double      d     = !tight ? miter : (i == 0 || i == k) ? hw : 0;
+
+    ni = (curve_point) { side * ni.x, side * ni.y };
+
+    curve_point inner = { p.x + ni.x * d, p.y + ni.y * d };
+
+    if (side > 0)
+      _stroke_add(s, inner, ni, outer, o, 0);
+    else
+      _stroke_add(s, outer, o, inner, ni, 0);
+  }
+}
+
+static SDL_FPoint _stroke_out(SDL_FPoint p, SDL_FPoint n, double d) {
+  return (SDL_FPoint) { (float)(p.x + n.x * d), (float)(p.y + n.y * d) };
+}
+
+static int _stroke_render(SDL_Renderer *renderer, const stroke_state *s) {
+  if (s->n < 2) return 0;
+
+  int aa  = s->fringe > 0;
+  int per = aa ? 4 : 2;
+  SDL_Color clear = s->color;
+  VALUE verts_v, idx_v;
+  SDL_Vertex *verts = ALLOCV_N(SDL_Vertex, verts_v, (size_t)per * s->n);
+  int *idx = ALLOCV_N(int, idx_v, 6 * (size_t)(per - 1) * (s->n - 1));
+  int *ip = idx;
+
+  clear.a = 0;
+
+  for (int i = 0; i < s->n; i++) {
+    const stroke_station *st = &s->st[i];
+    SDL_Vertex *v = &verts[per * i];
+
+    if (aa) {
+      v[0].position = _stroke_out(st->l, st->nl, s->fringe);
+      v[1].position = st->l;
+      v[2].position = st->r;
+      v[3].position = _stroke_out(st->r, st->nr, s->fringe);
+      v[0].color = v[3].color = clear;
+      v[1].color = v[2].color = st->fade ? clear : s->color;
+    } else {
+      v[0].position = st->l;
+      v[1].position = st->r;
+      v[0].color = v[1].color = s->color;
+    }
+
+    for (int j = 0; j < per; j++)
+      v[j].tex_coord = (SDL_FPoint) { 0, 0 };
+  }
+
+  for (int i = 0; i < s->n - 1; i++) {
+    int a = per * i, b = per * (i + 1);
+
+    for (int j = 0; j < per - 1; j++, a++, b++) {
+      *ip++ = a; *ip++ = a + 1; *ip++ = b;
+      *ip++ = b; *ip++ = a + 1; *ip++ = b + 1;
+    }
+  }
+
+  int bad = SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND) ||
+            SDL_RenderGeometry(renderer, NULL, verts, per * s->n,
+                               idx, (int)(ip - idx));
+
+  ALLOCV_END(verts_v);
+  ALLOCV_END(idx_v);
+
+  return bad;
+}
+
+// Strokes the n points in pts, which are deduplicated in place.
+static int _stroke_path(SDL_Renderer *renderer, stroke_state *s,
+                        curve_point *pts, int n, int closed) {
+  int m = 0;
+
+  for (int i = 0; i < n; i++) {
+    if (m > 0) {
+      double dx = pts[i].x - pts[m - 1].x, dy = pts[i].y - pts[m - 1].y;
+      if (dx * dx + dy * dy < 1e-12) continue;
+    }
+    pts[m++] = pts[i];
+  }
+
+  if (closed && m > 1) {
+    double dx = pts[m - 1].x - pts[0].x, dy = pts[m - 1].y - pts[0].y;
+    if (dx * dx + dy * dy < 1e-12) m--;
+  }
+
+  if (m < 3) closed = 0;
+
+  if (m == 0 || (m == 1 && s->cap == STROKE_BUTT)) return 0;
+
+  int per_joint = (int)ceil(M_PI / s->step) + 2;
+
+  if ((double)(m + 2) * per_joint * 18 >= INT_MAX)
+    rb_raise(rb_eArgError, "too many points: %d", n);
+
+  VALUE st_v;
+  s->st = ALLOCV_N(stroke_station, st_v, (size_t)(m + 2) * per_joint + 1);
+  s->n  = 0;
+
+  double len0, len1;
+
+  if (m == 1) {                         // a dot
+    curve_point d = { 1, 0 };
+
+    _stroke_cap(s, pts[0], d, 0);
+    _stroke_cap(s, pts[0], d, 1);
+  } else if (closed) {
+    curve_point d0 = _stroke_dir(pts[m - 1], pts[0], &len0);
+
+    for (int i = 0; i < m; i++) {
+      curve_point d1 = _stroke_dir(pts[i], pts[(i + 1) % m], &len1);
+
+      _stroke_join(s, pts[i], d0, len0, d1, len1);
+
+      d0   = d1;
+      len0 = len1;
+    }
+
+    s->st[s->n++] = s->st[0];           // back around to the start
+  } else {
+    curve_point d0 = _stroke_dir(pts[0], pts[1], &len0);
+
+    _stroke_cap(s, pts[0], d0, 0);
+
+    for (int i = 1; i < m - 1; i++) {
+      curve_point d1 = _stroke_dir(pts[i], pts[i + 1], &len1);
+
+      _stroke_join(s, pts[i], d0, len0, d1, len1);
+
+      d0   = d1;
+      len0 = len1;
+    }
+
+    _stroke_cap(s, pts[m - 1], d0, 1);
+  }
+
+  int bad = _stroke_render(renderer, s);
+
+  ALLOCV_END(st_v);
+
+  return bad;
+}
+
+// width: 1, join: :miter, cap: :butt, aa: false, h: nil,
+// miter_limit: 4, and closed: false if nkeys allows it.
+static void _stroke_options(VALUE opts, VALUE color_, int nkeys,
+                            stroke_state *s, int *flip, double *h, int *closed) {
+  VALUE vals[7];
+  ID keys[7] = { rb_intern("width"), rb_intern("join"), rb_intern("cap"),
+                 rb_intern("aa"), rb_intern("h"), rb_intern("miter_limit"),
+                 rb_intern("closed") };
+
+  rb_get_kwargs(opts, keys, 0, nkeys, vals);
+
+  double width = vals[0] == Qundef ? 1 : NUM2DBL(vals[0]);
+  int    aa    = vals[3] != Qundef && RTEST(vals[3]);
+  Uint32 color = VALUE2COLOR(color_);
+
+  if (!(width > 0))
+    rb_raise(rb_eArgError, "width must be positive");
+
+  s->join        = _stroke_kind(vals[1], STROKE_MITER, STROKE_ROUND, STROKE_BEVEL, "join");
+  s->cap         = _stroke_kind(vals[2], STROKE_BUTT,  STROKE_BUTT,  STROKE_ROUND, "cap");
+  s->miter_limit = vals[5] == Qundef ? 4 : NUM2DBL(vals[5]);
+  memcpy(&s->color, &color, sizeof(s->color)); // same byte order SDL2_gfx uses
+
+  if (aa) {                             // the fringe straddles the edge
+    s->hw     = width > 1 ? width / 2 - 0.5 : 0;
+    s->fringe = 1;
+    if (width < 1) s->color.a = (Uint8)lrint(s->color.a * width);
+  } else {
+    s->hw     = width / 2;
+    s->fringe = 0;
+  }
+
+  s->step = _stroke_step(s->hw + s->fringe);
+
+  *flip = vals[4] != Qundef && !NIL_P(vals[4]);
+  *h    = *flip ? NUM2DBL(vals[4]) : 0;
+
+  if (closed)
+    *closed = nkeys > 6 && vals[6] != Qundef && RTEST(vals[6]);
+}
+
+// draw_stroke(points, color, width: 1, join: :miter, cap: :butt,
+//             closed: false, aa: false, h: nil, miter_limit: 4)
+//
+// points is x0, y0, x1, y1, ... as an array or packed float64s, like
+// draw_bezier. Joins are :miter, :round or :bevel, and miters longer
+// than miter_limit half widths are beveled. Caps are :butt, :round or
+// :square. However wide, it's one geometry call.
+
+static VALUE Renderer_draw_stroke(int argc, VALUE *argv, VALUE self) {
+  DEFINE_SELF(Renderer, renderer, self);
+  VALUE points, color_, opts;
+  stroke_state s;
+  int flip, closed;
+  double h;
+
+  rb_scan_args(argc, argv, "2:", &points, &color_, &opts);
+  _stroke_options(opts, color_, 7, &s, &flip, &h, &closed);
+
+  long n = _curve_length(points);
+
+  if (n < 1) return Qnil;
+  if (n > INT_MAX / 4)
+    rb_raise(rb_eArgError, "too many points: %ld", n);
+
+  VALUE pts_v;
+  curve_point *pts = ALLOCV_N(curve_point, pts_v, n);
+
+  for (long i = 0; i < n; i++)
+    pts[i] = _curve_point(points, i, flip, h);
+
+  int bad = _stroke_path(renderer, &s, pts, (int)n, closed);
+
+  ALLOCV_END(pts_v);
+
+  if (bad)
+    FAILURE("Renderer#draw_stroke");
+
+  return Qnil;
+}
+
+// Points around the circle at c with radius r, from a0 to a0 + sweep
+// radians, both ends included.
+static int _stroke_arc(curve_point *pts, curve_point c, double r,
+                       double a0, double sweep, int steps) {
+  for (int i = 0; i <= steps; i++) {
+    double a = a0 + sweep * i / steps;
+
+    pts[i] = (curve_point) { c.x + r * cos(a), c.y + r * sin(a) };
+  }
+
+  return steps + 1;
+}
+
+static int _stroke_arc_steps(const stroke_state *s, double r, double sweep) {
+  double steps = ceil(fabs(sweep) / _stroke_step(r + s->hw + s->fringe));
+
+  return steps < 1 ? 1 : steps > 65536 ? 65536 : (int)steps;
+}
+
+// draw_arc(x, y, r, start, stop, color, width: 1, cap: :butt, ...)
+//
+// An arc from start to stop degrees, with the same options as
+// draw_stroke. A sweep of 360 or more is a whole circle.
+
+static VALUE Renderer_draw_arc(int argc, VALUE *argv, VALUE self) {
+  DEFINE_SELF(Renderer, renderer, self);
+  VALUE x_, y_, r_, start_, stop_, color_, opts;
+  stroke_state s;
+  int flip;
+  double h;
+
+  rb_scan_args(argc, argv, "6:", &x_, &y_, &r_, &start_, &stop_, &color_, &opts);
+  _stroke_options(opts, color_, 6, &s, &flip, &h, NULL);
+
+  curve_point c = { NUM2DBL(x_), NUM2DBL(y_) };
+  double r      = NUM2DBL(r_);
+  double a0     = NUM2DBL(start_) * M_PI / 180;
+  double sweep  = (NUM2DBL(stop_) - NUM2DBL(start_)) * M_PI / 180;
+  int    closed = fabs(sweep) >= 2 * M_PI;
+
+  if (!(r >= 0))
+    rb_raise(rb_eArgError, "radius must not be negative");
+
+  if (closed) sweep = 2 * M_PI;
+
+  int steps = _stroke_arc_steps(&s, r, sweep);
+  VALUE pts_v;
+  curve_point *pts = ALLOCV_N(curve_point, pts_v, steps + 1);
+  int n = _stroke_arc(pts, c, r, a0, sweep, steps);
+
+  if (flip)
+    for (int i = 0; i < n; i++)
+      pts[i].y = h - pts[i].y;
+
+  int bad = _stroke_path(renderer, &s, pts, closed ? n - 1 : n, closed);
+
+  ALLOCV_END(pts_v);
+
+  if (bad)
+    FAILURE("Renderer#draw_arc");
+
+  return Qnil;
+}
+
+// draw_rounded_rect(x, y, w, h, r, color, width: 1, ...)
+//
+// The outline of a w by h rect at x, y with its corners rounded to
+// radius r, as one closed stroke. Takes draw_stroke's options.
+
+static VALUE Renderer_draw_rounded_rect(int argc, VALUE *argv, VALUE self) {
+  DEFINE_SELF(Renderer, renderer, self);
+  VALUE x_, y_, w_, h_, r_, color_, opts;
+  stroke_state s;
+  int flip;
+  double h;
+
+  rb_scan_args(argc, argv, "6:", &x_, &y_, &w_, &h_, &r_, &color_, &opts);
+  _stroke_options(opts, color_, 6, &s, &flip, &h, NULL);
+
+  double x = NUM2DBL(x_), y = NUM2DBL(y_);
+  double w = NUM2DBL(w_), rh = NUM2DBL(h_), r = NUM2DBL(r_);
+
+  if (w < 0)  { x += w;  w  = -w;  }
+  if (rh < 0) { y += rh; rh = -rh; }
+  if (!(r > 0)) r = 0;
+  if (r > w / 2)  r = w / 2;
+  if (r > rh / 2) r = rh / 2;
+
+  int steps = r > 0 ? _stroke_arc_steps(&s, r, M_PI / 2) : 0;
+  curve_point corners[4] = { { x + w - r, y + rh - r }, { x + r, y + rh - r },
+                             { x + r, y + r },          { x + w - r, y + r } };
+  VALUE pts_v;
+  curve_point *pts = ALLOCV_N(curve_point, pts_v, 4 * ((size_t)steps + 1));
+  int n = 0;
+
+  for (int i = 0; i < 4; i++) {
+    if (steps)
+      n += _stroke_arc(pts + n, corners[i], r, M_PI / 2 * i, M_PI / 2, steps);
+    else
+      pts[n++] = corners[i];
+  }
+
+  if (flip)
+    for (int i = 0; i < n; i++)
+      pts[i].y = h - pts[i].y;
+
+  int bad = _stroke_path(renderer, &s, pts, n, 1);
+
+  ALLOCV_END(pts_v);
+
+  if (bad)
+    FAILURE("Renderer#draw_rounded_rect");
+
+  return Qnil;
+}
+
+static f_rxyxyc f_rect[] = { &rectangleColor,
+                             &boxColor };
+
+static VALUE Renderer_draw_rect(VALUE self,
+                                VALUE x_, VALUE y_,
+                                VALUE w_, VALUE h_,
+                                VALUE c,
+                                VALUE f) {
+  DEFINE_SELF(Renderer, renderer, self);
+
+  Sint16 x1 = NUM2SINT16(x_);
+  Sint16 y1 = NUM2SINT16(y_);
+  Sint16 x2 = NUM2SINT16(w_) + x1;
+  Sint16 y2 = NUM2SINT16(h_) + y1;
+  Uint8 idx = IDX1(RTEST(f));
+
+  f_rect[idx](renderer, x1, y1, x2, y2, NUM2UINT(c));
+
+  return Qnil;
+}
+
+static VALUE Renderer_clear(VALUE self, VALUE color) {
+  DEFINE_SELF(Renderer, renderer, self);
+  DEFINE_SELF(PixelFormat, format, rb_ivar_get(self, id_iv_format));
+
+  Uint8 r, g, b, a;
+  SDL_GetRGBA(NUM2UINT(color), format, &r, &g, &b, &a);
+
+  SDL_SetRenderDrawColor(renderer, r, g, b, a);
+
+  if (SDL_RenderClear(renderer))
+    FAILURE("Renderer#clear");
+
+  return Qnil;
+}
+
+static VALUE Renderer_copy_texture(VALUE self, VALUE texture_) {
+  DEFINE_SELF(Renderer, renderer, self);
+  DEFINE_SELF(Texture,  texture,  texture_);
+
+  if (SDL_RenderCopy(renderer, texture, NULL, NULL))
+    FAILURE("Renderer#copy_texture");
+
+  return Qnil;
+}
+
+static VALUE Renderer_fast_rect(VALUE self,
                                VALUE x, VALUE y,
                                VALUE w, VALUE h,
                                VALUE color) {
   return Renderer_draw_rect(self, x, y, w, h, color, Qtrue);
 }
 
-static VALUE Surface_format(VALUE self) {
-  DEFINE_SELF(Surface, surface, self);
-  SDL_PixelFormat* format;
-  SDL_Palette* palette;
-  SDL_Palette* src = surface->format->palette;
+static VALUE Surface_format(VALUE self) {
+  DEFINE_SELF(Surface, surface, self);
+  SDL_PixelFormat* format;
+  SDL_Palette* palette;
+  SDL_Palette* src = surface->format->palette;
+
+  // TODO: remove this or drop down to SDL_AllocFormat only
+
+  if (src) {
+    palette = ALLOC(SDL_Palette);
+    palette->ncolors = src->ncolors;
+    palette->colors  = ALLOC_N(SDL_Color, (size_t)src->ncolors);
+    MEMCPY(palette->colors, src->colors, SDL_Color, (size_t)src->ncolors);
+  } else {
+    palette = NULL;
+  }
+
+  VALUE ret = TypedData_Make_Struct(cPixelFormat, SDL_PixelFormat, &_PixelFormat_type, format);
+
+  *format = *(surface->format);
+  format->palette = palette;
+
+  return ret;
+}
+
+static VALUE Renderer_h(VALUE self) {
+  DEFINE_SELF(Renderer, renderer, self);
+
+  int w, h;
+
+  SDL_GetRendererOutputSize(renderer, &w, &h);
+
+  return INT2NUM(h);
+}
+
+static VALUE Renderer_w(VALUE self) {
+  DEFINE_SELF(Renderer, renderer, self);
+
+  int w, h;
+
+  SDL_GetRendererOutputSize(renderer, &w, &h);
+
+  return INT2NUM(w);
+}
+
+static VALUE Surface_h(VALUE self) {
+  DEFINE_SELF(Surface, surface, self);
+
+  return INT2NUM(surface->h);
+}
+
+static VALUE Surface_index(VALUE self, VALUE x_, VALUE y_) {
+  DEFINE_SELF(Surface, surface, self);
+
+  int x = NUM2INT(x_);
+  int y = NUM2INT(y_);
+
+  if (x < 0 || y < 0 || x >= surface->w || y >= surface->h)
+    rb_raise(rb_eIndexError, "%d, %d is outside of %dx%d",
+             x, y, surface->w, surface->h);
+
+  if (SDL_LockSurface(surface))
+    FAILURE("Surface#[]");
+
+  int bpp  = surface->format->BytesPerPixel;
+  Uint8 *p = (Uint8*)surface->pixels + y * surface->pitch + x * bpp;
+  Uint32 pixel = 0;
+
+  switch (bpp) {
+  case 1: pixel = *p;          break;
+  case 2: pixel = *(Uint16*)p; break;
+  case 3:
+    pixel = SDL_BYTEORDER == SDL_LIL_ENDIAN
+      ? p[0] | p[1] << 8 | p[2] << 16
+      : p[0] << 16 | p[1] << 8 | p[2];
+    break;
+  case 4: pixel = *(Uint32*)p; break;
+  }
+
+  SDL_UnlockSurface(surface);
+
+  Uint8 r, g, b, a;
+  SDL_GetRGBA(pixel, surface->format, &r, &g, &b, &a);
+
+  return UINT2NUM(rgba32(r, g, b, a));
+}
+
+static void _Surface_invalidate(VALUE surface);
+
+static int _Surface_cached_p(VALUE surface) {
+  return RTEST(rb_attr_get(surface, id_iv_cached));
+}
+
+static void _Surface_check_cached(VALUE surface) {
+  if (_Surface_cached_p(surface))
+    rb_frozen_error_raise(surface,
+                          "can't modify a shared surface from SDL::Surface.cache");
+}
+
+// flood_fill(x, y, color, tolerance: 0)
+//
+// Fills the pixels connected to x, y that match it with color (RGBA32,
+// like #[] returns). Any texture drawn from the surface is dropped so
+// the next blit picks up the change. Returns the number of pixels
+// filled.
+
+static VALUE Surface_flood_fill(int argc, VALUE *argv, VALUE self) {
+  DEFINE_SELF(Surface, surface, self);
+  VALUE x_, y_, color, opts, tmp = 0;
+
+  rb_scan_args(argc, argv, "3:", &x_, &y_, &color, &opts);
+  _Surface_check_cached(self);
+
+  int x = NUM2INT(x_);
+  int y = NUM2INT(y_);
+  Uint32 rgba = VALUE2COLOR(color);
+  SDL_PixelFormat *format = surface->format;
+  flood_fill f = { 0 };
+  Uint8 c[4];
+
+  f.tolerance = _flood_tolerance(opts);
+
+  if (x < 0 || y < 0 || x >= surface->w || y >= surface->h)
+    return INT2FIX(0);
+
+  memcpy(c, &rgba, sizeof(c));
+
+  f.fill = SDL_MapRGBA(format, c[0], c[1], c[2], c[3]);
+  f.w    = surface->w;
+  f.h    = surface->h;
+  f.bpp  = format->BytesPerPixel;
+
+  Uint8 *lut = NULL;
+
+  if (f.tolerance && f.bpp <= 2)        // before locking, ALLOCV can raise
+    lut = ALLOCV(tmp, (size_t)1 << (8 * f.bpp));
+
+  if (SDL_LockSurface(surface)) {
+    if (tmp) ALLOCV_END(tmp);
+    FAILURE("Surface#flood_fill");
+  }
+
+  f.pixels = surface->pixels;
+  f.pitch  = surface->pitch;
+
+  Uint8 *row = f.pixels + (size_t)y * f.pitch;
+
+  switch (f.bpp) {
+  case 1: f.target = FLOOD_GET1(row, x); break;
+  case 2: f.target = FLOOD_GET2(row, x); break;
+  case 3: f.target = FLOOD_GET3(row, x); break;
+  case 4: f.target = FLOOD_GET4(row, x); break;
+  }
+
+  if (f.tolerance) {
+    SDL_GetRGBA(f.target, format, &f.want[0], &f.want[1], &f.want[2], &f.want[3]);
+
+    if (lut) {
+      size_t n = (size_t)1 << (8 * f.bpp);
+
+      for (size_t i = 0; i < n; i++) {
+        SDL_GetRGBA((Uint32)i, format, &c[0], &c[1], &c[2], &c[3]);
+        lut[i] = (Uint8)_flood_within(c, f.want, f.tolerance);
+      }
+
+      f.lut = lut;
+    } else {
+      Uint32 masks[4] = { format->Rmask, format->Gmask,
+                          format->Bmask, format->Amask };
+
+      _flood_masks(&f, masks);
+    }
+  }
+
+  long filled = _flood_fill(&f, x, y);
+
+  SDL_UnlockSurface(surface);
+
+  if (tmp) ALLOCV_END(tmp);
+
+  if (filled < 0)
+    rb_memerror();
+
+  if (filled)
+    _Surface_invalidate(self);
+
+  return LONG2NUM(filled);
+}
+
+static VALUE Surface_pitch(VALUE self) {
+  DEFINE_SELF(Surface, surface, self);
+
+  return INT2NUM(surface->pitch);
+}
+
+#ifdef HAVE_RUBY_IO_BUFFER_H
+typedef struct {
+  SDL_Surface *surface;
+  VALUE buffer;
+} surface_pixels;
+
+static VALUE _Surface_pixels_yield(VALUE data) {
+  surface_pixels *args = (surface_pixels*)data;
+
+  return rb_yield_values(2, args->buffer, INT2NUM(args->surface->pitch));
+}
+
+static VALUE _Surface_pixels_release(VALUE data) {
+  surface_pixels *args = (surface_pixels*)data;
+
+  rb_io_buffer_free(args->buffer); // the buffer is dead outside the block
+  SDL_UnlockSurface(args->surface);
+
+  return Qnil;
+}
+
+// Yields an IO::Buffer over the surface's own pixels and the pitch.
+// The surface is locked for the duration of the block. See #format
+// for the layout. Cached surfaces get a read only buffer.
+
+static VALUE Surface_pixels(VALUE self) {
+  DEFINE_SELF(Surface, surface, self);
+  surface_pixels args = { surface, Qnil };
+
+  rb_need_block();
+
+  if (SDL_LockSurface(surface))
+    FAILURE("Surface#pixels");
+
+  enum rb_io_buffer_flags flags = RB_IO_BUFFER_EXTERNAL;
+  if (_Surface_cached_p(self)) flags |= RB_IO_BUFFER_READONLY;
+
+  args.buffer = rb_io_buffer_new(surface->pixels,
+                                 (size_t)surface->h * surface->pitch,
+                                 flags);
+
+  return rb_ensure(_Surface_pixels_yield,   (VALUE)&args,
+                   _Surface_pixels_release, (VALUE)&args);
+}
+#else
+static VALUE Surface_pixels(VALUE self) {
+  UNUSED(self);
+  rb_raise(rb_eNotImpError, "Surface#pixels needs IO::Buffer (ruby 3.1+)");
+  return Qnil;
+}
+#endif
+
+#ifdef HAVE_RUBY_MEMORY_VIEW_H
+// RLE surfaces only have pixels while locked, so they don't export.
+
+static bool _Surface_memory_view_available_p(VALUE self) {
+  DEFINE_SELF(Surface, surface, self);
+
+  return !SDL_MUSTLOCK(surface);
+}
+
+static bool _Surface_memory_view_get(VALUE self, rb_memory_view_t *view, int flags) {
+  DEFINE_SELF(Surface, surface, self);
+  UNUSED(flags);
+
+  if (SDL_MUSTLOCK(surface))
+    return false;
+
+  return rb_memory_view_init_as_byte_array(view, self, surface->pixels,
+                                           (ssize_t)surface->h * surface->pitch,
+                                           _Surface_cached_p(self));
+}
+
+static bool _Surface_memory_view_release(VALUE self, rb_memory_view_t *view) {
+  UNUSED(self);
+  UNUSED(view);
+  return true;
+}
+
+static const rb_memory_view_entry_t _Surface_memory_view = {
+  _Surface_memory_view_get,
+  _Surface_memory_view_release,
+  _Surface_memory_view_available_p,
+};
+#endif
+
+static VALUE Renderer_index_eq(VALUE self, VALUE x, VALUE y, VALUE color) {
+  DEFINE_SELF(Renderer, renderer, self);
+
+  pixelColor(renderer, NUM2SINT16(x), NUM2SINT16(y), VALUE2COLOR(color));
+
+  return Qnil;
+}
+
+// read_pixels(x = 0, y = 0, w = rest, h = rest)
+//
+// Reads a whole region back in one go as a packed RGBA32 string, rows
+// top to bottom, 4 * w bytes each.
+
+static VALUE Renderer_read_pixels(int argc, VALUE *argv, VALUE self) {
+  DEFINE_SELF(Renderer, renderer, self);
+  VALUE x_, y_, w_, h_;
+
+  rb_scan_args(argc, argv, "04", &x_, &y_, &w_, &h_);
+
+  int ow, oh;
+  if (SDL_GetRendererOutputSize(renderer, &ow, &oh))
+    FAILURE("Renderer#read_pixels(GetRendererOutputSize)");
+
+  int x = NIL_P(x_) ? 0      : NUM2INT(x_);
+  int y = NIL_P(y_) ? 0      : NUM2INT(y_);
+  int w = NIL_P(w_) ? ow - x : NUM2INT(w_);
+  int h = NIL_P(h_) ? oh - y : NUM2INT(h_);
+
+  if (w <= 0 || h <= 0)
+    rb_raise(rb_eArgError, "bad region %dx%d", w, h);
+
+  // SDL clips the rect and leaves the rest of the buffer untouched, so
+  // anything off the edge would come back as garbage.
+  if (x < 0 || y < 0 || w > ow - x || h > oh - y)
+    rb_raise(rb_eIndexError, "%dx%d at %d, %d is outside of %dx%d",
+             w, h, x, y, ow, oh);
+
+  SDL_Rect rect = { x, y, w, h };
+  VALUE pixels  = rb_str_new(NULL, (long)w * h * 4);
+
+  if (SDL_RenderReadPixels(renderer, &rect, SDL_PIXELFORMAT_RGBA32,
+                           RSTRING_PTR(pixels), 4 * w))
+    FAILURE("Renderer#read_pixels");
+
+  return pixels;
+}
+
+static VALUE Renderer_index(VALUE self, VALUE x, VALUE y) {
+  DEFINE_SELF(Renderer, renderer, self);
+
+  SDL_Rect pixel_rect = { NUM2SINT16(x), NUM2SINT16(y), 1, 1 };
+  Uint32 pixel;
+
+  if (SDL_RenderReadPixels(renderer, &pixel_rect, SDL_PIXELFORMAT_RGBA32,
+                           &pixel, sizeof(pixel)))
+    FAILURE("Renderer#[]");
+
+  return UINT2NUM(pixel);
+}
+
+static VALUE Surface_to_rgba32(VALUE self) {
+  DEFINE_SELF(Surface, surface, self);
+
+  SDL_Surface *rgba = SDL_ConvertSurfaceFormat(surface, SDL_PIXELFORMAT_RGBA32, 0);
+  if (!rgba)
+    FAILURE("Surface#to_rgba32");
+
+  long pitch = 4L * rgba->w;
+  VALUE str  = rb_str_new(NULL, pitch * rgba->h);
+
+  for (int y = 0; y < rgba->h; y++)
+    memcpy(RSTRING_PTR(str) + y * pitch,
+           (Uint8*)rgba->pixels + y * rgba->pitch, pitch);
+
+  SDL_FreeSurface(rgba);
+
+  return str;
+}
+
+static VALUE Surface_make_collision_map(VALUE self) {
+  DEFINE_SELF(Surface, surface, self);
+
+  sge_cdata * cdata = sge_make_cmap(surface);
+  if (!cdata)
+    FAILURE("Surface#make_collision_map");
+
+  return TypedData_Wrap_Struct(cCollisionMap, &_CollisionMap_type, cdata);
+}
+
+static VALUE Surface_w(VALUE self) {
+  DEFINE_SELF(Surface, surface, self);
+
+  return INT2NUM(surface->w);
+}
+
+// TODO: maybe remove? I dunno... could be nice for pre-rendering?
+static VALUE Surface_transform(VALUE self, VALUE angle,
+                               VALUE xscale, VALUE yscale,
+                               VALUE flags) {
+  DEFINE_SELF(Surface, surface, self);
+
+  SDL_Surface *result = rotozoomSurfaceXY(surface,
+                                          NUM2FLT(angle),
+                                          NUM2FLT(xscale),
+                                          NUM2FLT(yscale),
+                                          SMOOTHING_ON);
+
+  if (!result)
+    FAILURE("Surface#transform");
+
+  return _Surface_wrap(result);
+}
+
+static VALUE Renderer_blit(VALUE self, VALUE src_,
+                           VALUE x_, VALUE y_,
+                           VALUE a_,
+                           VALUE ws_, VALUE hs_,
+                           VALUE center_) {
+  DEFINE_SELF(Renderer, renderer, self);
+
+  int x    = NUM2SINT16(x_);
+  int y    = NUM2SINT16(y_);
+  double a = RTEST(a_)  ? -NUM2DBL(a_) : 0.0;
+  float ws = RTEST(ws_) ? NUM2FLT(ws_) : 1.0;
+  float hs = RTEST(hs_) ? NUM2FLT(hs_) : 1.0;
+
+  SDL_Texture* texture = _Surface_texture(self, src_);
+
+  int w, h;
+  if (SDL_QueryTexture(texture, NULL, NULL, &w, &h))
+    FAILURE("_blit(SDL_QueryTexture)");
+
+  SDL_Rect dst_rect = { x, y, w*ws, h*hs };
+
+  if (SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND))
+    FAILURE("Renderer#blit(SetTextureBlendMode)");
+
+  if (RTEST(a_) || RTEST(ws_) || RTEST(hs_)) {
+    SDL_Point bottom_left  = { 0, h-1 };
+    SDL_Point *point = (RTEST(center_) ? NULL : &bottom_left);
+
+    if (SDL_RenderCopyEx(renderer, texture, NULL, &dst_rect,
+                         a, point, SDL_FLIP_NONE))
+      FAILURE("_blit(SDL_RenderCopyEx)");
+  } else {
+    if (SDL_RenderCopy(renderer, texture, NULL, &dst_rect))
+      FAILURE("_blit(SDL_RenderCopyEx)");
+  }
+
+  return Qnil;
+}
+
+static VALUE Renderer_sprite(VALUE self, VALUE w_, VALUE h_) {
+  UNUSED(self);
+
+  int w   = NUM2INT(w_);
+  int h   = NUM2INT(h_);
+  int bpp = 32;
+
+  SDL_Surface *surface =
+    SDL_CreateRGBSurfaceWithFormat(0, w, h, bpp, SDL_PIXELFORMAT_RGBA32);
+  if (!surface) FAILURE("Surface#sprite(CreateRGBSurfaceWithFormat)");
+
+  SDL_Renderer *renderer = SDL_CreateSoftwareRenderer(surface);
+  if (!renderer) FAILURE("Surface#sprite(CreateSoftwareRenderer)");
+
+  // bumps the refcount and returns the same thing
+  SDL_PixelFormat *format = SDL_AllocFormat(surface->format->format);
+  if (format != surface->format)
+    rb_raise(eSDLError, "SDL_AllocFormat freaked out. %p vs %p",
+             format,
+             surface->format);
+
+  VALUE vrenderer = TypedData_Wrap_Struct(cRenderer,    &_Renderer_type,    renderer);
+  VALUE vsurface  = _Surface_wrap(surface);
+  VALUE vformat   = TypedData_Wrap_Struct(cPixelFormat, &_PixelFormat_type, format);
+
+  rb_ivar_set(vrenderer, id_iv_surface, vsurface);
+  rb_ivar_set(vrenderer, id_iv_format,  vformat);
+
+  return vrenderer;
+}
+
+static VALUE Renderer_save(VALUE self, VALUE path) {
+  DEFINE_SELF(Renderer, renderer, self);
+
+  int w, h;
+  SDL_GetRendererOutputSize(renderer, &w, &h);
+
+  SDL_Surface *sshot = SDL_CreateRGBSurfaceWithFormat(0, w, h, 32,
+                                                      SDL_PIXELFORMAT_RGBA32);
+  if (SDL_RenderReadPixels(renderer, NULL, SDL_PIXELFORMAT_RGBA32,
+                           sshot->pixels,
+                           sshot->pitch))
+    FAILURE("Renderer#save");
+  int ret = IMG_SavePNG(sshot, RSTRING_PTR(path));
+  SDL_FreeSurface(sshot);
+
+  return INT2NUM(ret);
+}
+
+static VALUE Renderer_stop_recording(VALUE self) {
+  VALUE vrec = rb_attr_get(self, id_iv_recorder);
+
+  if (!RTEST(vrec))
+    return Qnil;
+
+  Recorder_stop(vrec);
+  rb_ivar_set(self, id_iv_recorder, Qnil);
+
+  return vrec;
+}
+
+// start_recording(path, format: :png, depth: 8, policy: :drop,
+//                 threads: ncpu-1, fps: 60)
+//
+// :png writes path000000.png, path000001.png, ... while :y4m and :raw
+// write a single stream to path. When all depth buffers are busy,
+// policy :drop skips the frame and :block waits for an encoder.
+
+static VALUE Renderer_start_recording(int argc, VALUE *argv, VALUE self) {
+  DEFINE_SELF(Renderer, renderer, self);
+  VALUE path, opts, vrec;
+  VALUE vals[5];
+  ID keys[5] = { rb_intern("format"), rb_intern("depth"), rb_intern("policy"),
+                 rb_intern("threads"), rb_intern("fps") };
+  SDL_Recorder *rec;
+
+  rb_scan_args(argc, argv, "1:", &path, &opts);
+  rb_get_kwargs(opts, keys, 0, 5, vals);
+  ExportStringValue(path);
+
+  Renderer_stop_recording(self);
+
+  ID format    = vals[0] == Qundef ? rb_intern("png") : SYM2ID(vals[0]);
+  int depth    = vals[1] == Qundef ? 8 : NUM2INT(vals[1]);
+  ID policy    = vals[2] == Qundef ? rb_intern("drop") : SYM2ID(vals[2]);
+  int nthreads = vals[3] == Qundef ? SDL_GetCPUCount() - 1 : NUM2INT(vals[3]);
+  int fps      = vals[4] == Qundef ? 60 : NUM2INT(vals[4]);
+
+  if (depth < 1)
+    rb_raise(rb_eArgError, "depth must be positive");
+  if (nthreads < 1) nthreads = 1;
+  if (nthreads > depth) nthreads = depth;
+
+  int w, h;
+  if (SDL_GetRendererOutputSize(renderer, &w, &h))
+    FAILURE("Renderer#start_recording(GetRendererOutputSize)");
+
+  vrec = TypedData_Make_Struct(cRecorder, SDL_Recorder, &_Recorder_type, rec);
+
+  if (format == rb_intern("png"))
+    rec->format = RECORD_PNG;
+  else if (format == rb_intern("y4m"))
+    rec->format = RECORD_Y4M;
+  else if (format == rb_intern("raw"))
+    rec->format = RECORD_RAW;
+  else
+    rb_raise(rb_eArgError, "unknown recording format: %"PRIsVALUE, vals[0]);
+
+  if (policy == rb_intern("block"))
+    rec->block = 1;
+  else if (policy != rb_intern("drop"))
+    rb_raise(rb_eArgError, "unknown recording policy: %"PRIsVALUE, vals[2]);
+
+  rec->w     = w;
+  rec->h     = h;
+  rec->pitch = 4 * w;
+  rec->fps   = fps;
+  rec->path  = ruby_strdup(StringValueCStr(path));
+
+  if (rec->format != RECORD_PNG) {
+    rec->out = fopen(rec->path, "wb");
+    if (!rec->out)
+      rb_sys_fail(rec->path);
+
+    if (rec->format == RECORD_Y4M)
+      fprintf(rec->out, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", w, h, fps);
+  }
+
+  rec->slots      = ZALLOC_N(Uint8*, depth);
+  rec->seqs       = ZALLOC_N(Uint32, depth);
+  rec->free_slots = ALLOC_N(int, depth);
+  rec->queue      = ALLOC_N(int, depth);
+  rec->threads    = ZALLOC_N(SDL_Thread*, nthreads);
+
+  for (int i = 0; i < depth; i++) {
+    rec->slots[i] = ALLOC_N(Uint8, (size_t)h * rec->pitch);
+    rec->free_slots[rec->n_free++] = i;
+    rec->depth = i + 1;
+  }
+
+  rec->lock  = SDL_CreateMutex();
+  rec->ready = SDL_CreateCond();
+  rec->freed = SDL_CreateCond();
+  if (!rec->lock || !rec->ready || !rec->freed)
+    FAILURE("Renderer#start_recording(CreateMutex)");
+
+  for (int i = 0; i < nthreads; i++) {
+    rec->threads[i] = SDL_CreateThread(_Recorder_work, "recorder", rec);
+    if (!rec->threads[i])
+      FAILURE("Renderer#start_recording(CreateThread)");
+    rec->n_threads = i + 1;
+  }
+
+  rb_ivar_set(self, id_iv_recorder, vrec);
+
+  return vrec;
+}
+
+//// SDL::Renderer methods:
+
+static void _Renderer_free(void* renderer) {
+  if (is_quit) return;
+  if (renderer) SDL_DestroyRenderer(renderer);
+}
+
+static void _Renderer_mark(void* renderer) {
+  UNUSED(renderer);
+}
+
+// The Texture last assigned, rather than a new wrapper around
+// SDL_GetRenderTarget, which would destroy the texture when collected.
+// nil for the window.
+
+static VALUE Renderer_target(VALUE self) {
+  return rb_attr_get(self, id_iv_target);
+}
+
+static VALUE Renderer_target_eq(VALUE self, VALUE texture_) {
+  DEFINE_SELF(Renderer, renderer, self);
+  DEFINE_SELF0(Texture, texture, texture_);
+
+  if (SDL_SetRenderTarget(renderer, texture))
+    FAILURE("Renderer#target=");
+
+  rb_ivar_set(self, id_iv_target, texture_);
+
+  return texture_;
+}
+
+//// SDL::Texture methods:
+
+static void _Texture_free(void* p) {
+  texture_ref *ref = p;
+
+  if (!ref) return;
+  if (ref->texture && !is_quit) SDL_DestroyTexture(ref->texture);
+
+  xfree(ref);
+}
+
+static void _Texture_mark(void* texture) {
+  UNUSED(texture);
+}
+
+static size_t _Texture_bytes(SDL_Texture *texture) {
+  Uint32 format;
+  int w, h;
+
+  if (SDL_QueryTexture(texture, &format, NULL, &w, &h)) return 0;
+
+  return (size_t)w * h * SDL_BYTESPERPIXEL(format);
+}
+
+static size_t _Texture_memsize(const void *p) {
+  const texture_ref *ref = p;
+
+  return ref ? sizeof(texture_ref) + ref->bytes : 0;
+}
+
+static VALUE _Texture_wrap(SDL_Texture *texture) {
+  texture_ref *ref;
+  VALUE obj = TypedData_Make_Struct(cTexture, texture_ref, &_Texture_type, ref);
+
+  ref->texture = texture;
+  ref->bytes   = _Texture_bytes(texture);
+
+  return obj;
+}
+
+// Textures made to blit surfaces. Each renderer keeps the ones it
+// made in LRU order and evicts the least recently blitted once they
+// add up to more than its budget. The surface holds on to its (maybe
+// evicted) entry in @texture, so the texture is just made again the
+// next time it's blitted, and dies with the surface.
+//
+// GC frees the renderer, its cache and the entries in any order, so
+// evicted textures aren't destroyed on the spot. They go on the cache's
+// dead list, which is only emptied through a live renderer. If the
+// renderer goes first it has already destroyed them.
+
+#define TEXTURE_BUDGET ((size_t)256 << 20)
+
+typedef struct cached_texture cached_texture;
+
+struct SDL_TextureCache {
+  size_t          budget;
+  size_t          used;
+  cached_texture *head;                 // most recently used
+  cached_texture *tail;                 // next to go
+  SDL_Texture   **dead;                 // evicted, not yet destroyed
+  int             n_dead, dead_capa;
+};
+
+struct cached_texture {
+  SDL_Texture      *texture;            // NULL when evicted
+  size_t            bytes;
+  SDL_TextureCache *cache;              // NULL unless texture
+  cached_texture   *prev, *next;
+};
+
+static void _TextureCache_unlink(cached_texture *e) {
+  SDL_TextureCache *cache = e->cache;
+
+  if (!cache) return;
+
+  if (e->prev) e->prev->next = e->next; else cache->head = e->next;
+  if (e->next) e->next->prev = e->prev; else cache->tail = e->prev;
+
+  cache->used -= e->bytes;
+  e->prev = e->next = NULL;
+  e->cache = NULL;
+}
+
+static void _TextureCache_push(SDL_TextureCache *cache, cached_texture *e) {
+  e->cache = cache;
+  e->prev  = NULL;
+  e->next  = cache->head;
+
+  if (cache->head) cache->head->prev = e; else cache->tail = e;
+  cache->head = e;
+  cache->used += e->bytes;
+}
+
+// Plain realloc: this runs from GC free functions too.
+static void _TextureCache_bury(SDL_TextureCache *cache, SDL_Texture *texture) {
+  if (cache->n_dead == cache->dead_capa) {
+    int capa = cache->dead_capa ? 2 * cache->dead_capa : 16;
+    SDL_Texture **dead = realloc(cache->dead, capa * sizeof(*dead));
+
+    if (!dead) return;                  // leaks until the renderer goes
+
+    cache->dead      = dead;
+    cache->dead_capa = capa;
+  }
+
+  cache->dead[cache->n_dead++] = texture;
+}
+
+static void _TextureCache_reap(SDL_TextureCache *cache) {
+  for (int i = 0; i < cache->n_dead; i++)
+    if (!is_quit) SDL_DestroyTexture(cache->dead[i]);
+
+  cache->n_dead = 0;
+}
+
+static void _TextureCache_evict(cached_texture *e) {
+  SDL_TextureCache *cache = e->cache;
+
+  _TextureCache_unlink(e);
+
+  if (e->texture) {
+    if (cache) _TextureCache_bury(cache, e->texture);
+    rb_gc_adjust_memory_usage(-(ssize_t)e->bytes);
+  }
+
+  e->texture = NULL;
+  e->bytes   = 0;
+}
+
+static void _TextureCache_trim(SDL_TextureCache *cache, cached_texture *keep) {
+  while (cache->used > cache->budget && cache->tail && cache->tail != keep)
+    _TextureCache_evict(cache->tail);
+}
+
+static void _TextureCache_add(SDL_TextureCache *cache, cached_texture *e,
+                              SDL_Texture *texture) {
+  e->texture = texture;
+  e->bytes   = _Texture_bytes(texture);
+  rb_gc_adjust_memory_usage((ssize_t)e->bytes);
+
+  _TextureCache_push(cache, e);
+  _TextureCache_trim(cache, e);
+  _TextureCache_reap(cache);            // only called with a live renderer
+}
+
+static void _TextureCache_free(void* p) {
+  SDL_TextureCache *cache = p;
+
+  if (!cache) return;
+
+  // Only goes with the renderer, which destroys its own textures.
+  while (cache->head) {
+    cached_texture *e = cache->head;
+
+    _TextureCache_unlink(e);
+    rb_gc_adjust_memory_usage(-(ssize_t)e->bytes);
+    e->texture = NULL;
+    e->bytes   = 0;
+  }
+
+  free(cache->dead);
+  xfree(cache);
+}
+
+static void _TextureCache_mark(void* p) {
+  UNUSED(p);
+}
+
+static size_t _TextureCache_memsize(const void *p) {
+  return p ? sizeof(SDL_TextureCache) : 0;
+}
+
+static void _cached_texture_free(void* p) {
+  cached_texture *e = p;
+
+  if (!e) return;
+
+  _TextureCache_evict(e);
+  xfree(e);
+}
+
+static size_t _cached_texture_memsize(const void *p) {
+  const cached_texture *e = p;
+
+  return e ? sizeof(cached_texture) + e->bytes : 0;
+}
+
+static const rb_data_type_t _cached_texture_type = {
+  "SDL::Texture (cached)",
+  { NULL, _cached_texture_free, _cached_texture_memsize, { NULL, NULL }, },
+  NULL, NULL,
+};
+
+static SDL_TextureCache *_Renderer_textures(VALUE self) {
+  VALUE vcache = rb_attr_get(self, id_iv_textures);
+  SDL_TextureCache *cache;
+
+  if (NIL_P(vcache)) {
+    vcache = TypedData_Make_Struct(cTextureCache, SDL_TextureCache,
+                                   &_TextureCache_type, cache);
+    cache->budget = TEXTURE_BUDGET;
+    rb_ivar_set(self, id_iv_textures, vcache);
+  } else {
+    SET_SELF(TextureCache, cache, vcache);
+  }
+
+  _TextureCache_reap(cache);            // self is alive, so its renderer is
+
+  return cache;
+}
+
+// The texture for blitting surface, made (again) if need be.
+static SDL_Texture *_Surface_texture(VALUE self, VALUE surface) {
+  DEFINE_SELF(Renderer, renderer, self);
+  DEFINE_SELF(Surface, src, surface);
+  SDL_TextureCache *cache = _Renderer_textures(self);
+  VALUE ventry = rb_attr_get(surface, id_iv_texture);
+  cached_texture *e;
+
+  if (NIL_P(ventry)) {
+    ventry = TypedData_Make_Struct(cTexture, cached_texture,
+                                   &_cached_texture_type, e);
+    rb_ivar_set(surface, id_iv_texture, ventry);
+  } else {
+    TypedData_Get_Struct(ventry, cached_texture, &_cached_texture_type, e);
+  }
+
+  if (e->cache == cache) {              // hit: move to the front
+    _TextureCache_unlink(e);
+    _TextureCache_push(cache, e);
+    return e->texture;
+  }
+
+  _TextureCache_evict(e);               // evicted, or another renderer's
+
+  SDL_Texture *texture = SDL_CreateTextureFromSurface(renderer, src);
+  if (!texture)
+    FAILURE("_blit(SDL_CreateTextureFromSurface)");
+
+  _TextureCache_add(cache, e, texture);
+
+  return texture;
+}
+
+static int _Surface_textured_p(VALUE surface) {
+  VALUE ventry = rb_attr_get(surface, id_iv_texture);
+  cached_texture *e;
+
+  if (NIL_P(ventry)) return 0;
+
+  TypedData_Get_Struct(ventry, cached_texture, &_cached_texture_type, e);
+
+  return e->texture != NULL;
+}
+
+// Drops the cached texture of a surface whose pixels changed.
+
+static void _Surface_invalidate(VALUE surface) {
+  VALUE ventry = rb_attr_get(surface, id_iv_texture);
+  cached_texture *e;
+
+  if (NIL_P(ventry)) return;
+
+  TypedData_Get_Struct(ventry, cached_texture, &_cached_texture_type, e);
+  _TextureCache_evict(e);
+}
+
+static VALUE Renderer_texture_budget(VALUE self) {
+  return SIZET2NUM(_Renderer_textures(self)->budget);
+}
+
+static VALUE Renderer_texture_budget_eq(VALUE self, VALUE budget) {
+  SDL_TextureCache *cache = _Renderer_textures(self);
+
+  cache->budget = NUM2SIZET(budget);
+  _TextureCache_trim(cache, NULL);
+  _TextureCache_reap(cache);
+
+  return budget;
+}
+
+static VALUE Renderer_texture_usage(VALUE self) {
+  return SIZET2NUM(_Renderer_textures(self)->used);
+}
+
+//// Shape stamps:
+
+// Small circles & ellipses are rasterized once per shape, radii, aa
+// and fill by SDL2_gfx into a white texture, then drawn as quads
+// tinted by their vertex colors. So a thousand circles cost a
+// thousand quads in one geometry call, not a thousand rasterizations.
+// Stamps are entries in the renderer's texture cache, keyed in
+// @stamps, so they count against its budget and are just made again
+// if they get evicted. Bigger shapes are rasterized directly, where
+// the texture would cost more than it saves.
+
+static SDL_Texture *_stamp_make(SDL_Renderer *renderer, int shape,
+                                int rx, int ry, int aa, int fill) {
+  int w = 2 * rx + 3, h = 2 * ry + 3; // aa edges go a pixel past r
+  SDL_Surface *surface =
+    SDL_CreateRGBSurfaceWithFormat(0, w, h, 32, SDL_PIXELFORMAT_RGBA32);
+
+  if (!surface) return NULL;
+
+  SDL_FillRect(surface, NULL, 0);
+
+  SDL_Renderer *soft = SDL_CreateSoftwareRenderer(surface);
+  Uint8 idx = IDX2(aa, fill);
+
+  if (!soft) {
+    SDL_FreeSurface(surface);
+    return NULL;
+  }
+
+  if (shape == STAMP_CIRCLE)
+    f_circle[idx](soft, rx + 1, ry + 1, rx, 0xFFFFFFFF);
+  else
+    f_ellipse[idx](soft, rx + 1, ry + 1, rx, ry, 0xFFFFFFFF);
+
+  SDL_RenderFlush(soft);
+  SDL_DestroyRenderer(soft);
+
+  // aa edges were blended over clear black. Only keep their coverage,
+  // or tinted edges come out dark.
+  for (int y = 0; y < h; y++) {
+    Uint8 *px = (Uint8*)surface->pixels + y * surface->pitch;
+
+    for (int x = 0; x < w; x++, px += 4)
+      px[0] = px[1] = px[2] = 255;
+  }
+
+  SDL_Texture *texture = SDL_CreateTextureFromSurface(renderer, surface);
+  SDL_FreeSurface(surface);
+
+  if (texture && SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND)) {
+    SDL_DestroyTexture(texture);
+    return NULL;
+  }
+
+  return texture;
+}
+
+static SDL_Texture *_Renderer_stamp_texture(VALUE self, int shape,
+                                            int rx, int ry, int aa, int fill) {
+  DEFINE_SELF(Renderer, renderer, self);
+  SDL_TextureCache *cache = _Renderer_textures(self);
+  VALUE stamps = rb_attr_get(self, id_iv_stamps);
+
+  if (NIL_P(stamps)) {
+    stamps = rb_hash_new();
+    rb_ivar_set(self, id_iv_stamps, stamps);
+  }
+
+  VALUE key = INT2FIX(((shape * 64 + rx) * 64 + ry) * 4 + aa * 2 + fill);
+  VALUE ventry = rb_hash_lookup(stamps, key);
+  cached_texture *e;
+
+  if (NIL_P(ventry)) {
+    ventry = TypedData_Make_Struct(cTexture, cached_texture,
+                                   &_cached_texture_type, e);
+    rb_hash_aset(stamps, key, ventry);
+  } else {
+    TypedData_Get_Struct(ventry, cached_texture, &_cached_texture_type, e);
+  }
+
+  if (e->cache == cache) {              // hit: move to the front
+    _TextureCache_unlink(e);
+    _TextureCache_push(cache, e);
+    return e->texture;
+  }
+
+  _TextureCache_evict(e);
+
+  SDL_Texture *texture = _stamp_make(renderer, shape, rx, ry, aa, fill);
+  if (!texture)
+    FAILURE("Renderer#stamp");
+
+  _TextureCache_add(cache, e, texture);
+
+  return texture;
+}
+
+// stamps = false draws every shape straight through SDL2_gfx, and
+// drops the stamps made so far. true turns them back on.
+
+static VALUE Renderer_stamps_eq(VALUE self, VALUE on) {
+  rb_ivar_set(self, id_iv_stamps, RTEST(on) ? Qnil : Qfalse);
+
+  return on;
+}
+
+// Draws the stamp at each of the n centers, in colors[i] or all in
+// color if colors is NULL, as one geometry call.
+static int _Renderer_stamp(VALUE self, int shape, int rx, int ry,
+                           int aa, int fill, const SDL_Point *centers, long n,
+                           const Uint32 *colors, Uint32 color) {
+  DEFINE_SELF(Renderer, renderer, self);
+
+  if (n < 1) return 0;
+  if (n > INT_MAX / 6)
+    rb_raise(rb_eArgError, "too many shapes: %ld", n);
+
+  SDL_Texture *texture = _Renderer_stamp_texture(self, shape, rx, ry,
+                                                 !!aa, !!fill);
+  VALUE verts_v, idx_v;
+  SDL_Vertex *verts = ALLOCV_N(SDL_Vertex, verts_v, 4 * (size_t)n);
+  int *idx = ALLOCV_N(int, idx_v, 6 * (size_t)n);
+  float w = 2 * rx + 3, h = 2 * ry + 3;
+  SDL_Color c;
+
+  memcpy(&c, &color, sizeof(c));        // same byte order SDL2_gfx uses
+
+  for (long i = 0; i < n; i++) {
+    SDL_Vertex *v = &verts[4 * i];
+    int *ip = &idx[6 * i];
+    float x = centers[i].x - rx - 1, y = centers[i].y - ry - 1;
+    int a = 4 * (int)i;
+
+    if (colors) memcpy(&c, &colors[i], sizeof(c));
+
+    v[0].position = (SDL_FPoint) { x,     y     };
+    v[1].position = (SDL_FPoint) { x + w, y     };
+    v[2].position = (SDL_FPoint) { x + w, y + h };
+    v[3].position = (SDL_FPoint) { x,     y + h };
+    v[0].tex_coord = (SDL_FPoint) { 0, 0 };
+    v[1].tex_coord = (SDL_FPoint) { 1, 0 };
+    v[2].tex_coord = (SDL_FPoint) { 1, 1 };
+    v[3].tex_coord = (SDL_FPoint) { 0, 1 };
+    v[0].color = v[1].color = v[2].color = v[3].color = c;
+
+    ip[0] = a; ip[1] = a + 1; ip[2] = a + 2;
+    ip[3] = a; ip[4] = a + 2; ip[5] = a + 3;
+  }
+
+  int bad = SDL_RenderGeometry(renderer, texture, verts, 4 * (int)n,
+                               idx, 6 * (int)n);
+
+  ALLOCV_END(verts_v);
+  ALLOCV_END(idx_v);
+
+  return bad;
+}
+
+static VALUE _Renderer_draw_shapes(int argc, VALUE *argv, VALUE self,
+                                   int shape) {
+  DEFINE_SELF(Renderer, renderer, self);
+  VALUE points, rx_, ry_, color_, opts;
+  VALUE vals[3];
+  ID keys[3] = { rb_intern("aa"), rb_intern("fill"), rb_intern("h") };
+
+  if (shape == STAMP_CIRCLE) {
+    rb_scan_args(argc, argv, "3:", &points, &rx_, &color_, &opts);
+    ry_ = rx_;
+  } else {
+    rb_scan_args(argc, argv, "4:", &points, &rx_, &ry_, &color_, &opts);
+  }
+
+  rb_get_kwargs(opts, keys, 0, 3, vals);
+
+  int    aa   = vals[0] != Qundef && RTEST(vals[0]);
+  int    fill = vals[1] != Qundef && RTEST(vals[1]);
+  int    flip = vals[2] != Qundef && !NIL_P(vals[2]);
+  double h    = flip ? NUM2DBL(vals[2]) : 0;
+  Sint16 rx   = NUM2SINT16(rx_), ry = NUM2SINT16(ry_);
+  long   n    = _curve_length(points);
+  int    many = RB_TYPE_P(color_, T_ARRAY);
+
+  if (many && RARRAY_LEN(color_) != n)
+    rb_raise(rb_eArgError, "%ld colors for %ld shapes", RARRAY_LEN(color_), n);
+
+  VALUE centers_v, colors_v = 0;
+  SDL_Point *centers = ALLOCV_N(SDL_Point, centers_v, n);
+  Uint32 *colors     = many ? ALLOCV_N(Uint32, colors_v, n) : NULL;
+  Uint32 color       = many ? 0 : VALUE2COLOR(color_);
+
+  for (long i = 0; i < n; i++) {
+    curve_point p = _curve_point(points, i, flip, h);
+
+    // truncated like draw_circle's NUM2SINT16
+    centers[i].x = (Sint16)(p.x < -32768 ? -32768 : p.x > 32767 ? 32767 : p.x);
+    centers[i].y = (Sint16)(p.y < -32768 ? -32768 : p.y > 32767 ? 32767 : p.y);
+
+    if (many) colors[i] = VALUE2COLOR(RARRAY_AREF(color_, i));
+  }
+
+  int bad = 0;
+
+  if (_Renderer_stamps_fit(self, rx, ry)) {
+    bad = _Renderer_stamp(self, shape, rx, ry, aa, fill, centers, n,
+                          colors, color);
+  } else {
+    Uint8 idx = IDX2(aa, fill);
+
+    for (long i = 0; i < n; i++) {
+      Uint32 c = many ? colors[i] : color;
+      Sint16 x = centers[i].x, y = centers[i].y;
+
+      if (shape == STAMP_CIRCLE)
+        bad |= f_circle[idx](renderer, x, y, rx, c);
+      else
+        bad |= f_ellipse[idx](renderer, x, y, rx, ry, c);
+    }
+  }
+
+  ALLOCV_END(centers_v);
+  if (colors_v) ALLOCV_END(colors_v);
+
+  if (bad)
+    FAILURE(shape == STAMP_CIRCLE ? "Renderer#draw_circles"
+                                  : "Renderer#draw_ellipses");
+
+  return Qnil;
+}
+
+// draw_circles(points, r, color, aa: false, fill: false, h: nil)
+//
+// A circle of radius r centered on each point. points is x0, y0, x1,
+// y1, ... as an array or packed float64s, flipped about h unless it's
+// nil. color is one color, or an array of one per circle.
+
+static VALUE Renderer_draw_circles(int argc, VALUE *argv, VALUE self) {
+  return _Renderer_draw_shapes(argc, argv, self, STAMP_CIRCLE);
+}
+
+// draw_ellipses(points, rx, ry, color, aa: false, fill: false, h: nil)
+//
+// Like draw_circles, with radii rx & ry.
+
+static VALUE Renderer_draw_ellipses(int argc, VALUE *argv, VALUE self) {
+  return _Renderer_draw_shapes(argc, argv, self, STAMP_ELLIPSE);
+}
+
+//// SDL::Trail methods:
+
+// A fixed size ring of float points, oldest overwritten first. Drawn as
+// one strip of thin quads so the whole trail is a single geometry call
+// with the color ramp interpolated between points.
+
+struct SDL_Trail {
+  float      *xy;                       // max points, x & y interleaved
+  int         max, head, n;             // head is the next slot written
+  SDL_Vertex *verts;                    // 4 per segment, scratch
+  int        *indices;                  // 6 per segment, never changes
+};
+
+static void _Trail_free(void* p) {
+  SDL_Trail *trail = p;
+
+  if (!trail) return;
+
+  xfree(trail->xy);
+  xfree(trail->verts);
+  xfree(trail->indices);
+  xfree(trail);
+}
+
+static void _Trail_mark(void* p) {
+  UNUSED(p);
+}
+
+static size_t _Trail_memsize(const void *p) {
+  const SDL_Trail *trail = p;
+
+  if (!trail) return 0;
+
+  return sizeof(SDL_Trail) +
+    trail->max * (2 * sizeof(float) + 4 * sizeof(SDL_Vertex) + 6 * sizeof(int));
+}
+
+static VALUE Trail_s_new(VALUE klass, VALUE max_) {
+  int max = NUM2INT(max_);
+
+  if (max < 1)
+    rb_raise(rb_eArgError, "trail needs at least 1 point, not %d", max);
+
+  SDL_Trail *trail;
+  VALUE self = TypedData_Make_Struct(klass, SDL_Trail, &_Trail_type, trail);
+
+  trail->max     = max;
+  trail->xy      = ALLOC_N(float,      2 * max);
+  trail->verts   = ZALLOC_N(SDL_Vertex, 4 * (max - 1));
+  trail->indices = ALLOC_N(int,        6 * (max - 1));
+
+  for (int i = 0; i < max - 1; i++) {
+    int *idx = trail->indices + 6 * i, v = 4 * i;
+
+    idx[0] = v;     idx[1] = v + 1; idx[2] = v + 2;
+    idx[3] = v + 1; idx[4] = v + 3; idx[5] = v + 2;
+  }
+
+  return self;
+}
+
+// Point k back from the newest (0 is the newest).
+static const float* _Trail_point(const SDL_Trail *trail, int k) {
+  int i = trail->head - 1 - k;
+
+  if (i < 0) i += trail->max;
+
+  return trail->xy + 2 * i;
+}
+
+static VALUE Trail_push(VALUE self, VALUE x, VALUE y) {
+  DEFINE_SELF(Trail, trail, self);
+
+  float *xy = trail->xy + 2 * trail->head;
+
+  xy[0] = (float)NUM2DBL(x);
+  xy[1] = (float)NUM2DBL(y);
+
+  trail->head = (trail->head + 1) % trail->max;
+  if (trail->n < trail->max) trail->n++;
+
+  return self;
+}
+
+static VALUE Trail_clear(VALUE self) {
+  DEFINE_SELF(Trail, trail, self);
+
+  trail->head = trail->n = 0;
+
+  return self;
+}
+
+static VALUE Trail_max(VALUE self) {
+  DEFINE_SELF(Trail, trail, self);
+
+  return INT2NUM(trail->max);
+}
+
+static VALUE Trail_size(VALUE self) {
+  DEFINE_SELF(Trail, trail, self);
+
+  return INT2NUM(trail->n);
+}
+
+// Oldest first, same as the array Graphics::Trail used to keep.
+static VALUE Trail_to_a(VALUE self) {
+  DEFINE_SELF(Trail, trail, self);
+
+  VALUE ary = rb_ary_new_capa(trail->n);
+
+  for (int k = trail->n - 1; k >= 0; k--) {
+    const float *xy = _Trail_point(trail, k);
+
+    rb_ary_push(ary, rb_assoc_new(DBL2NUM(xy[0]), DBL2NUM(xy[1])));
+  }
+
+  return ary;
+}
+
+// colors is a string of RGBA bytes: the first for the newest point,
+// the last for the oldest point the trail can hold. Points are flipped
+// about h (like Simulation does) unless h is nil.
+static VALUE Renderer_draw_trail(VALUE self, VALUE trail_, VALUE colors,
+                                 VALUE h_) {
+  DEFINE_SELF(Renderer, renderer, self);
+  DEFINE_SELF(Trail, trail, trail_);
+
+  StringValue(colors);
+
+  long ncolors = RSTRING_LEN(colors) / 4;
+  const SDL_Color *lut = (const SDL_Color *)RSTRING_PTR(colors);
+
+  if (ncolors < 1)
+    rb_raise(rb_eArgError, "need at least one color");
+
+  if (trail->n < 2) return Qnil;
+
+  int   flip = !NIL_P(h_);
+  float h    = flip ? (float)NUM2DBL(h_) - 1 : 0;
+
+  SDL_Vertex *v = trail->verts;
+
+  for (int k = 0; k < trail->n - 1; k++, v += 4) {
+    const float *p0 = _Trail_point(trail, k);
+    const float *p1 = _Trail_point(trail, k + 1);
+
+    float x0 = p0[0], y0 = flip ? h - p0[1] : p0[1];
+    float x1 = p1[0], y1 = flip ? h - p1[1] : p1[1];
+
+    // half a pixel either side of the segment
+    float dx = x1 - x0, dy = y1 - y0;
+    float len = SDL_sqrtf(dx * dx + dy * dy);
+    float nx = len > 0 ? -dy / len * 0.5f : 0;
+    float ny = len > 0 ?  dx / len * 0.5f : 0;
+
+    long c0 = (long)k       * (ncolors - 1) / (trail->max - 1);
+    long c1 = (long)(k + 1) * (ncolors - 1) / (trail->max - 1);
+
+    v[0].position = (SDL_FPoint) { x0 + nx, y0 + ny };
+    v[1].position = (SDL_FPoint) { x0 - nx, y0 - ny };
+    v[2].position = (SDL_FPoint) { x1 + nx, y1 + ny };
+    v[3].position = (SDL_FPoint) { x1 - nx, y1 - ny };
+
+    v[0].color = v[1].color = lut[c0];
+    v[2].color = v[3].color = lut[c1];
+  }
+
+  int segments = trail->n - 1;
+
+  if (SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND) ||
+      SDL_RenderGeometry(renderer, NULL, trail->verts, 4 * segments,
+                         trail->indices, 6 * segments))
+    FAILURE("Renderer#draw_trail");
+
+  return Qnil;
+}
+
+//// SDL::Window methods:
+
+static void _Window_free(void* Window) {
+  if (is_quit) return;
+  if (Window) SDL_DestroyWindow(Window);
+}
+
+static void _Window_mark(void* Window) {
+  UNUSED(Window);
+}
+
+static VALUE Window_title_eq(VALUE self, VALUE title) {
+  DEFINE_SELF(Window, window, self);
+
+  ExportStringValue(title);
+
+  SDL_SetWindowTitle(window, StringValueCStr(title));
+
+  return Qnil;
+}
+
+static VALUE Window_title(VALUE self) {
+  DEFINE_SELF(Window, window, self);
+
+  const char* title = SDL_GetWindowTitle(window);
+
+  return rb_str_new_cstr(title);
+}
+
+static VALUE Window_update(VALUE self) {
+  DEFINE_SELF(Window, window, self);
+
+  if (SDL_UpdateWindowSurface(window))
+    FAILURE("Window#update");
+
+  return Qnil;
+}
+
+//// SDL::TTFFont methods:
+
+static void _TTFFont_free(void* font) {
+  if (is_quit) return;
+  if (font) TTF_CloseFont(font);
+}
+
+static void _TTFFont_mark(void* p) {
+  UNUSED(p);
+}
+
+static VALUE Font_s_open(int argc, VALUE *argv, VALUE self) {
+  UNUSED(self);
+  VALUE path, size, index;
+
+  rb_scan_args(argc, argv, "21", &path, &size, &index);
+
+  ExportStringValue(path);
+
+  TTF_Font* font = TTF_OpenFontIndex(RSTRING_PTR(path), NUM2UINT16(size),
+                                     NIL_P(index) ? 0 : NUM2LONG(index));
+
+  if (!font)
+    FAILURE("Font.open");
+
+  return TypedData_Wrap_Struct(cTTFFont, &_TTFFont_type, font);
+}
+
+#ifdef HAVE_FONTCONFIG_FONTCONFIG_H
+static int _Font_fc_named(FcPattern* match, const char* object, const char* name) {
+  FcChar8* s;
+
+  for (int i = 0; FcPatternGetString(match, object, i, &s) == FcResultMatch; i++)
+    if (!SDL_strcasecmp((const char*)s, name))
+      return 1;
+
+  return 0;
+}
+
+static VALUE Font_s_fontconfig(VALUE self, VALUE name) {
+  UNUSED(self);
+  VALUE result = Qnil;
+  const char* cname = StringValueCStr(name);
+  FcResult status;
+  FcChar8* file;
+  int index = 0;
+
+  FcPattern* pattern = FcNameParse((const FcChar8*)cname);
+  if (!pattern) return Qnil;
+
+  FcConfigSubstitute(NULL, pattern, FcMatchPattern);
+  FcDefaultSubstitute(pattern);
+
+  FcPattern* match = FcFontMatch(NULL, pattern, &status);
+  FcPatternDestroy(pattern);
+  if (!match) return Qnil;
+
+  // FcFontMatch always answers with *something*, so only take it if
+  // it's really the font that was asked for.
+  if (FcPatternGetString(match, FC_FILE, 0, &file) == FcResultMatch &&
+      (_Font_fc_named(match, FC_FAMILY, cname) ||
+       _Font_fc_named(match, FC_POSTSCRIPT_NAME, cname) ||
+       _Font_fc_named(match, FC_FULLNAME, cname))) {
+    FcPatternGetInteger(match, FC_INDEX, 0, &index);
+    result = rb_ary_new_from_args(2, rb_str_new_cstr((const char*)file),
+                                  INT2NUM(index));
+  }
+
+  FcPatternDestroy(match);
+
+  return result;
+}
+#endif
+
+static VALUE Font_height(VALUE self) {
+  DEFINE_SELF(TTFFont, font, self);
+
+  return INT2FIX(TTF_FontHeight(font));
+}
+
+static VALUE Font_render(VALUE self, VALUE dst, VALUE text, VALUE c) {
+  DEFINE_SELF(TTFFont, font, self);
+  DEFINE_SELF(PixelFormat, format, rb_ivar_get(dst, id_iv_format));
+
+  SDL_Surface *result;
+  SDL_Color fg;
+
+  SDL_GetRGBA(VALUE2COLOR(c), format,
+              &(fg.r), &(fg.g), &(fg.b), &(fg.a));
+
+  ExportStringValue(text);
+  result = TTF_RenderUTF8_Blended(font, StringValueCStr(text), fg);
+
+  if (!result)
+    TTF_FAILURE("Font.render");
+
+  return _Surface_wrap(result);
+}
+
+static VALUE Font_draw(VALUE self, VALUE dst, VALUE text, VALUE x, VALUE y, VALUE c) {
+  VALUE img = Font_render(self, dst, text, c);
+  return Renderer_blit(dst, img, x, y, Qnil, Qnil, Qnil, Qnil);
+}
+
+static VALUE Font_text_size(VALUE self, VALUE text) {
+  DEFINE_SELF(TTFFont, font, self);
+  int w = 1, h = 2, result;
+
+  ExportStringValue(text);
+  result = TTF_SizeText(font, StringValueCStr(text), &w, &h);
+
+  if (!result) {
+    return rb_ary_new_from_args(2, INT2FIX(w), INT2FIX(h));
+  } else {
+    FAILURE("SDL::TTF#text_size");
+  }
+}
+
+//// V methods:
+
+// V is just two doubles. Its type is spelled out by hand rather than
+// with DEFINE_CLASS so that it can be embedded in the object itself (no
+// malloc per vector on rubies that can), skip the write barrier dance
+// (it holds no references), and be shared between ractors once frozen.
+
+typedef struct {
+  double x, y;
+} SDL_V;
+
+#ifdef TYPED_DATA_EMBEDDED
+#define V_TYPE_FLAGS (RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED | \
+                      RUBY_TYPED_FROZEN_SHAREABLE | RUBY_TYPED_EMBEDDABLE)
+#else
+#define V_TYPE_FLAGS (RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED | \
+                      RUBY_TYPED_FROZEN_SHAREABLE)
+#endif
+
+static size_t _V_memsize(const void *p) {
+  UNUSED(p);
+
+  return sizeof(SDL_V);
+}
+
+static VALUE cV;
+static const rb_data_type_t _V_type = {
+  "V",
+  { NULL, RUBY_TYPED_DEFAULT_FREE, _V_memsize, }, NULL, NULL,
+  V_TYPE_FLAGS,
+};
+
+static SDL_V* ruby_to_V(VALUE val) {
+  SDL_V* ret;
+  TypedData_Get_Struct(val, SDL_V, &_V_type, ret);
+  return ret;
+}
+
+static VALUE _V_make(VALUE klass, double x, double y) {
+  SDL_V *v;
+  VALUE self = TypedData_Make_Struct(klass, SDL_V, &_V_type, v);
+
+  v->x = x;
+  v->y = y;
+
+  return self;
+}
+
+// Anything with x & y will do, but a V doesn't need the method calls.
+static SDL_V _V_arg(VALUE o) {
+  if (rb_typeddata_is_kind_of(o, &_V_type))
+    return *ruby_to_V(o);
+
+  SDL_V v = { NUM2DBL(rb_funcall(o, rb_intern("x"), 0)),
+              NUM2DBL(rb_funcall(o, rb_intern("y"), 0)) };
+
+  return v;
+}
+
+static SDL_V* _V_modify(VALUE self) {
+  rb_check_frozen(self);
+
+  return ruby_to_V(self);
+}
+
+static VALUE V_s_allocate(VALUE klass) {
+  return _V_make(klass, 0, 0);
+}
 
-  // TODO: remove this or drop down to SDL_AllocFormat only
+static VALUE V_s_new(VALUE klass, VALUE x, VALUE y) {
+  return _V_make(klass, NUM2DBL(x), NUM2DBL(y));
+}
 
-  if (src) {
-    palette = ALLOC(SDL_Palette);
-    palette->ncolors = src->ncolors;
-    palette->colors  = ALLOC_N(SDL_Color, (size_t)src->ncolors);
-    MEMCPY(palette->colors, src->colors, SDL_Color, (size_t)src->ncolors);
+static VALUE V_initialize(VALUE self, VALUE x, VALUE y) {
+  SDL_V *v = _V_modify(self);
+
+  v->x = NUM2DBL(x);
+  v->y = NUM2DBL(y);
+
+  return self;
+}
+
+static VALUE V_initialize_copy(VALUE self, VALUE other) {
+  *_V_modify(self) = *ruby_to_V(other);
+
+  return self;
+}
+
+static VALUE V_x(VALUE self) {
+  return DBL2NUM(ruby_to_V(self)->x);
+}
+
+static VALUE V_y(VALUE self) {
+  return DBL2NUM(ruby_to_V(self)->y);
+}
+
+static VALUE V_x_eq(VALUE self, VALUE x) {
+  _V_modify(self)->x = NUM2DBL(x);
+
+  return x;
+}
+
+static VALUE V_y_eq(VALUE self, VALUE y) {
+  _V_modify(self)->y = NUM2DBL(y);
+
+  return y;
+}
+
+static VALUE V_plus(VALUE self, VALUE other) {
+  SDL_V *a = ruby_to_V(self), b = _V_arg(other);
+
+  return _V_make(cV, a->x + b.x, a->y + b.y);
+}
+
+static VALUE V_minus(VALUE self, VALUE other) {
+  SDL_V *a = ruby_to_V(self), b = _V_arg(other);
+
+  return _V_make(cV, a->x - b.x, a->y - b.y);
+}
+
+static VALUE V_uminus(VALUE self) {
+  SDL_V *a = ruby_to_V(self);
+
+  return _V_make(cV, -a->x, -a->y);
+}
+
+static VALUE V_mul(VALUE self, VALUE s_) {
+  SDL_V *a = ruby_to_V(self);
+  double s = NUM2DBL(s_);
+
+  return _V_make(cV, a->x * s, a->y * s);
+}
+
+static VALUE V_div(VALUE self, VALUE s_) {
+  SDL_V *a = ruby_to_V(self);
+  double s = NUM2DBL(s_);
+
+  return _V_make(cV, a->x / s, a->y / s);
+}
+
+static VALUE V_equals(VALUE self, VALUE other) {
+  if (!rb_typeddata_is_kind_of(other, &_V_type))
+    return Qfalse;
+
+  SDL_V *a = ruby_to_V(self), *b = ruby_to_V(other);
+
+  return INT2BOOL(a->x == b->x && a->y == b->y);
+}
+
+static VALUE V_magnitude(VALUE self) {
+  SDL_V *a = ruby_to_V(self);
+
+  return DBL2NUM(sqrt(a->x * a->x + a->y * a->y));
+}
+
+static VALUE V_dot(VALUE self, VALUE other) {
+  SDL_V *a = ruby_to_V(self), b = _V_arg(other);
+
+  return DBL2NUM(a->x * b.x + a->y * b.y);
+}
+
+static VALUE V_add_bang(VALUE self, VALUE other) {
+  SDL_V *a = _V_modify(self), b = _V_arg(other);
+
+  a->x += b.x;
+  a->y += b.y;
+
+  return self;
+}
+
+static VALUE V_sub_bang(VALUE self, VALUE other) {
+  SDL_V *a = _V_modify(self), b = _V_arg(other);
+
+  a->x -= b.x;
+  a->y -= b.y;
+
+  return self;
+}
+
+static VALUE V_scale_bang(VALUE self, VALUE s_) {
+  SDL_V *a = _V_modify(self);
+  double s = NUM2DBL(s_);
+
+  a->x *= s;
+  a->y *= s;
+
+  return self;
+}
+
+static VALUE V_to_a(VALUE self) {
+  SDL_V *a = ruby_to_V(self);
+
+  return rb_assoc_new(DBL2NUM(a->x), DBL2NUM(a->y));
+}
+
+static VALUE V_marshal_load(VALUE self, VALUE xy) {
+  return V_initialize(self, rb_ary_entry(xy, 0), rb_ary_entry(xy, 1));
+}
+
+//// V::Array methods:
+
+// A packed array of vectors, x & y interleaved, for doing the same
+// math to a whole system of particles without a V per particle. The
+// bulk operations are plain loops over contiguous doubles, which the
+// compiler is free to vectorize.
+
+struct SDL_VArray {
+  double *xy;
+  long    n;
+};
+
+static void _VArray_free(void* p) {
+  SDL_VArray *ary = p;
+
+  if (!ary) return;
+
+  xfree(ary->xy);
+  xfree(ary);
+}
+
+static void _VArray_mark(void* p) {
+  UNUSED(p);
+}
+
+static size_t _VArray_memsize(const void *p) {
+  const SDL_VArray *ary = p;
+
+  return ary ? sizeof(SDL_VArray) + 2 * ary->n * sizeof(double) : 0;
+}
+
+static VALUE VArray_s_new(VALUE klass, VALUE n_) {
+  long n = NUM2LONG(n_);
+
+  if (n < 0)
+    rb_raise(rb_eArgError, "negative array size");
+
+  SDL_VArray *ary;
+  VALUE self = TypedData_Make_Struct(klass, SDL_VArray, &_VArray_type, ary);
+
+  ary->n  = n;
+  ary->xy = ZALLOC_N(double, 2 * n);
+
+  return self;
+}
+
+static SDL_VArray* _VArray_modify(VALUE self) {
+  rb_check_frozen(self);
+
+  return ruby_to_VArray(self);
+}
+
+static SDL_VArray* _VArray_same(SDL_VArray *ary, VALUE other) {
+  DEFINE_SELF(VArray, b, other);
+
+  if (b->n != ary->n)
+    rb_raise(rb_eArgError, "size mismatch: %ld vs %ld", ary->n, b->n);
+
+  return b;
+}
+
+static double* _VArray_at(SDL_VArray *ary, VALUE i_) {
+  long i = NUM2LONG(i_);
+
+  if (i < 0) i += ary->n;
+
+  if (i < 0 || i >= ary->n)
+    rb_raise(rb_eIndexError, "index %ld outside of V::Array (%ld)",
+             NUM2LONG(i_), ary->n);
+
+  return ary->xy + 2 * i;
+}
+
+static VALUE VArray_size(VALUE self) {
+  DEFINE_SELF(VArray, ary, self);
+
+  return LONG2NUM(ary->n);
+}
+
+static VALUE VArray_index(VALUE self, VALUE i) {
+  DEFINE_SELF(VArray, ary, self);
+  double *xy = _VArray_at(ary, i);
+
+  return _V_make(cV, xy[0], xy[1]);
+}
+
+static VALUE VArray_index_eq(VALUE self, VALUE i, VALUE v_) {
+  double *xy = _VArray_at(_VArray_modify(self), i);
+  SDL_V v = _V_arg(v_);
+
+  xy[0] = v.x;
+  xy[1] = v.y;
+
+  return v_;
+}
+
+static VALUE VArray_to_a(VALUE self) {
+  DEFINE_SELF(VArray, ary, self);
+  VALUE result = rb_ary_new_capa(ary->n);
+
+  for (long i = 0; i < ary->n; i++)
+    rb_ary_push(result, _V_make(cV, ary->xy[2 * i], ary->xy[2 * i + 1]));
+
+  return result;
+}
+
+static VALUE VArray_fill(VALUE self, VALUE v_) {
+  SDL_VArray *ary = _VArray_modify(self);
+  SDL_V v = _V_arg(v_);
+
+  for (long i = 0; i < ary->n; i++) {
+    ary->xy[2 * i]     = v.x;
+    ary->xy[2 * i + 1] = v.y;
+  }
+
+  return self;
+}
+
+// self += a * other
+static VALUE VArray_axpy_bang(VALUE self, VALUE a_, VALUE other) {
+  SDL_VArray *ary = _VArray_modify(self);
+  SDL_VArray *b   = _VArray_same(ary, other);
+  double a = NUM2DBL(a_);
+  double *restrict y = ary->xy;
+  const double *restrict x = b->xy;
+
+  if (y == x) {                         // a.axpy! 1, a
+    for (long i = 0; i < 2 * ary->n; i++)
+      y[i] *= 1 + a;
   } else {
-    palette = NULL;
+    for (long i = 0; i < 2 * ary->n; i++)
+      y[i] += a * x[i];
+  }
+
+  return self;
+}
+
+static VALUE VArray_scale_bang(VALUE self, VALUE s_) {
+  SDL_VArray *ary = _VArray_modify(self);
+  double s = NUM2DBL(s_);
+
+  for (long i = 0; i < 2 * ary->n; i++)
+    ary->xy[i] *= s;
+
+  return self;
+}
+
+// Zero length vectors stay zero.
+static VALUE VArray_normalize_bang(VALUE self) {
+  SDL_VArray *ary = _VArray_modify(self);
+
+  for (long i = 0; i < ary->n; i++) {
+    double *v = ary->xy + 2 * i;
+    double m  = sqrt(v[0] * v[0] + v[1] * v[1]);
+    double s  = m > 0 ? 1 / m : 0;
+
+    v[0] *= s;
+    v[1] *= s;
+  }
+
+  return self;
+}
+
+// Shorten any vector longer than max to max.
+static VALUE VArray_clamp_bang(VALUE self, VALUE max_) {
+  SDL_VArray *ary = _VArray_modify(self);
+  double max = NUM2DBL(max_);
+
+  for (long i = 0; i < ary->n; i++) {
+    double *v = ary->xy + 2 * i;
+    double m2 = v[0] * v[0] + v[1] * v[1];
+    double s  = m2 > max * max ? max / sqrt(m2) : 1;
+
+    v[0] *= s;
+    v[1] *= s;
+  }
+
+  return self;
+}
+
+// Like Body#wrap: anything off one edge of [0, w] x [0, h] comes back
+// on the opposite edge.
+static VALUE VArray_wrap_bang(VALUE self, VALUE w_, VALUE h_) {
+  SDL_VArray *ary = _VArray_modify(self);
+  double w = NUM2DBL(w_), h = NUM2DBL(h_);
+
+  for (long i = 0; i < ary->n; i++) {
+    double *v = ary->xy + 2 * i;
+
+    if (v[0] < 0)      v[0] = w;
+    else if (v[0] > w) v[0] = 0;
+
+    if (v[1] < 0)      v[1] = h;
+    else if (v[1] > h) v[1] = 0;
+  }
+
+  return self;
+}
+
+// Sum of the dot products of each pair of vectors.
+static VALUE VArray_dot(VALUE self, VALUE other) {
+  DEFINE_SELF(VArray, ary, self);
+  SDL_VArray *b = _VArray_same(ary, other);
+  double sum = 0;
+
+  for (long i = 0; i < 2 * ary->n; i++)
+    sum += ary->xy[i] * b->xy[i];
+
+  return DBL2NUM(sum);
+}
+
+//// Graphics::SPH methods:
+
+// Smoothed particle hydrodynamics, the same model as examples/fluid.rb
+// but with the particles stored as columns of doubles, neighbors found
+// through a uniform grid of h sized cells, and the kernel constants
+// worked out once instead of per pair.
+//
+// A step is three passes: density, then forces (which need every
+// density), then integration. Each pass only writes its own particle,
+// so the first two are split across threads and the whole step runs
+// without the GVL.
+
+struct SDL_SPH {
+  double    *x, *y, *vx, *vy, *rho, *fx, *fy;
+  int        n, capa;
+  int        threads;
+
+  double     mass, density, k, eta, h, gx, gy;
+  double     h2;
+  double     poly6;                     // 315 / (64 pi h^9) * mass
+  double     spiky;                     // 45 / (pi h^6)
+  double     viscosity;                 // 45 / (2 pi h^5) * eta * mass
+
+  point_grid grid;
+  double     dt;                        // for the step in progress
+  int        busy;                      // stepping without the GVL
+};
+
+static void _SPH_free(void* p) {
+  SDL_SPH *sph = p;
+
+  if (!sph) return;
+
+  xfree(sph->x);   xfree(sph->y);
+  xfree(sph->vx);  xfree(sph->vy);
+  xfree(sph->rho);
+  xfree(sph->fx);  xfree(sph->fy);
+  _grid_free(&sph->grid);
+  xfree(sph);
+}
+
+static void _SPH_mark(void* p) {
+  UNUSED(p);
+}
+
+static size_t _SPH_memsize(const void *p) {
+  const SDL_SPH *sph = p;
+
+  if (!sph) return 0;
+
+  return sizeof(SDL_SPH) + 7 * sph->capa * sizeof(double) +
+    _grid_memsize(&sph->grid);
+}
+
+// new(mass:, density:, k:, eta:, h:, gravity:, threads: cpus)
+//
+// Takes the same constants as the SPH class in examples/fluid.rb.
+// gravity is a V (or anything with x & y).
+
+static VALUE SPH_s_new(int argc, VALUE *argv, VALUE klass) {
+  VALUE opts;
+  VALUE vals[7] = { Qundef, Qundef, Qundef, Qundef, Qundef, Qundef, Qundef };
+  ID ids[] = { rb_intern("mass"), rb_intern("density"), rb_intern("k"),
+               rb_intern("eta"),  rb_intern("h"),       rb_intern("gravity"),
+               rb_intern("threads") };
+
+  rb_scan_args(argc, argv, "0:", &opts);
+  rb_get_kwargs(opts, ids, 6, 1, vals);
+
+  SDL_SPH *sph;
+  VALUE self = TypedData_Make_Struct(klass, SDL_SPH, &_SPH_type, sph);
+
+  SDL_V g = _V_arg(vals[5]);
+
+  sph->mass    = NUM2DBL(vals[0]);
+  sph->density = NUM2DBL(vals[1]);
+  sph->k       = NUM2DBL(vals[2]);
+  sph->eta     = NUM2DBL(vals[3]);
+  sph->h       = NUM2DBL(vals[4]);
+  sph->gx      = g.x;
+  sph->gy      = g.y;
+  sph->threads = vals[6] == Qundef ? SDL_GetCPUCount() : NUM2INT(vals[6]);
+
+  double h = sph->h;
+
+  if (!(h > 0))
+    rb_raise(rb_eArgError, "h must be positive");
+
+  sph->h2        = h * h;
+  sph->poly6     = 315.0 / (64 * M_PI * pow(h, 9)) * sph->mass;
+  sph->spiky     = 45.0 / (M_PI * pow(h, 6));
+  sph->viscosity = 45.0 / (2 * M_PI * pow(h, 5)) * sph->eta * sph->mass;
+
+  return self;
+}
+
+static VALUE SPH_add(VALUE self, VALUE x, VALUE y) {
+  DEFINE_SELF(SPH, sph, self);
+
+  _busy_check(sph->busy, "SPH");
+
+  if (sph->n == sph->capa) {
+    int capa = sph->capa ? 2 * sph->capa : 256;
+
+    REALLOC_N(sph->x,   double, capa);
+    REALLOC_N(sph->y,   double, capa);
+    REALLOC_N(sph->vx,  double, capa);
+    REALLOC_N(sph->vy,  double, capa);
+    REALLOC_N(sph->rho, double, capa);
+    REALLOC_N(sph->fx,  double, capa);
+    REALLOC_N(sph->fy,  double, capa);
+
+    sph->capa = capa;
+  }
+
+  int i = sph->n++;
+
+  sph->x[i]   = NUM2DBL(x);
+  sph->y[i]   = NUM2DBL(y);
+  sph->vx[i]  = sph->vy[i] = 0;
+  sph->fx[i]  = sph->fy[i] = 0;
+  sph->rho[i] = sph->density;
+
+  return self;
+}
+
+static VALUE SPH_size(VALUE self) {
+  DEFINE_SELF(SPH, sph, self);
+
+  return INT2NUM(sph->n);
+}
+
+static void _SPH_density(void *ctx, int lo, int hi) {
+  SDL_SPH *sph = ctx;
+  const double *x = sph->x, *y = sph->y;
+  double h2 = sph->h2;
+
+  for (int i = lo; i < hi; i++) {
+    double rho = 0;
+
+    GRID_EACH_NEIGHBOR(&sph->grid, i, j, {
+      double dx = x[i] - x[j], dy = y[i] - y[j];
+      double r2 = dx * dx + dy * dy;
+
+      if (r2 > 0 && r2 < h2) {
+        double d = h2 - r2;
+        rho += d * d * d;
+      }
+    });
+
+    sph->rho[i] = sph->density + sph->poly6 * rho;
+  }
+}
+
+static void _SPH_forces(void *ctx, int lo, int hi) {
+  SDL_SPH *sph = ctx;
+  const double *x = sph->x, *y = sph->y, *vx = sph->vx, *vy = sph->vy;
+  const double *rho = sph->rho;
+  double h = sph->h, h2 = sph->h2, k = sph->k, rest = sph->density;
+  double half_mass = sph->mass / 2;
+
+  for (int i = lo; i < hi; i++) {
+    double fx = 0, fy = 0;
+    double pi = k * (rho[i] - rest);
+
+    GRID_EACH_NEIGHBOR(&sph->grid, i, j, {
+      double dx = x[i] - x[j], dy = y[i] - y[j];
+      double r2 = dx * dx + dy * dy;
+
+      if (r2 > 0 && r2 <= h2) {
+        double len = sqrt(r2), d = h - len;
+        double pj  = k * (rho[j] - rest);
+
+        // pressure: -spiky gradient, scaled by the pair's mean pressure
+        double press = sph->spiky * d * d / len * half_mass * (pi + pj) / rho[j];
+        // viscosity: pulls toward the neighbor's velocity
+        double visc  = sph->viscosity * (1 - len / h) / rho[j];
+
+        fx += dx * press + (vx[j] - vx[i]) * visc;
+        fy += dy * press + (vy[j] - vy[i]) * visc;
+      }
+    });
+
+    sph->fx[i] = fx;
+    sph->fy[i] = fy;
+  }
+}
+
+// Same (explicit euler) integration as the ruby version.
+static void _SPH_integrate(SDL_SPH *sph) {
+  double dt = sph->dt, gx = sph->gx * dt, gy = sph->gy * dt;
+  double *restrict x  = sph->x,  *restrict y  = sph->y;
+  double *restrict vx = sph->vx, *restrict vy = sph->vy;
+  const double *restrict fx  = sph->fx, *restrict fy = sph->fy;
+  const double *restrict rho = sph->rho;
+
+  for (int i = 0; i < sph->n; i++) {
+    double s = dt * dt / rho[i];
+
+    vx[i] += fx[i] * s + gx;
+    vy[i] += fy[i] * s + gy;
+    x[i]  += vx[i] * dt;
+    y[i]  += vy[i] * dt;
+  }
+}
+
+static void* _SPH_step_without_gvl(void *data) {
+  SDL_SPH *sph = data;
+
+  _parallel_for(sph->n, sph->threads, _SPH_density, sph);
+  _parallel_for(sph->n, sph->threads, _SPH_forces,  sph);
+  _SPH_integrate(sph);
+
+  return NULL;
+}
+
+static VALUE SPH_step(VALUE self, VALUE dt) {
+  DEFINE_SELF(SPH, sph, self);
+
+  _busy_check(sph->busy, "SPH");
+
+  if (!sph->n) return self;
+
+  sph->dt = NUM2DBL(dt);
+
+  _grid_build(&sph->grid, sph->x, sph->y, 1, sph->n, sph->h);
+
+  _busy_without_gvl(&sph->busy, _SPH_step_without_gvl, sph);
+
+  return self;
+}
+
+// contain(w, h = w)
+//
+// Nudges particles that left [0, w] x [0, h] back inside with a bit
+// of jitter so they don't stack up, and stops them in that direction.
+
+static VALUE SPH_contain(int argc, VALUE *argv, VALUE self) {
+  DEFINE_SELF(SPH, sph, self);
+  VALUE w_, h_;
+
+  rb_scan_args(argc, argv, "11", &w_, &h_);
+
+  double w = NUM2DBL(w_);
+  double h = NIL_P(h_) ? w : NUM2DBL(h_);
+
+  _busy_check(sph->busy, "SPH");
+
+  for (int i = 0; i < sph->n; i++) {
+    if (sph->x[i] >= w - 0.01) {
+      sph->x[i]  = w - (0.01 + 0.1 * rb_genrand_real());
+      sph->vx[i] = 0;
+    } else if (sph->x[i] < 0.01) {
+      sph->x[i]  = 0.01 + 0.1 * rb_genrand_real();
+      sph->vx[i] = 0;
+    }
+
+    if (sph->y[i] >= h - 0.01) {
+      sph->y[i]  = h - (0.01 + 0.1 * rb_genrand_real());
+      sph->vy[i] = 0;
+    } else if (sph->y[i] < 0.01) {
+      sph->y[i]  = 0.01 + 0.1 * rb_genrand_real();
+      sph->vy[i] = 0;
+    }
+  }
+
+  return self;
+}
+
+// Yields x, y, vx, vy, and density for each particle.
+static VALUE SPH_each(VALUE self) {
+  DEFINE_SELF(SPH, sph, self);
+
+  RETURN_ENUMERATOR(self, 0, 0);
+
+  for (int i = 0; i < sph->n; i++) {
+    _busy_check(sph->busy, "SPH");     // the block may have let a step in
+    rb_yield_values(5,
+                    DBL2NUM(sph->x[i]),  DBL2NUM(sph->y[i]),
+                    DBL2NUM(sph->vx[i]), DBL2NUM(sph->vy[i]),
+                    DBL2NUM(sph->rho[i]));
+  }
+
+  return self;
+}
+
+//// Graphics::Flock methods:
+
+// The three boids rules from examples/boid.rb (cohesion, separation,
+// and alignment) over packed V::Arrays of positions and velocities.
+// Neighbors come from a grid of max_distance sized cells, and every
+// boid steers off the same snapshot of the flock, so boids can be
+// split across threads.
+
+struct SDL_Flock {
+  double        cohesion, separation, alignment;
+  double        max_distance, too_close, max_velocity;
+  int           threads;
+
+  point_grid    grid;
+  double       *out;                    // new velocities, x & y interleaved
+  long          out_capa;
+
+  const double *xy, *v;                 // for the step in progress
+  int           busy;                   // stepping without the GVL
+};
+
+static void _Flock_free(void* p) {
+  SDL_Flock *flock = p;
+
+  if (!flock) return;
+
+  _grid_free(&flock->grid);
+  xfree(flock->out);
+  xfree(flock);
+}
+
+static void _Flock_mark(void* p) {
+  UNUSED(p);
+}
+
+static size_t _Flock_memsize(const void *p) {
+  const SDL_Flock *flock = p;
+
+  if (!flock) return 0;
+
+  return sizeof(SDL_Flock) + flock->out_capa * sizeof(double) +
+    _grid_memsize(&flock->grid);
+}
+
+// A negative (or NaN) distance would still square to a positive reach
+// but leave the neighbor grid with cells it can't use, so it's 0.
+
+static double _Flock_distance(double d) {
+  return d > 0 ? d : 0;
+}
+
+// new(cohesion: 0.01, separation: 0.125, alignment: 0.25,
+//     max_distance: 100, too_close: 50, max_velocity: 5, threads: cpus)
+//
+// The defaults are the ones examples/boid.rb uses.
+
+static VALUE Flock_s_new(int argc, VALUE *argv, VALUE klass) {
+  VALUE opts;
+  VALUE vals[7] = { Qundef, Qundef, Qundef, Qundef, Qundef, Qundef, Qundef };
+  ID ids[] = { rb_intern("cohesion"),     rb_intern("separation"),
+               rb_intern("alignment"),    rb_intern("max_distance"),
+               rb_intern("too_close"),    rb_intern("max_velocity"),
+               rb_intern("threads") };
+
+  rb_scan_args(argc, argv, "0:", &opts);
+  if (!NIL_P(opts))
+    rb_get_kwargs(opts, ids, 0, 7, vals);
+
+  SDL_Flock *flock;
+  VALUE self = TypedData_Make_Struct(klass, SDL_Flock, &_Flock_type, flock);
+
+#define FLOCK_OPT(i, default) (vals[i] == Qundef ? (default) : NUM2DBL(vals[i]))
+  flock->cohesion     = FLOCK_OPT(0, 0.01);
+  flock->separation   = FLOCK_OPT(1, 1 / 8.0);
+  flock->alignment    = FLOCK_OPT(2, 1 / 4.0);
+  flock->max_distance = _Flock_distance(FLOCK_OPT(3, 100));
+  flock->too_close    = FLOCK_OPT(4, 50);
+  flock->max_velocity = FLOCK_OPT(5, 5);
+#undef FLOCK_OPT
+  flock->threads      = vals[6] == Qundef ? SDL_GetCPUCount() : NUM2INT(vals[6]);
+
+  return self;
+}
+
+static void _Flock_steer(void *ctx, int lo, int hi) {
+  SDL_Flock *flock = ctx;
+  const double *xy = flock->xy, *v = flock->v;
+  double far2   = flock->max_distance * flock->max_distance;
+  double close2 = flock->too_close * flock->too_close;
+  double max_v  = flock->max_velocity;
+
+  for (int i = lo; i < hi; i++) {
+    double px = xy[2 * i], py = xy[2 * i + 1];
+    double vx = v[2 * i],  vy = v[2 * i + 1];
+    double cx = 0, cy = 0, ax = 0, ay = 0, sx = 0, sy = 0;
+    int near = 0, close = 0;
+
+    GRID_EACH_NEIGHBOR(&flock->grid, i, j, {
+      if (j == i) continue;
+
+      double dx = xy[2 * j] - px, dy = xy[2 * j + 1] - py;
+      double r2 = dx * dx + dy * dy;
+
+      if (r2 < far2) {
+        near++;
+        cx += dx;          cy += dy;
+        ax += v[2 * j];    ay += v[2 * j + 1];
+
+        if (r2 < close2) {
+          close++;
+          sx += dx;        sy += dy;
+        }
+      }
+    });
+
+    double nvx = vx, nvy = vy;
+
+    if (near) {
+      // rule 1: toward the center of the neighbors
+      nvx += cx / near * flock->cohesion;
+      nvy += cy / near * flock->cohesion;
+      // rule 3: toward their average velocity
+      nvx += (ax / near - vx) * flock->alignment;
+      nvy += (ay / near - vy) * flock->alignment;
+    } else {
+      // alone, rule 3 in boid.rb hands back the boid's own velocity
+      nvx += vx;
+      nvy += vy;
+    }
+
+    if (close) {
+      // rule 2: away from the ones that are too close
+      nvx -= sx / close * flock->separation;
+      nvy -= sy / close * flock->separation;
+    }
+
+    double m2 = nvx * nvx + nvy * nvy;
+
+    if (m2 > max_v * max_v) {
+      double s = max_v / sqrt(m2);
+      nvx *= s;
+      nvy *= s;
+    }
+
+    flock->out[2 * i]     = nvx;
+    flock->out[2 * i + 1] = nvy;
+  }
+}
+
+typedef struct {
+  SDL_Flock *flock;
+  int        n;
+} flock_step;
+
+static void* _Flock_step_without_gvl(void *data) {
+  flock_step *step = data;
+
+  _parallel_for(step->n, step->flock->threads, _Flock_steer, step->flock);
+
+  return NULL;
+}
+
+// step(positions, velocities)
+//
+// Applies the rules to velocities (a V::Array the same size as
+// positions) in place. Moving is left to the caller, eg:
+//
+//   positions.axpy! 1, velocities
+
+static VALUE Flock_step(VALUE self, VALUE positions, VALUE velocities) {
+  DEFINE_SELF(Flock, flock, self);
+  SDL_VArray *v  = _VArray_modify(velocities);
+  SDL_VArray *xy = _VArray_same(v, positions);
+
+  int n = (int)v->n;
+
+  _busy_check(flock->busy, "Flock");
+
+  if (!n) return self;
+
+  if (flock->out_capa < 2L * n) {
+    REALLOC_N(flock->out, double, 2L * n);
+    flock->out_capa = 2L * n;
   }
 
-  VALUE ret = TypedData_Make_Struct(cPixelFormat, SDL_PixelFormat, &_PixelFormat_type, format);
+  _grid_build(&flock->grid, xy->xy, xy->xy + 1, 2, n, flock->max_distance);
 
-  *format = *(surface->format);
-  format->palette = palette;
+  flock->xy = xy->xy;
+  flock->v  = v->xy;
 
-  return ret;
-}
+  flock_step step = { flock, n };
 
-static VALUE Renderer_h(VALUE self) {
-  DEFINE_SELF(Renderer, renderer, self);
+  _busy_without_gvl(&flock->busy, _Flock_step_without_gvl, &step);
 
-  int w, h;
+  MEMCPY(v->xy, flock->out, double, 2L * n);
 
-  SDL_GetRendererOutputSize(renderer, &w, &h);
+  return self;
+}
 
-  return INT2NUM(h);
+static VALUE Flock_max_distance(VALUE self) {
+  DEFINE_SELF(Flock, flock, self);
+
+  return DBL2NUM(flock->max_distance);
 }
 
-static VALUE Renderer_w(VALUE self) {
-  DEFINE_SELF(Renderer, renderer, self);
+static VALUE Flock_max_distance_eq(VALUE self, VALUE d) {
+  DEFINE_SELF(Flock, flock, self);
 
-  int w, h;
+  _busy_check(flock->busy, "Flock");
 
-  SDL_GetRendererOutputSize(renderer, &w, &h);
+  flock->max_distance = _Flock_distance(NUM2DBL(d));
 
-  return INT2NUM(w);
+  return d;
 }
 
-static VALUE Surface_h(VALUE self) {
-  DEFINE_SELF(Surface, surface, self);
+//// Graphics::CellGrid methods:
 
-  return INT2NUM(surface->h);
+// A toroidal grid of cells for Game of Life style automata: a cell's
+// next state only depends on whether it is alive and how many of its
+// eight neighbors are, per a B/S rule string like "B3/S23".
+//
+// Cells are packed 64 to a word, so a step works on 64 cells at a
+// time: the eight neighbor words are summed with bitwise adders into
+// four bit planes (the count's 1s, 2s, 4s, and 8s) and the rule is
+// applied to all of them at once. Rows are split across threads.
+
+struct SDL_CellGrid {
+  Uint64 *cells, *next;                 // h rows of words each
+  int     w, h, words;
+  Uint64  last;                         // mask of the real cells in a row's last word
+  Uint16  born, survive;                // bit n is set if n neighbors is a birth/survival
+  int     threads;
+  int     busy;                         // stepping or rendering without the GVL
+};
+
+#define CELL_ROW(grid, cells, y) ((cells) + (size_t)(y) * (grid)->words)
+
+static void _CellGrid_free(void* p) {
+  SDL_CellGrid *grid = p;
+
+  if (!grid) return;
+
+  xfree(grid->cells);
+  xfree(grid->next);
+  xfree(grid);
 }
 
-static VALUE Surface_index(VALUE self, VALUE x, VALUE y) {
-  rb_raise(eSDLError, "Reading the canvas isn't currently supported");
-  return Qnil;
+static void _CellGrid_mark(void* p) {
+  UNUSED(p);
 }
 
-static VALUE Renderer_index_eq(VALUE self, VALUE x, VALUE y, VALUE color) {
-  DEFINE_SELF(Renderer, renderer, self);
+static size_t _CellGrid_memsize(const void *p) {
+  const SDL_CellGrid *grid = p;
 
-  pixelColor(renderer, NUM2SINT16(x), NUM2SINT16(y), VALUE2COLOR(color));
+  if (!grid) return 0;
 
-  return Qnil;
+  return sizeof(SDL_CellGrid) + 2 * sizeof(Uint64) * grid->words * grid->h;
 }
 
-static SDL_Surface *pixel = NULL;
+// Accepts "B3/S23", "S23/B3", and the older "23/3" (survive/born).
+
+static void _CellGrid_parse_rule(SDL_CellGrid *grid, VALUE rule) {
+  const char *s = StringValueCStr(rule);
+  Uint16 born = 0, survive = 0, *set = NULL;
+  int slash = 0;
+
+  for (const char *c = s; *c; c++) {
+    switch (*c) {
+    case 'B': case 'b': set = &born;    break;
+    case 'S': case 's': set = &survive; break;
+    case '/':
+      if (slash++) goto bad;
+      set = NULL;
+      break;
+    default:
+      if (*c < '0' || *c > '8') goto bad;
+      if (!set) set = slash ? &born : &survive;
+      *set |= 1 << (*c - '0');
+    }
+  }
 
-static VALUE Renderer_index(VALUE self, VALUE x, VALUE y) {
-  DEFINE_SELF(Renderer, renderer, self);
+  grid->born    = born;
+  grid->survive = survive;
 
-  SDL_Rect pixel_rect = { NUM2SINT16(x), NUM2SINT16(y), 1, 1 };
+  return;
 
-  if (!pixel)
-    pixel = SDL_CreateRGBSurfaceWithFormat(0, 1, 1, 32,
-                                           SDL_PIXELFORMAT_RGBA32);
+ bad:
+  rb_raise(rb_eArgError, "bad rule %s", s);
+}
 
-  if (SDL_RenderReadPixels(renderer, &pixel_rect, SDL_PIXELFORMAT_RGBA32,
-                           pixel->pixels,
-                           pixel->pitch))
-    FAILURE("Renderer#[]");
+// new(w, h, rule: "B3/S23", threads: cpus)
 
-  return UINT2NUM(((Uint32*)pixel->pixels)[0]);
-}
+static VALUE CellGrid_s_new(int argc, VALUE *argv, VALUE klass) {
+  VALUE w_, h_, opts;
+  VALUE vals[2] = { Qundef, Qundef };
+  ID ids[] = { rb_intern("rule"), rb_intern("threads") };
 
-static VALUE Surface_make_collision_map(VALUE self) {
-  DEFINE_SELF(Surface, surface, self);
+  rb_scan_args(argc, argv, "2:", &w_, &h_, &opts);
+  if (!NIL_P(opts))
+    rb_get_kwargs(opts, ids, 0, 2, vals);
 
-  sge_cdata * cdata = sge_make_cmap(surface);
-  if (!cdata)
-    FAILURE("Surface#make_collision_map");
+  int w = NUM2INT(w_);
+  int h = NUM2INT(h_);
 
-  return TypedData_Wrap_Struct(cCollisionMap, &_CollisionMap_type, cdata);
-}
+  if (w <= 0 || h <= 0)
+    rb_raise(rb_eArgError, "bad grid size %dx%d", w, h);
 
-static VALUE Surface_w(VALUE self) {
-  DEFINE_SELF(Surface, surface, self);
+  SDL_CellGrid *grid;
+  VALUE self = TypedData_Make_Struct(klass, SDL_CellGrid, &_CellGrid_type, grid);
 
-  return INT2NUM(surface->w);
-}
+  grid->w       = w;
+  grid->h       = h;
+  grid->words   = (w + 63) / 64;
+  grid->last    = w % 64 ? ((Uint64)1 << (w % 64)) - 1 : ~(Uint64)0;
+  grid->threads = vals[1] == Qundef ? SDL_GetCPUCount() : NUM2INT(vals[1]);
+  grid->cells   = ZALLOC_N(Uint64, (size_t)grid->words * h);
+  grid->next    = ZALLOC_N(Uint64, (size_t)grid->words * h);
 
-// TODO: maybe remove? I dunno... could be nice for pre-rendering?
-static VALUE Surface_transform(VALUE self, VALUE angle,
-                               VALUE xscale, VALUE yscale,
-                               VALUE flags) {
-  DEFINE_SELF(Surface, surface, self);
+  _CellGrid_parse_rule(grid, vals[0] == Qundef ? rb_str_new_cstr("B3/S23") : vals[0]);
 
-  SDL_Surface *result = rotozoomSurfaceXY(surface,
-                                          NUM2FLT(angle),
-                                          NUM2FLT(xscale),
-                                          NUM2FLT(yscale),
-                                          SMOOTHING_ON);
+  return self;
+}
 
-  if (!result)
-    FAILURE("Surface#transform");
+static Uint64 _popcount64(Uint64 x) {
+  x = x - ((x >> 1) & 0x5555555555555555ULL);
+  x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+  x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
 
-  return TypedData_Wrap_Struct(cSurface, &_Surface_type, result);
+  return (x * 0x0101010101010101ULL) >> 56;
 }
 
-static VALUE Renderer_blit(VALUE self, VALUE src_,
-                           VALUE x_, VALUE y_,
-                           VALUE a_,
-                           VALUE ws_, VALUE hs_,
-                           VALUE center_) {
-  DEFINE_SELF(Renderer, renderer, self);
-  DEFINE_SELF(Surface, src, src_);
+// Each cell's neighbor to the west (x - 1) and east (x + 1), wrapping
+// around the row. Bits past w in the last word are always 0.
 
-  int x    = NUM2SINT16(x_);
-  int y    = NUM2SINT16(y_);
-  double a = RTEST(a_)  ? -NUM2DBL(a_) : 0.0;
-  float ws = RTEST(ws_) ? NUM2FLT(ws_) : 1.0;
-  float hs = RTEST(hs_) ? NUM2FLT(hs_) : 1.0;
+static inline Uint64 _cell_west(const SDL_CellGrid *grid, const Uint64 *row, int k) {
+  Uint64 carry = k ? row[k - 1] >> 63 : row[grid->words - 1] >> ((grid->w - 1) % 64);
 
-  SDL_Texture* texture;
-  VALUE vtexture = rb_attr_get(src_, id_iv_texture);
+  return (row[k] << 1) | (carry & 1);
+}
 
-  if (RTEST(vtexture)) {
-    SET_SELF(Texture, texture, vtexture);
-  } else {
-    texture = SDL_CreateTextureFromSurface(renderer, src);
-    if (!texture)
-      FAILURE("_blit(SDL_CreateTextureFromSurface)");
+static inline Uint64 _cell_east(const SDL_CellGrid *grid, const Uint64 *row, int k) {
+  if (k == grid->words - 1)
+    return (row[k] >> 1) | ((row[0] & 1) << ((grid->w - 1) % 64));
+
+  return (row[k] >> 1) | (row[k + 1] << 63);
+}
 
-    VALUE vtexture = TypedData_Wrap_Struct(cTexture, &_Texture_type, texture);
+#define FULL_ADD(s, c, a, b, d) do {             \
+    Uint64 _ab = (a) ^ (b);                      \
+    s = _ab ^ (d);                               \
+    c = ((a) & (b)) | (_ab & (d));               \
+  } while (0)
 
-    rb_ivar_set(src_, id_iv_texture,  vtexture);
+static void _CellGrid_step_rows(void *ctx, int lo, int hi) {
+  SDL_CellGrid *grid = ctx;
+  int words = grid->words;
+  Uint64 born[9], survive[9];
+
+  for (int n = 0; n < 9; n++) {
+    born[n]    = grid->born    & (1 << n) ? ~(Uint64)0 : 0;
+    survive[n] = grid->survive & (1 << n) ? ~(Uint64)0 : 0;
   }
 
-  int w, h;
-  if (SDL_QueryTexture(texture, NULL, NULL, &w, &h))
-    FAILURE("_blit(SDL_QueryTexture)");
+  for (int y = lo; y < hi; y++) {
+    const Uint64 *up   = CELL_ROW(grid, grid->cells, (y + grid->h - 1) % grid->h);
+    const Uint64 *mid  = CELL_ROW(grid, grid->cells, y);
+    const Uint64 *down = CELL_ROW(grid, grid->cells, (y + 1) % grid->h);
+    Uint64       *out  = CELL_ROW(grid, grid->next, y);
 
-  SDL_Rect dst_rect = { x, y, w*ws, h*hs };
+    for (int k = 0; k < words; k++) {
+      Uint64 a0, a1, b0, b1, c0, c1, ones, d1, t0, t1, t2, twos;
 
-  if (SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND))
-    FAILURE("Renderer#blit(SetTextureBlendMode)");
+      // neighbor counts, summed 64 cells at a time into bit planes
+      FULL_ADD(a0, a1, _cell_west(grid, up, k),   up[k],   _cell_east(grid, up, k));
+      FULL_ADD(b0, b1, _cell_west(grid, down, k), down[k], _cell_east(grid, down, k));
+      c0 = _cell_west(grid, mid, k) ^ _cell_east(grid, mid, k);
+      c1 = _cell_west(grid, mid, k) & _cell_east(grid, mid, k);
 
-  if (RTEST(a_) || RTEST(ws_) || RTEST(hs_)) {
-    SDL_Point bottom_left  = { 0, h-1 };
-    SDL_Point *point = (RTEST(center_) ? NULL : &bottom_left);
+      FULL_ADD(ones, d1, a0, b0, c0);
+      FULL_ADD(t0, t1, a1, b1, c1);
+      twos = t0 ^ d1;
+      t2   = t0 & d1;
 
-    if (SDL_RenderCopyEx(renderer, texture, NULL, &dst_rect,
-                         a, point, SDL_FLIP_NONE))
-      FAILURE("_blit(SDL_RenderCopyEx)");
-  } else {
-    if (SDL_RenderCopy(renderer, texture, NULL, &dst_rect))
-      FAILURE("_blit(SDL_RenderCopyEx)");
-  }
+      Uint64 fours  = t1 ^ t2;
+      Uint64 eights = t1 & t2;
+      Uint64 alive  = mid[k];
+      Uint64 result = 0;
 
-  return Qnil;
-}
+      for (int n = 0; n < 9; n++) {
+        if (!(born[n] | survive[n])) continue;
 
-static VALUE Renderer_sprite(VALUE self, VALUE w_, VALUE h_) {
-  UNUSED(self);
+        Uint64 is_n = ((n & 1) ? ones   : ~ones)
+                    & ((n & 2) ? twos   : ~twos)
+                    & ((n & 4) ? fours  : ~fours)
+                    & ((n & 8) ? eights : ~eights);
 
-  int w   = NUM2INT(w_);
-  int h   = NUM2INT(h_);
-  int bpp = 32;
+        result |= is_n & ((alive & survive[n]) | (~alive & born[n]));
+      }
 
-  SDL_Surface *surface =
-    SDL_CreateRGBSurfaceWithFormat(0, w, h, bpp, SDL_PIXELFORMAT_RGBA32);
-  if (!surface) FAILURE("Surface#sprite(CreateRGBSurfaceWithFormat)");
+      out[k] = result;
+    }
 
-  SDL_Renderer *renderer = SDL_CreateSoftwareRenderer(surface);
-  if (!renderer) FAILURE("Surface#sprite(CreateSoftwareRenderer)");
+    out[words - 1] &= grid->last;
+  }
+}
 
-  // bumps the refcount and returns the same thing
-  SDL_PixelFormat *format = SDL_AllocFormat(surface->format->format);
-  if (format != surface->format)
-    rb_raise(eSDLError, "SDL_AllocFormat freaked out. %p vs %p",
-             format,
-             surface->format);
+#undef FULL_ADD
 
-  VALUE vrenderer = TypedData_Wrap_Struct(cRenderer,    &_Renderer_type,    renderer);
-  VALUE vsurface  = TypedData_Wrap_Struct(cSurface,     &_Surface_type,     surface);
-  VALUE vformat   = TypedData_Wrap_Struct(cPixelFormat, &_PixelFormat_type, format);
+typedef struct {
+  SDL_CellGrid *grid;
+  long          n;
+} cell_grid_step;
 
-  rb_ivar_set(vrenderer, id_iv_surface, vsurface);
-  rb_ivar_set(vrenderer, id_iv_format,  vformat);
+static void* _CellGrid_step_without_gvl(void *data) {
+  cell_grid_step *step = data;
+  SDL_CellGrid   *grid = step->grid;
 
-  return vrenderer;
+  for (long i = 0; i < step->n; i++) {
+    _parallel_for(grid->h, grid->threads, _CellGrid_step_rows, grid);
+
+    Uint64 *tmp = grid->cells;
+    grid->cells = grid->next;
+    grid->next  = tmp;
+  }
+
+  return NULL;
 }
 
-static VALUE Renderer_save(VALUE self, VALUE path) {
-  DEFINE_SELF(Renderer, renderer, self);
+// step(n = 1)
 
-  int w, h;
-  SDL_GetRendererOutputSize(renderer, &w, &h);
+static VALUE CellGrid_step(int argc, VALUE *argv, VALUE self) {
+  DEFINE_SELF(CellGrid, grid, self);
+  VALUE n_;
 
-  SDL_Surface *sshot = SDL_CreateRGBSurfaceWithFormat(0, w, h, 32,
-                                                      SDL_PIXELFORMAT_RGBA32);
-  if (SDL_RenderReadPixels(renderer, NULL, SDL_PIXELFORMAT_RGBA32,
-                           sshot->pixels,
-                           sshot->pitch))
-    FAILURE("Renderer#save");
-  int ret = IMG_SavePNG(sshot, RSTRING_PTR(path));
-  SDL_FreeSurface(sshot);
+  rb_scan_args(argc, argv, "01", &n_);
 
-  return INT2NUM(ret);
-}
+  cell_grid_step step = { grid, NIL_P(n_) ? 1 : NUM2LONG(n_) };
 
-//// SDL::Renderer methods:
+  _busy_check(grid->busy, "CellGrid");
 
-static void _Renderer_free(void* renderer) {
-  if (is_quit) return;
-  if (renderer) SDL_DestroyRenderer(renderer);
+  if (step.n > 0)
+    _busy_without_gvl(&grid->busy, _CellGrid_step_without_gvl, &step);
+
+  return self;
 }
 
-static void _Renderer_mark(void* renderer) {
-  UNUSED(renderer);
+static int _CellGrid_wrap(int v, int n) {
+  v %= n;
+
+  return v < 0 ? v + n : v;
 }
 
-static VALUE Renderer_target(VALUE self) {
-  DEFINE_SELF(Renderer, renderer, self);
+// Coordinates wrap around, like the grid.
 
-  SDL_Texture* texture = SDL_GetRenderTarget(renderer);
+static VALUE CellGrid_index(VALUE self, VALUE x_, VALUE y_) {
+  DEFINE_SELF(CellGrid, grid, self);
 
-  if (!texture)
-    FAILURE("Renderer#target");
+  int x = _CellGrid_wrap(NUM2INT(x_), grid->w);
+  int y = _CellGrid_wrap(NUM2INT(y_), grid->h);
 
-  return TypedData_Wrap_Struct(cTexture, &_Texture_type, texture);
+  return INT2BOOL(CELL_ROW(grid, grid->cells, y)[x / 64] >> (x % 64) & 1);
 }
 
-static VALUE Renderer_target_eq(VALUE self, VALUE texture_) {
-  DEFINE_SELF(Renderer, renderer, self);
-  DEFINE_SELF0(Texture, texture, texture_);
+static VALUE CellGrid_index_eq(VALUE self, VALUE x_, VALUE y_, VALUE alive) {
+  DEFINE_SELF(CellGrid, grid, self);
 
-  if (SDL_SetRenderTarget(renderer, texture))
-    FAILURE("Renderer#target=");
+  int x = _CellGrid_wrap(NUM2INT(x_), grid->w);
+  int y = _CellGrid_wrap(NUM2INT(y_), grid->h);
+  Uint64 *word = CELL_ROW(grid, grid->cells, y) + x / 64;
+  Uint64  bit  = (Uint64)1 << (x % 64);
 
-  return texture_;
-}
+  _busy_check(grid->busy, "CellGrid");
 
-//// SDL::Texture methods:
+  if (RTEST(alive))
+    *word |= bit;
+  else
+    *word &= ~bit;
 
-static void _Texture_free(void* texture) {
-  if (is_quit) return;
-  if (texture) SDL_DestroyTexture(texture);
+  return alive;
 }
 
-static void _Texture_mark(void* texture) {
-  UNUSED(texture);
-}
+static VALUE CellGrid_clear(VALUE self) {
+  DEFINE_SELF(CellGrid, grid, self);
 
-//// SDL::Window methods:
+  _busy_check(grid->busy, "CellGrid");
 
-static void _Window_free(void* Window) {
-  if (is_quit) return;
-  if (Window) SDL_DestroyWindow(Window);
-}
+  MEMZERO(grid->cells, Uint64, (size_t)grid->words * grid->h);
 
-static void _Window_mark(void* Window) {
-  UNUSED(Window);
+  return self;
 }
 
-static VALUE Window_title_eq(VALUE self, VALUE title) {
-  DEFINE_SELF(Window, window, self);
+// Bring each cell to life with probability pct.
 
-  ExportStringValue(title);
+static VALUE CellGrid_randomize(VALUE self, VALUE pct_) {
+  DEFINE_SELF(CellGrid, grid, self);
+  double pct = NUM2DBL(pct_);
 
-  SDL_SetWindowTitle(window, StringValueCStr(title));
+  _busy_check(grid->busy, "CellGrid");
 
-  return Qnil;
-}
+  for (int y = 0; y < grid->h; y++) {
+    Uint64 *row = CELL_ROW(grid, grid->cells, y);
 
-static VALUE Window_title(VALUE self) {
-  DEFINE_SELF(Window, window, self);
+    for (int x = 0; x < grid->w; x++) {
+      Uint64 bit = (Uint64)1 << (x % 64);
 
-  const char* title = SDL_GetWindowTitle(window);
+      if (rb_genrand_real() < pct)
+        row[x / 64] |= bit;
+      else
+        row[x / 64] &= ~bit;
+    }
+  }
 
-  return rb_str_new_cstr(title);
+  return self;
 }
 
-static VALUE Window_update(VALUE self) {
-  DEFINE_SELF(Window, window, self);
+static VALUE CellGrid_population(VALUE self) {
+  DEFINE_SELF(CellGrid, grid, self);
+  size_t n = (size_t)grid->words * grid->h;
+  long count = 0;
 
-  if (SDL_UpdateWindowSurface(window))
-    FAILURE("Window#update");
+  for (size_t i = 0; i < n; i++)
+    count += (long)_popcount64(grid->cells[i]);
 
-  return Qnil;
+  return LONG2NUM(count);
 }
 
-//// SDL::TTFFont methods:
+// Yields the x, y of each live cell, row by row.
 
-static void _TTFFont_free(void* font) {
-  if (is_quit) return;
-  if (font) TTF_CloseFont(font);
+static VALUE CellGrid_each(VALUE self) {
+  DEFINE_SELF(CellGrid, grid, self);
+
+  RETURN_ENUMERATOR(self, 0, 0);
+
+  for (int y = 0; y < grid->h; y++) {
+    for (int k = 0; k < grid->words; k++) {
+      // re-read each word, in case the block changed the grid
+      for (int b = 0; b < 64; b++) {
+        if (!(CELL_ROW(grid, grid->cells, y)[k] >> b)) break;
+        if (CELL_ROW(grid, grid->cells, y)[k] >> b & 1)
+          rb_yield_values(2, INT2FIX(k * 64 + b), INT2FIX(y));
+      }
+    }
+  }
+
+  return self;
 }
 
-static void _TTFFont_mark(void* p) {
-  UNUSED(p);
+typedef struct {
+  SDL_CellGrid    *grid;
+  SDL_Framebuffer *fb;
+  Uint32           alive, dead;
+} cell_grid_render;
+
+static void _CellGrid_render_rows(void *ctx, int lo, int hi) {
+  cell_grid_render *render = ctx;
+  SDL_CellGrid     *grid   = render->grid;
+  SDL_Framebuffer  *fb     = render->fb;
+
+  for (int y = lo; y < hi; y++) {
+    const Uint64 *row = CELL_ROW(grid, grid->cells, y);
+    void         *out = FB_ROW(fb, y);
+
+    for (int x = 0; x < grid->w; x++) {
+      Uint32 c = row[x / 64] >> (x % 64) & 1 ? render->alive : render->dead;
+
+      switch (fb->bits) {
+      case 8:  ((Uint8*) out)[x] = (Uint8)c;  break;
+      case 16: ((Uint16*)out)[x] = (Uint16)c; break;
+      default: ((Uint32*)out)[x] = c;         break;
+      }
+    }
+  }
 }
 
-static VALUE Font_s_open(VALUE self, VALUE path, VALUE size) {
-  UNUSED(self);
+static void* _CellGrid_render_without_gvl(void *data) {
+  cell_grid_render *render = data;
 
-  ExportStringValue(path);
+  _parallel_for(render->grid->h, render->grid->threads,
+                _CellGrid_render_rows, render);
 
-  TTF_Font* font = TTF_OpenFont(RSTRING_PTR(path), NUM2UINT16(size));
+  return NULL;
+}
 
-  if (!font)
-    FAILURE("Font.open");
+// render(framebuffer, alive, dead)
+//
+// Writes every cell into a framebuffer of the same size as either
+// alive or dead (colors, or palette indices for indexed framebuffers).
+// The whole thing goes up on the next draw.
 
-  return TypedData_Wrap_Struct(cTTFFont, &_TTFFont_type, font);
+static VALUE CellGrid_render(VALUE self, VALUE fb_, VALUE alive, VALUE dead) {
+  DEFINE_SELF(CellGrid, grid, self);
+  DEFINE_SELF(Framebuffer, fb, fb_);
+
+  if (fb->w != grid->w || fb->h != grid->h)
+    rb_raise(rb_eArgError, "framebuffer is %dx%d, not %dx%d",
+             fb->w, fb->h, grid->w, grid->h);
+
+  cell_grid_render render = { grid, fb, NUM2UINT(alive), NUM2UINT(dead) };
+
+  _busy_check(grid->busy, "CellGrid");
+  _busy_without_gvl(&grid->busy, _CellGrid_render_without_gvl, &render);
+
+  _Framebuffer_dirty_all(fb);
+
+  return fb_;
 }
 
-static VALUE Font_height(VALUE self) {
-  DEFINE_SELF(TTFFont, font, self);
+static VALUE CellGrid_w(VALUE self) {
+  DEFINE_SELF(CellGrid, grid, self);
 
-  return INT2FIX(TTF_FontHeight(font));
+  return INT2NUM(grid->w);
 }
 
-static VALUE Font_render(VALUE self, VALUE dst, VALUE text, VALUE c) {
-  DEFINE_SELF(TTFFont, font, self);
-  DEFINE_SELF(PixelFormat, format, rb_ivar_get(dst, id_iv_format));
+static VALUE CellGrid_h(VALUE self) {
+  DEFINE_SELF(CellGrid, grid, self);
 
-  SDL_Surface *result;
-  SDL_Color fg;
+  return INT2NUM(grid->h);
+}
 
-  SDL_GetRGBA(VALUE2COLOR(c), format,
-              &(fg.r), &(fg.g), &(fg.b), &(fg.a));
+static VALUE CellGrid_rule(VALUE self) {
+  DEFINE_SELF(CellGrid, grid, self);
+  VALUE s = rb_str_new_cstr("B");
 
-  ExportStringValue(text);
-  result = TTF_RenderUTF8_Blended(font, StringValueCStr(text), fg);
+  for (int n = 0; n < 9; n++)
+    if (grid->born & (1 << n)) rb_str_catf(s, "%d", n);
 
-  if (!result)
-    TTF_FAILURE("Font.render");
+  rb_str_cat_cstr(s, "/S");
 
-  return TypedData_Wrap_Struct(cSurface, &_Surface_type, result);
-}
+  for (int n = 0; n < 9; n++)
+    if (grid->survive & (1 << n)) rb_str_catf(s, "%d", n);
 
-static VALUE Font_draw(VALUE self, VALUE dst, VALUE text, VALUE x, VALUE y, VALUE c) {
-  VALUE img = Font_render(self, dst, text, c);
-  return Renderer_blit(dst, img, x, y, Qnil, Qnil, Qnil, Qnil);
+  return s;
 }
 
-static VALUE Font_text_size(VALUE self, VALUE text) {
-  DEFINE_SELF(TTFFont, font, self);
-  int w = 1, h = 2, result;
+static VALUE CellGrid_rule_eq(VALUE self, VALUE rule) {
+  DEFINE_SELF(CellGrid, grid, self);
 
-  ExportStringValue(text);
-  result = TTF_SizeText(font, StringValueCStr(text), &w, &h);
+  _busy_check(grid->busy, "CellGrid");
 
-  if (!result) {
-    return rb_ary_new_from_args(2, INT2FIX(w), INT2FIX(h));
-  } else {
-    FAILURE("SDL::TTF#text_size");
-  }
+  _CellGrid_parse_rule(grid, rule);
+
+  return rule;
 }
 
 // The Rest...
@@ -1077,9 +7343,14 @@ void Init_sdl() {
   mMouse       = rb_define_module_under(mSDL, "Mouse");
 
   cAudio        = rb_define_class_under(mSDL, "Audio",        rb_cData);
+  cBundle       = rb_define_class_under(mSDL, "Bundle",       rb_cData);
   cCollisionMap = rb_define_class_under(mSDL, "CollisionMap", rb_cData);
   cEvent        = rb_define_class_under(mSDL, "Event",        rb_cObject);
+  cFramebuffer  = rb_define_class_under(mSDL, "Framebuffer",  rb_cData);
+  cLoader       = rb_define_class_under(mSDL, "Loader",       rb_cData);
+  cKeyBindings  = rb_define_class_under(mKey, "Bindings",     rb_cData);
   cPixelFormat  = rb_define_class_under(mSDL, "PixelFormat",  rb_cData);
+  cRecorder     = rb_define_class_under(mSDL, "Recorder",     rb_cData);
   cSurface      = rb_define_class_under(mSDL, "Surface",      rb_cData);
   cTTFFont      = rb_define_class_under(mSDL, "TTF",          rb_cData); // TODO: Font
 
@@ -1087,6 +7358,16 @@ void Init_sdl() {
   cRenderer     = rb_define_class_under(mSDL, "Renderer",     rb_cData);
   cWindow       = rb_define_class_under(mSDL, "Window",       rb_cData);
   cTexture      = rb_define_class_under(mSDL, "Texture",      rb_cData);
+  cTextureCache = rb_define_class_under(mSDL, "TextureCache", rb_cData);
+  cTrail        = rb_define_class_under(mSDL, "Trail",        rb_cData);
+
+  cGraphics     = rb_define_class("Graphics", rb_cObject);
+  cCellGrid     = rb_define_class_under(cGraphics, "CellGrid", rb_cData);
+  cFlock        = rb_define_class_under(cGraphics, "Flock", rb_cData);
+  cSPH          = rb_define_class_under(cGraphics, "SPH", rb_cData);
+
+  cV            = rb_define_class_under(mSDL, "V",            rb_cObject);
+  cVArray       = rb_define_class_under(cV, "Array", rb_cData);
 
   cEventQuit    = rb_define_class_under(cEvent, "Quit",    cEvent);
   cEventKeydown = rb_define_class_under(cEvent, "Keydown", cEvent);
@@ -1108,12 +7389,27 @@ void Init_sdl() {
   rb_define_singleton_method(cAudio, "load", Audio_s_load, 1);
   rb_define_method(cAudio, "play", Audio_play, 0);
 
+  //// SDL::Bundle methods:
+
+  rb_define_singleton_method(cBundle, "open", Bundle_s_open, 1);
+#ifdef HAVE_LZ4_H
+  rb_define_singleton_method(cBundle, "compress", Bundle_s_compress, 1);
+#endif
+
+  rb_define_method(cBundle, "collision_map", Bundle_collision_map, 1);
+  rb_define_method(cBundle, "font",          Bundle_font,          2);
+  rb_define_method(cBundle, "image",         Bundle_image,         1);
+  rb_define_method(cBundle, "names",         Bundle_names,         0);
+  rb_define_method(cBundle, "sound",         Bundle_sound,         1);
+
   //// SDL::CollisionMap methods:
 
   rb_define_method(cCollisionMap, "check", CollisionMap_check, 5);
+  rb_define_method(cCollisionMap, "dump",  CollisionMap_dump,  0);
 
   //// SDL::Event methods:
 
+  rb_define_singleton_method(cEvent, "drain", Event_s_drain, -1);
   rb_define_singleton_method(cEvent, "poll", Event_s_poll, 0);
 
   rb_define_attr(cEventKeydown, "press",   1, 1);
@@ -1141,11 +7437,48 @@ void Init_sdl() {
   rb_define_attr(cEventMouseup,   "x",      1, 1);
   rb_define_attr(cEventMouseup,   "y",      1, 1);
 
+  //// SDL::Framebuffer methods:
+
+  rb_define_method(cFramebuffer, "[]",        Framebuffer_index,     2);
+  rb_define_method(cFramebuffer, "[]=",       Framebuffer_index_eq,  3);
+  rb_define_method(cFramebuffer, "bits",      Framebuffer_bits,      0);
+  rb_define_method(cFramebuffer, "clear",     Framebuffer_clear,     1);
+  rb_define_method(cFramebuffer, "fill_rect", Framebuffer_fill_rect, 5);
+  rb_define_method(cFramebuffer, "flood_fill", Framebuffer_flood_fill, -1);
+  rb_define_method(cFramebuffer, "h",         Framebuffer_h,         0);
+  rb_define_method(cFramebuffer, "palette",   Framebuffer_palette,   0);
+  rb_define_method(cFramebuffer, "palette=",  Framebuffer_palette_eq, 1);
+  rb_define_method(cFramebuffer, "pixels",    Framebuffer_pixels,    0);
+  rb_define_method(cFramebuffer, "upload",    Framebuffer_upload,    0);
+  rb_define_method(cFramebuffer, "w",         Framebuffer_w,         0);
+  rb_define_method(cFramebuffer, "write",     Framebuffer_write,     -1);
+
   //// SDL::Key methods:
 
   rb_define_module_function(mKey, "press?", Key_s_press_p, 1);
   rb_define_module_function(mKey, "scan",   Key_s_scan,    0);
 
+  //// SDL::Key::Bindings methods:
+
+  rb_define_alloc_func(cKeyBindings, KeyBindings_s_allocate);
+
+  rb_define_method(cKeyBindings, "bind",      KeyBindings_bind,       -1);
+  rb_define_method(cKeyBindings, "held?",     KeyBindings_held_p,      1);
+  rb_define_method(cKeyBindings, "pressed?",  KeyBindings_pressed_p,   1);
+  rb_define_method(cKeyBindings, "released?", KeyBindings_released_p,  1);
+  rb_define_method(cKeyBindings, "size",      KeyBindings_size,        0);
+  rb_define_method(cKeyBindings, "unbind",    KeyBindings_unbind,     -1);
+  rb_define_method(cKeyBindings, "update",    KeyBindings_update,      0);
+
+  //// SDL::Loader methods:
+
+  rb_define_method(cLoader, "[]",      Loader_index,  1);
+  rb_define_method(cLoader, "done?",   Loader_done_p, 0);
+  rb_define_method(cLoader, "loaded",  Loader_loaded, 0);
+  rb_define_method(cLoader, "size",    Loader_size,   0);
+  rb_define_method(cLoader, "upload",  Loader_upload, -1);
+  rb_define_method(cLoader, "wait",    Loader_wait,   0);
+
   //// SDL::Mouse methods:
 
   rb_define_module_function(mMouse, "state", Mouse_s_state, 0);
@@ -1154,8 +7487,16 @@ void Init_sdl() {
   //// TODO: phase these out... move to renderer or top of SDL
 
   rb_define_method(cPixelFormat, "get_rgba", PixelFormat_get_rgba, 1);
+  rb_define_method(cPixelFormat, "lookup",   PixelFormat_lookup,   1);
   rb_define_method(cPixelFormat, "map_rgba", PixelFormat_map_rgba, 4);
 
+  //// SDL::Recorder methods:
+
+  rb_define_method(cRecorder, "dropped", Recorder_dropped, 0);
+  rb_define_method(cRecorder, "failed",  Recorder_failed,  0);
+  rb_define_method(cRecorder, "frames",  Recorder_frames,  0);
+  rb_define_method(cRecorder, "stop",    Recorder_stop,    0);
+
   //// SDL::Screen methods:
   //// TODO: phase these out entirely?
 
@@ -1166,6 +7507,16 @@ void Init_sdl() {
   rb_const_set(cScreen, id_W, Qnil);
   rb_const_set(cScreen, id_H, Qnil);
 
+  //// SDL::Trail methods:
+
+  rb_define_singleton_method(cTrail, "new", Trail_s_new, 1);
+
+  rb_define_method(cTrail, "clear", Trail_clear, 0);
+  rb_define_method(cTrail, "max",   Trail_max,   0);
+  rb_define_method(cTrail, "push",  Trail_push,  2);
+  rb_define_method(cTrail, "size",  Trail_size,  0);
+  rb_define_method(cTrail, "to_a",  Trail_to_a,  0);
+
   //// SDL::Window methods:
 
   // TODO: move to top renderer?
@@ -1180,57 +7531,173 @@ void Init_sdl() {
   rb_define_method(cRenderer, "blit",          Renderer_blit,         7);
   rb_define_method(cRenderer, "clear",         Renderer_clear,        1);
   rb_define_method(cRenderer, "copy_texture",  Renderer_copy_texture, 1);
-  rb_define_method(cRenderer, "draw_bezier",   Renderer_draw_bezier,  4);
+  rb_define_method(cRenderer, "draw_arc",      Renderer_draw_arc,     -1);
+  rb_define_method(cRenderer, "draw_bezier",   Renderer_draw_bezier,  -1);
   rb_define_method(cRenderer, "draw_circle",   Renderer_draw_circle,  6);
+  rb_define_method(cRenderer, "draw_circles",  Renderer_draw_circles, -1);
   rb_define_method(cRenderer, "draw_ellipse",  Renderer_draw_ellipse, 7);
+  rb_define_method(cRenderer, "draw_ellipses", Renderer_draw_ellipses, -1);
+  rb_define_method(cRenderer, "draw_field",    Renderer_draw_field,   -1);
+  rb_define_method(cRenderer, "draw_framebuffer", Renderer_draw_framebuffer, 2);
+  rb_define_method(cRenderer, "draw_framebuffer_changes", Renderer_draw_framebuffer_changes, 1);
   rb_define_method(cRenderer, "draw_line",     Renderer_draw_line,    6);
+  rb_define_method(cRenderer, "draw_polygon",  Renderer_draw_polygon, -1);
   rb_define_method(cRenderer, "draw_rect",     Renderer_draw_rect,    6);
+  rb_define_method(cRenderer, "draw_rounded_rect", Renderer_draw_rounded_rect, -1);
+  rb_define_method(cRenderer, "draw_stroke",   Renderer_draw_stroke,  -1);
+  rb_define_method(cRenderer, "draw_trail",    Renderer_draw_trail,   3);
   rb_define_method(cRenderer, "fast_rect",     Renderer_fast_rect,    5);
   rb_define_method(cRenderer, "h",             Renderer_h,            0);
+  rb_define_method(cRenderer, "new_framebuffer", Renderer_new_framebuffer, 2);
+  rb_define_method(cRenderer, "new_indexed_framebuffer", Renderer_new_indexed_framebuffer, 3);
   rb_define_method(cRenderer, "new_texture",   Renderer_new_texture,  0);
   rb_define_method(cRenderer, "present",       Renderer_present,      0);
+  rb_define_method(cRenderer, "read_pixels",   Renderer_read_pixels,  -1);
   rb_define_method(cRenderer, "save",          Renderer_save,         1);
   rb_define_method(cRenderer, "sprite",        Renderer_sprite,       2);
+  rb_define_method(cRenderer, "start_recording", Renderer_start_recording, -1);
+  rb_define_method(cRenderer, "stop_recording", Renderer_stop_recording, 0);
   rb_define_method(cRenderer, "target",        Renderer_target,       0);
   rb_define_method(cRenderer, "target=",       Renderer_target_eq,    1);
+  rb_define_method(cRenderer, "texture_budget",  Renderer_texture_budget,    0);
+  rb_define_method(cRenderer, "texture_budget=", Renderer_texture_budget_eq, 1);
+  rb_define_method(cRenderer, "stamps=",         Renderer_stamps_eq,         1);
+  rb_define_method(cRenderer, "texture_usage",   Renderer_texture_usage,     0);
   rb_define_method(cRenderer, "w",             Renderer_w,            0);
 
   //// SDL::Surface methods:
 
   rb_define_singleton_method(cSurface, "load", Surface_s_load, 1);
+  rb_define_singleton_method(cSurface, "load_async", Surface_s_load_async, -1);
+  rb_define_singleton_method(cSurface, "cache", Surface_s_cache, 0);
+  rb_define_singleton_method(cSurface, "cached", Surface_s_cached, 1);
+  rb_define_singleton_method(cSurface, "clear_cache", Surface_s_clear_cache, 0);
 
   rb_define_method(cSurface, "h",             Surface_h,             0);
   rb_define_method(cSurface, "[]",            Surface_index,         2);
+  rb_define_method(cSurface, "flood_fill",    Surface_flood_fill,    -1);
   rb_define_method(cSurface, "format",        Surface_format,        0);
+  rb_define_method(cSurface, "pitch",         Surface_pitch,         0);
+  rb_define_method(cSurface, "pixels",        Surface_pixels,        0);
+  rb_define_method(cSurface, "to_rgba32",     Surface_to_rgba32,     0);
   rb_define_method(cSurface, "transform",     Surface_transform,     4);
   rb_define_method(cSurface, "w",             Surface_w,             0);
 
+#ifdef HAVE_RUBY_MEMORY_VIEW_H
+  rb_memory_view_register(cSurface, &_Surface_memory_view);
+#endif
+
   // TODO: reimplement and jettison SGE
   rb_define_method(cSurface, "make_collision_map", Surface_make_collision_map, 0);
 
   //// SDL::TTFFont methods:
 
-  rb_define_singleton_method(cTTFFont, "open", Font_s_open, 2);
+  rb_define_singleton_method(cTTFFont, "open", Font_s_open, -1);
+#ifdef HAVE_FONTCONFIG_FONTCONFIG_H
+  rb_define_singleton_method(cTTFFont, "fontconfig", Font_s_fontconfig, 1);
+#endif
 
   rb_define_method(cTTFFont, "height",    Font_height,    0);
   rb_define_method(cTTFFont, "render",    Font_render,    3);
   rb_define_method(cTTFFont, "draw",      Font_draw,      5);
   rb_define_method(cTTFFont, "text_size", Font_text_size, 1);
 
+  //// V methods:
+
+  // SDL itself wants one thread (and so one ractor) driving it, but the
+  // vector math touches nothing global, so only it is ractor safe.
+#ifdef HAVE_RUBY_RACTOR_H
+  rb_ext_ractor_safe(true);
+#endif
+
+  rb_define_alloc_func(cV, V_s_allocate);
+  rb_define_singleton_method(cV, "[]", V_s_new, 2);
+
+  rb_define_method(cV, "initialize",      V_initialize,      2);
+  rb_define_method(cV, "initialize_copy", V_initialize_copy, 1);
+  rb_define_method(cV, "+",               V_plus,            1);
+  rb_define_method(cV, "-",               V_minus,           1);
+  rb_define_method(cV, "-@",              V_uminus,          0);
+  rb_define_method(cV, "*",               V_mul,             1);
+  rb_define_method(cV, "/",               V_div,             1);
+  rb_define_method(cV, "==",              V_equals,          1);
+  rb_define_method(cV, "add!",            V_add_bang,        1);
+  rb_define_method(cV, "dot",             V_dot,             1);
+  rb_define_method(cV, "magnitude",       V_magnitude,       0);
+  rb_define_method(cV, "marshal_dump",    V_to_a,            0);
+  rb_define_method(cV, "marshal_load",    V_marshal_load,    1);
+  rb_define_method(cV, "scale!",          V_scale_bang,      1);
+  rb_define_method(cV, "sub!",            V_sub_bang,        1);
+  rb_define_method(cV, "to_a",            V_to_a,            0);
+  rb_define_method(cV, "x",               V_x,               0);
+  rb_define_method(cV, "x=",              V_x_eq,            1);
+  rb_define_method(cV, "y",               V_y,               0);
+  rb_define_method(cV, "y=",              V_y_eq,            1);
+
+  //// V::Array methods:
+
+  rb_define_singleton_method(cVArray, "new", VArray_s_new, 1);
+
+  rb_define_method(cVArray, "[]",          VArray_index,          1);
+  rb_define_method(cVArray, "[]=",         VArray_index_eq,       2);
+  rb_define_method(cVArray, "axpy!",       VArray_axpy_bang,      2);
+  rb_define_method(cVArray, "clamp!",      VArray_clamp_bang,     1);
+  rb_define_method(cVArray, "dot",         VArray_dot,            1);
+  rb_define_method(cVArray, "fill",        VArray_fill,           1);
+  rb_define_method(cVArray, "normalize!",  VArray_normalize_bang, 0);
+  rb_define_method(cVArray, "scale!",      VArray_scale_bang,     1);
+  rb_define_method(cVArray, "size",        VArray_size,           0);
+  rb_define_method(cVArray, "to_a",        VArray_to_a,           0);
+  rb_define_method(cVArray, "wrap!",       VArray_wrap_bang,      2);
+
+#ifdef HAVE_RUBY_RACTOR_H
+  rb_ext_ractor_safe(false);
+#endif
+
+  //// Graphics::CellGrid methods:
+
+  rb_define_singleton_method(cCellGrid, "new", CellGrid_s_new, -1);
+
+  rb_define_method(cCellGrid, "[]",         CellGrid_index,      2);
+  rb_define_method(cCellGrid, "[]=",        CellGrid_index_eq,   3);
+  rb_define_method(cCellGrid, "clear",      CellGrid_clear,      0);
+  rb_define_method(cCellGrid, "each",       CellGrid_each,       0);
+  rb_define_method(cCellGrid, "h",          CellGrid_h,          0);
+  rb_define_method(cCellGrid, "population", CellGrid_population, 0);
+  rb_define_method(cCellGrid, "randomize",  CellGrid_randomize,  1);
+  rb_define_method(cCellGrid, "render",     CellGrid_render,     3);
+  rb_define_method(cCellGrid, "rule",       CellGrid_rule,       0);
+  rb_define_method(cCellGrid, "rule=",      CellGrid_rule_eq,    1);
+  rb_define_method(cCellGrid, "step",       CellGrid_step,       -1);
+  rb_define_method(cCellGrid, "w",          CellGrid_w,          0);
+
+  //// Graphics::Flock methods:
+
+  rb_define_singleton_method(cFlock, "new", Flock_s_new, -1);
+
+  rb_define_method(cFlock, "max_distance",  Flock_max_distance,    0);
+  rb_define_method(cFlock, "max_distance=", Flock_max_distance_eq, 1);
+  rb_define_method(cFlock, "step",          Flock_step,            2);
+
+  //// Graphics::SPH methods:
+
+  rb_define_singleton_method(cSPH, "new", SPH_s_new, -1);
+
+  rb_define_method(cSPH, "add",     SPH_add,     2);
+  rb_define_method(cSPH, "contain", SPH_contain, -1);
+  rb_define_method(cSPH, "each",    SPH_each,    0);
+  rb_define_method(cSPH, "size",    SPH_size,    0);
+  rb_define_method(cSPH, "step",    SPH_step,    1);
+
   //// Other Init Actions:
 
-  for (int i=0; i < SDL_NUMEVENTS; ++i)
-    event_creators[i] = Event__null;
+  _init_colormaps();
+
+  collision_lock = SDL_CreateMutex();
+  polygon_lock   = SDL_CreateMutex();
 
-  // event_creators[SDL_ACTIVEEVENT]     = Event__active;
-  event_creators[SDL_KEYDOWN]         = Event__keydown;
-  event_creators[SDL_KEYUP]           = Event__keyup;
-  event_creators[SDL_MOUSEMOTION]     = Event__mousemove;
-  event_creators[SDL_MOUSEBUTTONDOWN] = Event__mousedown;
-  event_creators[SDL_MOUSEBUTTONUP]   = Event__mouseup;
-  event_creators[SDL_QUIT]            = Event__quit;
-  // event_creators[SDL_SYSWMEVENT]      = Event__syswm;
-  // event_creators[SDL_VIDEORESIZE]     = Event__videoresize;
+  surface_cache = rb_hash_new();
+  rb_gc_register_address(&surface_cache);
 
   // TODO: maybe pause/unpause automatically instead of chewing CPU?
   // SDL_APP_DIDENTERBACKGROUND
@@ -1245,10 +7712,17 @@ void Init_sdl() {
   INIT_ID(renderer);
   INIT_ID(window);
   INIT_ID(texture);
+  INIT_ID(recorder);
+  INIT_ID(field);
+  INIT_ID(bundle);
+  INIT_ID(textures);
+  INIT_ID(stamps);
+  INIT_ID(cached);
   INIT_ID(button);
   INIT_ID(mod);
   INIT_ID(press);
   INIT_ID(state);
+  INIT_ID(target);
   INIT_ID(sym);
   INIT_ID(x);
   INIT_ID(xrel);
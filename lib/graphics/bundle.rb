@@ -0,0 +1,103 @@
+# -*- coding: utf-8 -*-
+
+require "sdl/sdl"
+
+##
+# Writes asset bundles for SDL::Bundle.open. A bundle holds images
+# already decoded to RGBA32 (plus their collision maps), fonts, and
+# sounds in one file, so loading them at startup is an mmap instead of
+# a pile of opens and decodes.
+#
+#   SDL::Bundle.build "resources.bundle", Dir["resources/**/*"]
+#
+#   bundle = SDL::Bundle.open "resources.bundle"
+#   body   = bundle.image "resources/images/body.png"
+
+class SDL::Bundle
+  MAGIC   = "GFXBNDL\0".freeze # :nodoc:
+  VERSION = 1                  # :nodoc:
+  ALIGN   = 64                 # :nodoc:
+  LZ4     = 1                  # :nodoc:
+
+  KINDS = { image: 1, mask: 2, font: 3, sound: 4 }.freeze # :nodoc:
+
+  # frozen all the way down so other ractors can read them
+  IMAGES = %w[.png .jpg .jpeg .bmp .gif .tga .tif .tiff .webp].map(&:freeze).freeze # :nodoc:
+  FONTS  = %w[.ttf .ttc .otf].map(&:freeze).freeze                                  # :nodoc:
+  SOUNDS = %w[.wav .ogg .mp3 .flac].map(&:freeze).freeze                            # :nodoc:
+
+  ##
+  # Write a bundle of +files+ to +path+. Files are named by the path
+  # given. Anything that isn't an image, font, or sound is skipped.
+  #
+  # With +compress+, image pixels are LZ4 compressed. That needs
+  # graphics built against liblz4 and costs a decompress (and a copy)
+  # per image at load time, but makes for a much smaller file.
+
+  def self.build path, files, compress: false
+    if compress && !respond_to?(:compress) then
+      raise ArgumentError, "graphics was built without LZ4"
+    end
+
+    entries = []
+
+    files.sort.each do |file|
+      next unless File.file? file
+
+      case File.extname(file).downcase
+      when *IMAGES then
+        surface = SDL::Surface.load file
+        pixels  = surface.to_rgba32
+        w, h    = surface.w, surface.h
+        flags   = 0
+
+        if compress then
+          packed = self.compress pixels
+          pixels, flags = packed, LZ4 if packed.bytesize < pixels.bytesize
+        end
+
+        entries << [file, :image, flags, w, h, pixels, 4 * w * h]
+
+        mw, mh, bits = surface.make_collision_map.dump
+        entries << [file, :mask, 0, mw, mh, bits, bits.bytesize]
+      when *FONTS then
+        data = File.binread file
+        entries << [file, :font, 0, 0, 0, data, data.bytesize]
+      when *SOUNDS then
+        data = File.binread file
+        entries << [file, :sound, 0, 0, 0, data, data.bytesize]
+      end
+    end
+
+    write path, entries
+  end
+
+  def self.write path, entries # :nodoc:
+    tmp = "#{path}.#{$$}"
+
+    File.open tmp, "wb" do |io|
+      io.write [MAGIC, VERSION, entries.size, 0].pack("a8VVQ<")
+
+      index = entries.map { |name, kind, flags, w, h, data, raw_size|
+        io.write "\0" * (-io.pos % ALIGN)
+        offset = io.pos
+        io.write data
+
+        name = name.b
+        [name.bytesize, KINDS[kind], flags, w, h, 0,
+         offset, data.bytesize, raw_size].pack("vCCVVVQ<Q<Q<") + name
+      }
+
+      index_offset = io.pos
+      io.write index.join
+
+      io.seek 16
+      io.write [index_offset].pack("Q<")
+    end
+
+    File.rename tmp, path
+    path
+  ensure
+    File.unlink tmp if tmp && File.exist?(tmp)
+  end
+end
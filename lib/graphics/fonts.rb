@@ -0,0 +1,142 @@
+# -*- coding: utf-8 -*-
+
+require "sdl/sdl"
+require "fileutils"
+
+##
+# Font lookup for SDL::TTF. The font directories are scanned once and
+# the resulting index of font name to file is cached on disk, keyed by
+# the modification times of every directory scanned, so a later run
+# only has to stat those directories to know the index is still good.
+#
+# Names that aren't file names (eg "DejaVu Sans Mono") are handed to
+# fontconfig when the extension was built with it.
+
+class SDL::TTF
+  ##
+  # Directories searched for .ttf and .ttc files. Only the ones ending
+  # in <tt>**/</tt> are searched recursively.
+
+  DIRS = [
+    # OS X
+    "/System/Library/Fonts",
+    "/Library/Fonts",
+    File.expand_path("~/Library/Fonts/"),
+
+    # Ubuntu
+    "/usr/share/fonts/truetype/**/",
+  ].map(&:freeze).freeze
+
+  ##
+  # Where the font index is cached between runs.
+
+  CACHE = File.join(ENV["XDG_CACHE_HOME"] || File.expand_path("~/.cache"),
+                    "graphics", "fonts.idx").freeze
+
+  INDEX_VERSION = 2 # :nodoc:
+
+  @index = nil
+  @fonts = {}
+
+  ##
+  # Return [path, face_index] for the font named +name+, or nil.
+
+  def self.lookup name
+    name = name.to_s
+
+    index[name] || (fontconfig name if respond_to? :fontconfig)
+  end
+
+  ##
+  # Find and open the font named +name+ at +size+. Fonts are shared,
+  # so asking for the same font and size again returns the same
+  # object.
+
+  def self.find name, size = 16
+    path, face = lookup name
+
+    raise ArgumentError, "Can't find font named '#{name}'" unless path
+
+    @fonts[[path, face, size]] ||= open path, size, face
+  end
+
+  ##
+  # The font index: a hash of font name to [path, face_index].
+
+  def self.index
+    @index ||= load_index
+  end
+
+  ##
+  # Load the font index from +cache+ if none of +dirs+ have changed
+  # since it was written, otherwise rescan and rewrite it.
+
+  def self.load_index dirs = DIRS, cache = CACHE
+    data = begin
+             Marshal.load File.binread cache
+           rescue SystemCallError, ArgumentError, TypeError
+             nil
+           end
+
+    return data[:fonts] if fresh? data, dirs
+
+    fonts, mtimes = scan dirs
+
+    begin
+      FileUtils.mkdir_p File.dirname cache
+      tmp = "#{cache}.#{$$}"
+      File.binwrite tmp, Marshal.dump(version: INDEX_VERSION,
+                                      roots:   dirs,
+                                      dirs:    mtimes,
+                                      fonts:   fonts)
+      File.rename tmp, cache
+    rescue SystemCallError
+      # read-only home or the like... just don't cache
+    end
+
+    fonts
+  end
+
+  def self.fresh? data, dirs # :nodoc:
+    Hash === data &&
+      data[:version] == INDEX_VERSION &&
+      data[:roots] == dirs &&
+      data[:dirs].all? { |dir, mtime| dir_mtime(dir) == mtime }
+  end
+
+  ##
+  # Scan +dirs+ for fonts. Returns the index and the mtimes of every
+  # directory looked at. The first font found for a name wins.
+
+  def self.scan dirs
+    fonts  = {}
+    mtimes = {}
+
+    dirs.each do |dir|
+      root = dir.delete_suffix "**/"
+      deep = root != dir
+
+      mtimes[root] = dir_mtime root
+      next unless mtimes[root]
+
+      Dir.glob("**/", base: root).sort.each do |sub|
+        sub = File.join root, sub
+        mtimes[sub] = dir_mtime sub
+      end if deep
+
+      files = Dir.glob(deep ? "**/*.{ttc,ttf}" : "*.{ttc,ttf}", base: root)
+      files.sort_by { |f| [f.count("/"), f] }.each do |file|
+        name = File.basename file, ".*"
+        fonts[name] ||= [File.join(root, file), 0]
+      end
+    end
+
+    return fonts, mtimes
+  end
+
+  def self.dir_mtime dir # :nodoc:
+    File.stat(dir).mtime.to_r
+  rescue SystemCallError
+    nil
+  end
+end
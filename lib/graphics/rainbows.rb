@@ -39,6 +39,18 @@ class Graphics::Rainbow
     @cache[scaled]
   end
 
+  ##
+  # Return +n+ colors spread evenly from one end of the rainbow to the
+  # other. Handy as an indexed framebuffer's palette. A single color
+  # is the start of the rainbow.
+
+  def palette n = 256
+    raise ArgumentError, "need at least one color, not #{n}" if n < 1
+    return [@cache[0]] if n == 1
+
+    (0...n).map { |i| @cache[(360.0 * i / (n - 1)).round] }
+  end
+
   def _color degree # :nodoc:
     raise "Subclass responsibility"
   end
@@ -117,4 +129,12 @@ class Graphics::Simulation
       self.register_color(color_name, *color, 255)
     end
   end
+
+  ##
+  # Generate an indexed framebuffer palette of +n+ colors using a
+  # rainbow. Scale your values into 0...n and write those instead.
+
+  def rainbow_palette rainbow, n = 256
+    rainbow.palette(n).map { |rgb| renderer.format.map_rgba(*rgb, 255) }
+  end
 end
@@ -1,6 +1,8 @@
 # -*- coding: utf-8 -*-
 
 require "sdl/sdl"
+require "graphics/fonts"
+require "graphics/bundle"
 
 module SDL # :nodoc:
   init INIT_EVERYTHING
@@ -95,13 +97,16 @@ class Graphics::AbstractSimulation
   # The current font for rendering text.
   attr_accessor :font
 
-  # A hash of color names to their values.
+  # A hash of color names to their values. Ramps like :gray42 or
+  # :red128 are computed the first time they're looked up, so
+  # color.keys only lists the ramp colors used so far. Call
+  # #register_color_ramps to list them all.
   attr_accessor :color
 
   # Number of update iterations per drawing tick.
   attr_accessor :iter_per_tick
 
-  # Procs registered to handle key events.
+  # An SDL::Key::Bindings of procs registered to handle key events.
   attr_accessor :key_handler
 
   # Procs registered to handle keydown events.
@@ -138,12 +143,16 @@ class Graphics::AbstractSimulation
 
     renderer.title = name
 
-    self.color = {}
+    format = renderer.format
+    self.color = Hash.new { |h, name|
+      c = format.lookup name if Symbol === name || String === name
+      h[name] = c if c
+    }
     self.paused = false
 
     self.iter_per_tick = 1
 
-    self.key_handler = []
+    self.key_handler = SDL::Key::Bindings.new
     self.keydown_handler = {}
 
     initialize_keys
@@ -176,49 +185,18 @@ class Graphics::AbstractSimulation
     register_color :yellow,    255, 255, 0
     register_color :alpha,     0,   0,   0,   0
 
-    (0..99).each do |n|
-      m = (255 * (n / 100.0)).to_i
-      register_color(("gray%02d"    % n).to_sym, m, m, m)
-      register_color(("red%02d"     % n).to_sym, m, 0, 0)
-      register_color(("green%02d"   % n).to_sym, 0, m, 0)
-      register_color(("blue%02d"    % n).to_sym, 0, 0, m)
-      register_color(("cyan%02d"    % n).to_sym, 0, m, m)
-      register_color(("magenta%02d" % n).to_sym, m, 0, m)
-      register_color(("yellow%02d"  % n).to_sym, m, m, 0)
-    end
-
-    (0...256).each do |n|
-      m = (256 * n / 255.0).to_i
-      register_color(("gray%03d"    % n).to_sym, m, m, m)
-      register_color(("red%03d"     % n).to_sym, m, 0, 0)
-      register_color(("green%03d"   % n).to_sym, 0, m, 0)
-      register_color(("blue%03d"    % n).to_sym, 0, 0, m)
-      register_color(("cyan%03d"    % n).to_sym, 0, m, m)
-      register_color(("magenta%03d" % n).to_sym, m, 0, m)
-      register_color(("yellow%03d"  % n).to_sym, m, m, 0)
-    end
+    # gray00..gray99, gray000..gray255, and the same for red, green,
+    # blue, cyan, magenta, and yellow are filled in on demand by #color.
   end
 
-  font_dirs = [
-    # OS X
-    "/System/Library/Fonts",
-    "/Library/Fonts",
-    File.expand_path("~/Library/Fonts/"),
-
-    # Ubuntu
-    "/usr/share/fonts/truetype/**/",
-  ]
-  FONT_GLOB = "{#{font_dirs.join(",")}}" # :nodoc:
+  FONT_GLOB = "{#{SDL::TTF::DIRS.join(",")}}" # :nodoc:
 
   ##
-  # Find and open a (TTF) font. Should be as system agnostic as possible.
+  # Find and open a (TTF) font. Should be as system agnostic as
+  # possible. See SDL::TTF.lookup.
 
   def find_font name, size = 16
-    font = Dir["#{FONT_GLOB}/#{name}.{ttc,ttf}"].first
-
-    raise ArgumentError, "Can't find font named '#{name}'" unless font
-
-    SDL::TTF.open(font, size)
+    SDL::TTF.find name, size
   end
 
   ##
@@ -244,6 +222,18 @@ class Graphics::AbstractSimulation
     color[name] = renderer.format.map_rgba r, g, b, a
   end
 
+  ##
+  # Register every ramp color up front: gray00..gray99, gray000..gray255,
+  # and the same for red, green, blue, cyan, magenta, and yellow. Only
+  # needed to enumerate them, since #color looks them up on demand.
+
+  def register_color_ramps
+    %w[gray red green blue cyan magenta yellow].each do |ramp|
+      (0..99).each  { |n| color[("%s%02d" % [ramp, n]).to_sym] }
+      (0..255).each { |n| color[("%s%03d" % [ramp, n]).to_sym] }
+    end
+  end
+
   ##
   # Name a color w/ HSL values.
 
@@ -337,8 +327,8 @@ class Graphics::AbstractSimulation
     when SDL::Event::Quit then
       exit
     when SDL::Event::Keydown then
-      c = event.sym.chr rescue nil
-      b = keydown_handler[c]
+      sym = event.sym
+      b = keydown_handler[sym.chr] if sym.between? 0, 255
       b[self] if b
     end
   end
@@ -347,11 +337,15 @@ class Graphics::AbstractSimulation
   # Register a block to run for a particular key-press. This allows
   # you to register multiple blocks for the same key and also to
   # handle multiple keys down at the same time.
+  #
+  # By default the block runs every tick the key is held. Pass +on+ as
+  # :pressed or :released to run it only on that tick instead, and
+  # +mod+ (eg SDL::Key::MOD_CTRL) to require modifiers too.
 
-  def add_key_handler k, remove = nil, &b
+  def add_key_handler k, remove = nil, on: :held, mod: 0, &b
     k = SDL::Key.const_get k
-    key_handler.delete_if { |a, _| k==a } if remove
-    key_handler.unshift [k, b]
+    key_handler.unbind k if remove
+    key_handler.bind k, b, on: on, mod: mod
   end
 
   ##
@@ -363,33 +357,32 @@ class Graphics::AbstractSimulation
   end
 
   ##
-  # Handle key events by looking through key_handler and running any
-  # blocks that match the key(s) being pressed.
+  # Handle key events by updating key_handler from the keyboard state
+  # and running any blocks that match the key(s) being pressed.
 
   def handle_keys
-    SDL::Key.scan
-    key_handler.each do |k, blk|
-      blk[self] if SDL::Key.press? k
+    key_handler.update.each do |blk|
+      blk[self]
     end
   end
 
   ##
-  # Run the simulation. This handles all events by polling and
-  # scanning for key presses (multiple keys at once are possible).
+  # Run the simulation. This handles all events by draining the event
+  # queue and scanning for key presses (multiple keys at once are
+  # possible). Runs of mouse motion arrive as a single Mousemove.
   #
   # On each tick, call update, then draw the scene.
 
   def run
     self.start_time = Time.now
     n = 0
-    event = nil
     self.done = false
 
     logger = respond_to? :log
     log_interval = self.class::LOG_INTERVAL
 
     loop do
-      handle_event event, n while event = SDL::Event.poll
+      SDL::Event.drain.each { |event| handle_event event, n }
       handle_keys
 
       break if done
@@ -494,14 +487,16 @@ class Graphics::AbstractSimulation
   end
 
   ##
-  # Draw a closed form polygon from an array of points in a particular
-  # color.
+  # Draw a closed form polygon from an array of points (anything that
+  # splats to x, y) in a particular color. Filled polygons can be
+  # concave, and their triangulation is cached, so redrawing the same
+  # shape every frame is cheap.
 
-  def polygon *points, color
-    points << points.first
-    points.each_cons(2) do |p1, p2|
-      line(*p1, *p2, color)
-    end
+  def polygon *points, c, fill: false, aa: true
+    h      = self.h
+    xs, ys = points.map(&:to_a).transpose
+
+    renderer.draw_polygon xs, ys.map { |y| h-y-1 }, color[c], fill: fill, aa: aa
   end
 
   ##
@@ -512,6 +507,15 @@ class Graphics::AbstractSimulation
     line x1, y1, x2, y2, c
   end
 
+  ##
+  # Draw an arc of radius r around x/y from angle a1 to a2 (degrees,
+  # counterclockwise) in color c. A sweep of 360 or more is a circle.
+
+  def arc x, y, r, a1, a2, c, width: 1, cap: :butt, aa: true
+    renderer.draw_arc(x, y, r, a1, a2, color[c],
+                      width: width, cap: cap, aa: aa, h: self.h-1)
+  end
+
   ##
   # Draw a rect at x/y with w by h dimensions in color c. Ignores blending.
 
@@ -523,7 +527,8 @@ class Graphics::AbstractSimulation
   ##
   # Read or write a color to x/y. If c is given, write, otherwise read.
   #
-  # Reading is pretty slow. Try to avoid.
+  # Reading is pretty slow. Try to avoid. If you need more than a few
+  # pixels, read the whole region at once with renderer.read_pixels.
 
   def point x, y, c = nil
     if c then
@@ -533,6 +538,41 @@ class Graphics::AbstractSimulation
     end
   end
 
+  ##
+  # Create a framebuffer of +w+ by +h+ cells for per-pixel drawing.
+  # Reads and writes only touch memory. See #draw_framebuffer.
+
+  def framebuffer w = self.w, h = self.h
+    renderer.new_framebuffer w, h
+  end
+
+  ##
+  # Create a framebuffer of +w+ by +h+ 8 or 16 bit palette indices.
+  # Set its colors with #palette= and then write indices instead of
+  # colors. See Simulation#rainbow_palette.
+
+  def indexed_framebuffer w = self.w, h = self.h, bits = 8
+    renderer.new_indexed_framebuffer w, h, bits
+  end
+
+  ##
+  # Upload the changed rows of framebuffer +fb+ and draw it scaled up
+  # to fill the window. Like everything else, row 0 is the bottom.
+
+  def draw_framebuffer fb
+    renderer.draw_framebuffer fb, true
+  end
+
+  ##
+  # Draw a +w+ by +h+ grid of packed float32 or float64 +values+ (eg
+  # from Array#pack("f*")) as a heatmap filling the window. Options
+  # are +colormap+ (:hue, :greyscale, :cubehelix, or an array of
+  # colors) and +min+/+max+, which default to the field's own range.
+
+  def draw_field values, w, h, **options
+    renderer.draw_field values, w, h, flip: true, **options
+  end
+
   ##
   # Calculate the x/y coordinate offset from x1/y1 with an angle and a
   # magnitude.
@@ -550,6 +590,15 @@ class Graphics::AbstractSimulation
     renderer.draw_rect x, y, w, h, color[c], fill
   end
 
+  ##
+  # Draw the outline of a rect at x/y with w by h dimensions and its
+  # corners rounded to radius r in color c.
+
+  def rounded_rect x, y, w, h, r, c, width: 1, aa: true
+    renderer.draw_rounded_rect(x, y, w, h, r, color[c],
+                               width: width, aa: aa, h: self.h-1)
+  end
+
   ##
   # Draw a circle at x/y with radius r in color c.
 
@@ -558,6 +607,19 @@ class Graphics::AbstractSimulation
     renderer.draw_circle x, y, r, color[c], aa, fill
   end
 
+  ##
+  # Draw a circle with radius r at each of +points+ (like #stroke
+  # takes) in color c, or an array with a color per circle. Small
+  # circles are stamped from a cached texture, so thousands of them
+  # are still a single draw call.
+
+  def circles points, r, c, fill = false, aa = true
+    c = Array === c ? c.map { |k| color[k] } : color[c]
+
+    renderer.draw_circles(flatten_points(points), r, c,
+                          aa: aa, fill: fill, h: self.h-1)
+  end
+
   ##
   # Draw a circle at x/y with radiuses w/h in color c.
 
@@ -567,17 +629,50 @@ class Graphics::AbstractSimulation
   end
 
   ##
-  # Draw an antialiased curve from x1/y1 to x2/y2 via control points
-  # cx1/cy1 & cx2/cy2 in color c.
+  # Draw an ellipse with radiuses w/h at each of +points+, like
+  # #circles.
+
+  def ellipses points, w, h, c, fill = false, aa = true
+    c = Array === c ? c.map { |k| color[k] } : color[c]
+
+    renderer.draw_ellipses(flatten_points(points), w, h, c,
+                           aa: aa, fill: fill, h: self.h-1)
+  end
+
+  ##
+  # Draw a curve from x1/y1 to x2/y2 via control points cx1/cy1 &
+  # cx2/cy2 in color c. Any number of control points works. Pass aa:
+  # true to antialias it.
 
-  def bezier *points, c
-    h = self.h-1
+  def bezier *points, c, aa: false
+    renderer.draw_bezier points, color[c], h: self.h-1, aa: aa
+  end
 
-    # TODO: there is probably a cleaner way... or move entirely into C
-    xs, ys = points.each_slice(2).to_a.transpose
-    ys.map! { |y| h-y }
+  ##
+  # Draw a connected path of curves in one go. +points+ is x0, y0 and
+  # then +degree+ more points per curve (two control points and an
+  # end point for the default cubic curves), as an array or a string
+  # of packed float64s.
 
-    renderer.draw_bezier xs, ys, 5, color[c]
+  def bezier_path points, c, degree: 3, aa: false
+    renderer.draw_bezier points, color[c], degree: degree, h: self.h-1, aa: aa
+  end
+
+  ##
+  # Draw a line +width+ pixels wide through +points+ (anything that
+  # splats to x, y, a flat array of coordinates, or a string of packed
+  # float64s) in color c. Joins are :miter, :round, or :bevel and caps
+  # are :butt, :round, or :square. However wide, it's one draw call.
+
+  def stroke points, c, width: 1, join: :miter, cap: :butt, closed: false, aa: true
+    renderer.draw_stroke(flatten_points(points), color[c],
+                         width: width, join: join, cap: cap,
+                         closed: closed, aa: aa, h: self.h-1)
+  end
+
+  def flatten_points points # :nodoc:
+    return points if String === points or Numeric === points.first
+    points.flat_map(&:to_a)
   end
 
   ## Text
@@ -627,10 +722,32 @@ class Graphics::AbstractSimulation
   ### Blitting Methods:
 
   ##
-  # Load an image at path into a new surface.
+  # Load an image at path into a surface. Images are cached by their
+  # expanded path, so loading the same image again returns the same
+  # surface. That surface is shared and read only; use
+  # SDL::Surface.load for one you can change. SDL::Surface.clear_cache
+  # lets go of them all.
 
   def image path
-    SDL::Surface.load path
+    SDL::Surface.cached path
+  end
+
+  ##
+  # Start loading images at +paths+ in the background and return an
+  # SDL::Loader. Call #upload_images once a frame to turn finished
+  # images into textures a few at a time, or +wait+ on the loader to
+  # get a hash of path to surface.
+
+  def images paths, **options
+    SDL::Surface.load_async paths, **options
+  end
+
+  ##
+  # Create textures for up to +max+ images +loader+ has finished, so
+  # the first blit of each doesn't stall.
+
+  def upload_images loader, max = nil
+    loader.upload renderer, max
   end
 
   ##
@@ -640,6 +757,13 @@ class Graphics::AbstractSimulation
     SDL::Audio.load path
   end
 
+  ##
+  # Open an asset bundle made by <tt>rake bundle</tt>. See SDL::Bundle.
+
+  def bundle path
+    SDL::Bundle.open path
+  end
+
   ##
   # Open the audio mixer with a number of +channels+ open.
 
@@ -677,6 +801,22 @@ class Graphics::AbstractSimulation
     renderer.save path
   end
 
+  ##
+  # Record every presented frame to +path+ in the background. See
+  # SDL::Renderer#start_recording for the options.
+
+  def start_recording path, **options
+    renderer.start_recording path, **options
+  end
+
+  ##
+  # Stop recording and wait for any queued frames to be written.
+  # Returns the SDL::Recorder so you can check #frames and #dropped.
+
+  def stop_recording
+    renderer.stop_recording
+  end
+
   ##
   # Create a new renderer with a given width and height and yield to a
   # block for drawing. The resulting surface is returned.
@@ -731,6 +871,12 @@ class Graphics::Drawing < Graphics::AbstractSimulation
 
   attr_accessor :texture
 
+  ##
+  # An optional CPU-side copy of texture, an SDL::Framebuffer. See
+  # #shadow.
+
+  attr_accessor :canvas
+
   def initialize(*a) # :nodoc:
     super
 
@@ -756,6 +902,68 @@ class Graphics::Drawing < Graphics::AbstractSimulation
     renderer.present
   end
 
+  ##
+  # Keep a CPU-side copy of the drawing in #canvas and return it.
+  # Reading a pixel back from the renderer stalls until the GPU
+  # catches up, so simulations that read and write lots of pixels
+  # every tick should use the canvas instead: reads and writes only
+  # touch memory and whatever changed is uploaded once per frame.
+  #
+  # The canvas is in window coordinates (row 0 is the top), the same
+  # as renderer[x, y]. At the end of each frame the rectangle around
+  # whatever changed on it is copied onto the drawing, over anything
+  # the renderer drew there that frame; the rest of the drawing is left
+  # alone. The canvas doesn't see renderer drawing, so pixels you want
+  # to read back should be drawn through it.
+
+  def shadow
+    return canvas if canvas
+
+    old = renderer.target
+
+    begin
+      renderer.target = texture
+      fb = renderer.new_framebuffer w, h
+      fb.write renderer.read_pixels
+      renderer.draw_framebuffer_changes fb # already on the texture
+      self.canvas = fb
+    ensure
+      renderer.target = old
+    end
+  end
+
+  def point x, y, c = nil # :nodoc:
+    return super unless canvas
+
+    y = h-y-1
+
+    if c then
+      canvas[x, y] = color[c]
+    elsif x >= 0 && y >= 0 && x < w && y < h then
+      canvas[x, y]
+    end
+  end
+
+  def clear c = self.class::CLEAR_COLOR # :nodoc:
+    super
+    canvas.clear color[c] if canvas && color[c]
+  end
+
+  ##
+  # Fill the region of the #canvas around x, y with color +c+, like a
+  # paint bucket. Pixels whose channels are all within +tolerance+ of
+  # the one at x, y count as the same color. Returns the number of
+  # pixels filled.
+  #
+  # The canvas has to be turned on with #shadow first, since it's drawn
+  # over everything else from then on.
+
+  def flood_fill x, y, c, tolerance: 0
+    raise "flood_fill needs a canvas; call shadow first" unless canvas
+
+    canvas.flood_fill x, h-y-1, color[c], tolerance: tolerance
+  end
+
   def pre_draw n # :nodoc:
     # no clear
   end
@@ -763,6 +971,7 @@ class Graphics::Drawing < Graphics::AbstractSimulation
   def draw_and_flip n # :nodoc:
     draw_on texture do
       self.draw n
+      renderer.draw_framebuffer_changes canvas if canvas
     end
   end
 end
@@ -13,12 +13,12 @@
 #   trail.draw
 
 class Graphics::Trail
-  @@c = {}
+  @@c = ObjectSpace::WeakMap.new # renderer => { color => ramp }
 
   ##
-  # The array of x/y coordinates of the trail.
+  # The points of the trail, an SDL::Trail ring buffer.
 
-  attr_accessor :a
+  attr_accessor :trail
 
   ##
   # The windowing system we're drawing in.
@@ -26,12 +26,7 @@ class Graphics::Trail
   attr_accessor :w
 
   ##
-  # The maximum number of segments to keep in the trail.
-
-  attr_accessor :max
-
-  ##
-  # The hues to draw in the trail.
+  # The hues to draw in the trail, packed RGBA from newest to oldest.
 
   attr_accessor :c
 
@@ -40,30 +35,57 @@ class Graphics::Trail
 
   def initialize w, max, color = :green
     self.w = w
-    self.a = []
-    self.max = max
-    unless @@c[color] then
-      @@c[color] ||= (0..99).map { |n| ("%s%02d" % [color, n]).to_sym }.reverse
-    end
-    self.c = @@c[color]
+    self.trail = SDL::Trail.new max
+    ramps  = @@c[w.renderer] ||= {}
+    self.c = ramps[color] ||= ramp(color)
   end
 
   ##
-  # Draw the trail and taper off the color as we go.
+  # The array of x/y coordinates of the trail, oldest first.
+
+  def a
+    trail.to_a
+  end
+
+  ##
+  # The maximum number of segments to keep in the trail.
+
+  def max
+    trail.max
+  end
+
+  ##
+  # Change the maximum number of segments, keeping the newest ones.
+
+  def max= n
+    old = trail.to_a.last n
+    self.trail = SDL::Trail.new n
+    old.each { |x, y| trail.push x, y }
+  end
+
+  ##
+  # Draw the trail and taper off the color as we go. The whole trail
+  # is a single draw call.
 
   def draw
-    m = 100.0 / max
-    a.reverse_each.each_cons(2).with_index do |((x1, y1), (x2, y2)), i|
-      w.line x1, y1, x2, y2, c[(i*m).round] || :black
-    end
+    w.renderer.draw_trail trail, c, w.h
   end
 
   ##
   # Add another segment to the trail, and remove a segment if needed.
 
   def << body
-    a << [body.x, body.y]
-    a.shift if a.size > max
+    trail.push body.x, body.y
     nil
   end
+
+  private
+
+  def ramp color # :nodoc:
+    format = w.renderer.format
+
+    99.downto(0).map { |n|
+      format.get_rgba(w.color[("%s%02d" % [color, n]).to_sym]).pack "C4"
+    }.join.freeze
+  end
 end
@@ -1,78 +1,56 @@
+require "sdl/sdl"
+
 ##
-# Simple and fast 2 dimensional vector
+# Simple and fast 2 dimensional vector. V is implemented in the sdl
+# extension as a pair of doubles, so reading x & y or doing math on
+# one doesn't cost an ivar lookup per coordinate.
+#
+# Every operator returns a new vector. To avoid the allocation in a
+# hot loop, use the in-place versions, add!, sub!, and scale!, or keep
+# a whole system of vectors in a V::Array.
+#
+# V::Array is a packed array of vectors with bulk operations over all
+# of them at once: axpy! (self += a * other), scale!, normalize!,
+# clamp! (to a maximum magnitude), and dot.
+#
+# Components are always Floats: V[1, 2].x is 1.0, not 1.
+#
+# The extension defines it as SDL::V; requiring graphics/v is what
+# makes it V at the top level.
+
+V = SDL::V
 
 class V
-  # x coordinate accessors -- preferably float
-  attr_accessor :x
-  # y coordinate accessors -- preferably float
-  attr_accessor :y
-
-  class << self
-    alias :[] :new # :nodoc:
-  end
-
-  ##
-  # Create a new vector with x & y coordinates.
-
-  def initialize x, y
-    @x = x
-    @y = y
-  end
-
   # zero vector
-  ZERO = V[0.0, 0.0]
+  ZERO = V[0.0, 0.0].freeze
 
   # one vector
-  ONE  = V[1.0, 1.0]
-
-  ##
-  # Add two vectors, returning a new vector.
-
-  def + v
-    V[x+v.x, y+v.y]
-  end
-
-  ##
-  # Subtract two vectors, returning a new vector.
-
-  def - v
-    V[x-v.x, y-v.y]
-  end
-
-  ##
-  # Unary negation.
-
-  def -@
-    V[-x, -y]
-  end
-
-  ##
-  # Multiply a vector by a scalar, returning a new vector.
+  ONE  = V[1.0, 1.0].freeze
 
-  def * s
-    V[x*s, y*s]
+  def inspect # :nodoc:
+    "V[%.2f, %.2f]" % [x, y]
   end
+  alias to_s inspect # :nodoc:
 
-  ##
-  # Divide a vector by a scalar, returning a new vector.
+  class Array
+    include Enumerable
 
-  def / s
-    V[x/s, y/s]
-  end
+    ##
+    # Yield each vector in turn. Allocates a V per element, so prefer
+    # the bulk operations where you can.
 
-  def == other # :nodoc:
-    x == other.x && y == other.y
-  end
+    def each
+      return enum_for :each unless block_given?
 
-  ##
-  # Return the length of the vector from the origin.
+      size.times do |i|
+        yield self[i]
+      end
 
-  def magnitude
-    @magnitude ||= Math.sqrt(x*x + y*y)
-  end
+      self
+    end
 
-  def inspect # :nodoc:
-    "#{self.class.name}[%.2f, %.2f]" % [x, y]
+    def inspect # :nodoc:
+      "#<V::Array #{to_a.map(&:inspect).join ", "}>"
+    end
   end
-  alias to_s inspect # :nodoc:
 end
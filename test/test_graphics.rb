@@ -1,6 +1,7 @@
 # -*- coding: utf-8 -*-
 
 require "minitest/autorun"
+require "set"
 require "graphics"
 
 class FakeSimulation < Graphics::Simulation
@@ -304,6 +305,684 @@ class TestNumeric < Minitest::Test
   end
 end
 
+class TestV < Minitest::Test
+  def test_math
+    a, b = V[1, 2], V[3, 4]
+
+    assert_equal V[4, 6],   a + b
+    assert_equal V[-2, -2], a - b
+    assert_equal V[-1, -2], -a
+    assert_equal V[2, 4],   a * 2
+    assert_equal V[0.5, 1], a / 2
+    assert_equal 5.0,       b.magnitude
+    assert_equal 11.0,      a.dot(b)
+  end
+
+  def test_floats
+    assert_kind_of Float, V[1, 2].x
+    assert_equal "V[1.00, 2.00]", V[1, 2].inspect
+  end
+
+  def test_equals_other_types
+    xy = Struct.new :x
+    refute_equal V[1, 2], xy.new(1)
+    refute_equal V[1, 2], [1, 2]
+  end
+
+  def test_in_place
+    a = V[1, 2]
+
+    assert_same a, a.add!(V[3, 4]).scale!(2).sub!(V::ONE)
+    assert_equal V[7, 11], a
+
+    assert_raises FrozenError do
+      V::ZERO.add! a
+    end
+  end
+
+  def test_array
+    a = V::Array.new 2
+    a[0] = V[3, 4]
+    b = V::Array.new(2).fill V::ONE
+
+    assert_equal 7.0, a.dot(b)
+
+    a.axpy! 2, b
+    assert_equal [V[5, 6], V[2, 2]], a.to_a
+
+    a.normalize!
+    a.to_a.each { |v| assert_in_delta 1.0, v.magnitude }
+
+    a.clamp! 0.5
+    assert_in_delta 0.5, a[-1].magnitude
+
+    assert_raises(IndexError) { a[2] }
+    assert_raises(ArgumentError) { a.dot V::Array.new 3 }
+  end
+end
+
+class TestSPH < Minitest::Test
+  def fluid
+    Graphics::SPH.new(mass: 5, density: 1, k: 20, eta: 1, h: 1,
+                      gravity: V[0, -0.5])
+  end
+
+  def test_step
+    sph = fluid
+    sph.add 5, 5
+    sph.add 5, 5.5
+    sph.add 9, 9
+
+    sph.step 0.1
+
+    (x0, y0, _, _, d0), (_, y1, _, _, d1), (_, _, _, _, d2) = sph.each.to_a
+
+    assert_equal 3, sph.size
+    assert_in_delta 5, x0
+    assert_operator y0, :<, y1 - 0.5 # pushed apart
+    assert_equal d0, d1
+    assert_equal 1.0, d2             # alone, so rest density
+  end
+
+  def test_threads
+    rng = Random.new 42
+    one, four = [1, 4].map { |n|
+      Graphics::SPH.new(mass: 5, density: 1, k: 20, eta: 1, h: 1,
+                        gravity: V[0, -0.5], threads: n)
+    }
+
+    40.times do |i|
+      30.times do |j|
+        x, y = 1 + i * 0.5 + rng.rand * 0.1, 1 + j * 0.5
+        one.add x, y
+        four.add x, y
+      end
+    end
+
+    3.times do
+      one.step 0.1
+      four.step 0.1
+    end
+
+    assert_equal 1200, four.size
+    assert_equal one.each.to_a, four.each.to_a
+  end
+
+  # The model from examples/fluid2.rb, on plain arrays.
+  def reference_step ps, dt
+    mass, rest, k, eta, h, g = 5, 1, 20, 1, 1.0, [0, -0.5]
+    near = ->(a, b) {
+      dx, dy = a[0] - b[0], a[1] - b[1]
+      len = Math.sqrt dx * dx + dy * dy
+      [dx, dy, len] if len > 0 && len < h
+    }
+
+    ps.each do |p|
+      p[4] = rest + ps.sum { |q|
+        *, len = near[p, q]
+        len ? mass * 315.0 / (64 * Math::PI * h**9) * (h**2 - len**2)**3 : 0
+      }
+    end
+
+    forces = ps.map { |p|
+      ps.inject([0, 0]) { |(fx, fy), q|
+        dx, dy, len = near[p, q]
+        next [fx, fy] unless len
+
+        press = 45.0 / (Math::PI * h**6 * len) * (h - len)**2 *
+          mass * (k * (p[4] - rest) + k * (q[4] - rest)) / (2 * q[4])
+        visc  = eta * mass / q[4] * 45.0 / (2 * Math::PI * h**5) * (1 - len / h)
+
+        [fx + dx * press + (q[2] - p[2]) * visc,
+         fy + dy * press + (q[3] - p[3]) * visc]
+      }
+    }
+
+    ps.zip(forces).each do |p, (fx, fy)|
+      p[2] += (fx * (1.0 / p[4] * dt) + g[0]) * dt
+      p[3] += (fy * (1.0 / p[4] * dt) + g[1]) * dt
+      p[0] += p[2] * dt
+      p[1] += p[3] * dt
+    end
+  end
+
+  def test_matches_reference
+    rng = Random.new 42
+    sph = fluid
+    ps  = []
+
+    11.times do |i|
+      11.times do |j|
+        x, y = i + 1 + rng.rand * 0.1, j + 5
+        sph.add x, y
+        ps << [x, y, 0, 0, 1]
+      end
+    end
+
+    3.times do
+      sph.step 0.1
+      reference_step ps, 0.1
+    end
+
+    sph.each.zip(ps).each do |got, want|
+      got.zip(want).each { |a, b| assert_in_delta b, a, 1e-9 }
+    end
+  end
+
+  def test_contain
+    sph = fluid
+    sph.add(-1, 20)
+    sph.contain 10
+
+    x, y, = sph.each.first
+
+    assert_operator x, :>, 0
+    assert_operator y, :<, 10
+  end
+end
+
+class TestFlock < Minitest::Test
+  def test_step
+    flock = Graphics::Flock.new max_distance: 100, too_close: 50
+
+    pos = V::Array.new 3
+    vel = V::Array.new 3
+    pos[0], pos[1], pos[2] = V[0, 0], V[10, 0], V[500, 500]
+    vel[0], vel[1], vel[2] = V[1, 0], V[-1, 0], V[0, 1]
+
+    flock.step pos, vel
+
+    assert_operator vel[0].x, :<, 1  # pushed apart
+    assert_operator vel[1].x, :>, -1
+    assert_equal V[0, 2], vel[2]     # alone, so it keeps its heading
+  end
+
+  def test_step_size_mismatch
+    flock = Graphics::Flock.new
+
+    assert_raises ArgumentError do
+      flock.step V::Array.new(2), V::Array.new(3)
+    end
+  end
+
+  def test_max_distance
+    flock = Graphics::Flock.new max_distance: 10
+    flock.max_distance = 20
+
+    assert_equal 20, flock.max_distance
+
+    flock.max_distance = -5
+    assert_equal 0, flock.max_distance
+
+    assert_equal 0, Graphics::Flock.new(max_distance: -1).max_distance
+  end
+end
+
+class TestCellGrid < Minitest::Test
+  def grid *cells, rule: "B3/S23"
+    g = Graphics::CellGrid.new 5, 5, rule: rule
+    cells.each { |x, y| g[x, y] = true }
+    g
+  end
+
+  def test_step_blinker
+    g = grid [1, 2], [2, 2], [3, 2]
+
+    g.step
+
+    assert_equal [[2, 1], [2, 2], [2, 3]], g.each.to_a
+    assert_equal 3, g.population
+
+    g.step 2
+
+    assert_equal [[2, 1], [2, 2], [2, 3]], g.each.to_a
+  end
+
+  def test_step_wraps
+    g = grid [4, 0], [0, 0], [1, 0]
+
+    g.step
+
+    assert_equal [[0, 0], [0, 1], [0, 4]], g.each.to_a.sort
+  end
+
+  # B3/S23 on a w by h torus, one generation of a set of [x, y].
+  def life cells, w, h
+    counts = Hash.new 0
+
+    cells.each do |x, y|
+      [-1, 0, 1].product([-1, 0, 1]) do |dx, dy|
+        counts[[(x + dx) % w, (y + dy) % h]] += 1 unless dx == 0 && dy == 0
+      end
+    end
+
+    counts.select { |c, n| n == 3 || n == 2 && cells.include?(c) }.keys.to_set
+  end
+
+  # Wide enough for three words per row (the last one partial) and tall
+  # enough to split into a band per thread.
+  def big_grid cells
+    g = Graphics::CellGrid.new 130, 512, threads: 4
+    cells.each { |x, y| g[x, y] = true }
+    g
+  end
+
+  def test_step_glider_across_words
+    glider = [[1, 0], [2, 1], [0, 2], [1, 2], [2, 2]].map { |x, y| [x + 60, y + 250] }
+    g = big_grid glider
+
+    g.step 16 # 4 cells down and right, from word 0 into word 1
+
+    assert_equal glider.map { |x, y| [x + 4, y + 4] }.sort, g.each.to_a.sort
+  end
+
+  def test_step_matches_reference
+    rng   = Random.new 7
+    cells = Set.new
+
+    [*56..72, *120..129, *0..4].each do |x|
+      512.times { |y| cells << [x, y] if rng.rand < 0.35 }
+    end
+
+    g = big_grid cells
+
+    10.times do
+      g.step
+      cells = life cells, 130, 512
+      assert_equal cells.sort, g.each.to_a.sort
+    end
+  end
+
+  def test_index
+    g = grid
+
+    g[-1, 5] = true
+
+    assert g[4, 0]
+    refute g[0, 0]
+  end
+
+  def test_rule
+    assert_equal "B3/S23", grid.rule
+    assert_equal "B36/S23", grid(rule: "23/36").rule
+    assert_equal "B2/S", grid(rule: "b2/s").rule
+
+    assert_raises ArgumentError do
+      grid rule: "B9/S23"
+    end
+  end
+end
+
+class TestTTF < Minitest::Test
+  def test_load_index
+    require "tmpdir"
+
+    Dir.mktmpdir do |root|
+      fonts = File.join root, "fonts"
+      cache = File.join root, "cache", "fonts.idx"
+
+      Dir.mkdir fonts
+      Dir.mkdir File.join fonts, "sub"
+      File.write File.join(fonts, "sub", "Deep.ttf"), ""
+      File.write File.join(fonts, "sub", "Top.ttf"),  ""
+      File.write File.join(fonts, "Top.ttc"),         ""
+
+      exp = {
+        "Top"  => [File.join(fonts, "Top.ttc"), 0],
+        "Deep" => [File.join(fonts, "sub", "Deep.ttf"), 0],
+      }
+      deep = "#{fonts}/**/"
+
+      assert_equal exp, SDL::TTF.load_index([deep], cache)
+      assert_path_exists cache
+
+      File.write File.join(fonts, "sub", "Deep.ttf"), "changed"
+      assert_equal exp, SDL::TTF.load_index([deep], cache) # still cached
+
+      File.write File.join(fonts, "sub", "New.ttf"), ""
+      exp["New"] = [File.join(fonts, "sub", "New.ttf"), 0]
+      assert_equal exp, SDL::TTF.load_index([deep], cache) # rescanned
+
+      flat = { "Top" => [File.join(fonts, "Top.ttc"), 0] }
+      assert_equal flat, SDL::TTF.load_index([fonts], cache) # not recursive
+    end
+  end
+end
+
+class TestSurface < Minitest::Test
+  BODY = File.expand_path "../resources/images/body.png", __dir__
+
+  def test_load_async
+    loader = SDL::Surface.load_async [BODY, BODY], threads: 2
+    surfaces = loader.wait
+
+    assert_equal [BODY], surfaces.keys
+    assert_predicate loader, :done?
+    assert_equal 1, loader.size
+
+    again = SDL::Surface.load_async [BODY]
+    assert_same surfaces[BODY], again[BODY] # cached, nothing to load
+    assert_same surfaces[BODY], SDL::Surface.cache[BODY]
+  end
+
+  def test_load_async_spellings
+    SDL::Surface.clear_cache
+
+    Dir.chdir File.dirname(BODY) do
+      loader   = SDL::Surface.load_async ["body.png", "./body.png", BODY]
+      surfaces = loader.wait
+
+      assert_equal 1, loader.size
+      assert_equal ["body.png", "./body.png", BODY].sort, surfaces.keys.sort
+      assert_same surfaces["body.png"], surfaces["./body.png"]
+      assert_same surfaces["body.png"], surfaces[BODY]
+    end
+  end
+
+  def test_cached
+    SDL::Surface.clear_cache
+
+    surface = SDL::Surface.cached BODY
+
+    assert_same surface, SDL::Surface.cached(BODY)
+    Dir.chdir File.dirname(BODY) do
+      assert_same surface, SDL::Surface.cached("../images/body.png")
+    end
+    assert_equal [BODY], SDL::Surface.cache.keys
+
+    assert_raises(FrozenError) { surface.flood_fill 0, 0, 0 }
+    assert_operator SDL::Surface.load(BODY).flood_fill(0, 0, 0), :>, 0
+
+    surface.pixels { |buffer, _| assert_predicate buffer, :readonly? } if
+      defined? IO::Buffer
+
+    SDL::Surface.clear_cache
+    assert_empty SDL::Surface.cache
+    refute_same surface, SDL::Surface.cached(BODY)
+  end
+
+  def test_ractor_safe
+    skip "needs ractors" unless defined? Ractor
+
+    assert_equal 5.0, Ractor.new { (V[1, 2] + V[2, 2]).magnitude }.take
+
+    e = assert_raises Ractor::RemoteError do
+      Ractor.new { SDL::Surface.cache }.take
+    end
+    assert_kind_of Ractor::UnsafeError, e.cause
+  end
+
+  def test_load_async_missing
+    loader = SDL::Surface.load_async ["nope.png"]
+
+    assert_raises SDL::Error do
+      loader.wait
+    end
+  end
+
+  def rgba *c
+    c.pack("C4").unpack1 "L"
+  end
+
+  def sprite
+    renderer = FakeSimulation.new.renderer.sprite 4, 3
+    renderer.clear rgba(0, 0, 255, 255)
+    renderer[1, 1] = renderer[2, 1] = rgba(255, 0, 0, 255)
+    renderer
+  end
+
+  def test_index
+    surface = sprite.instance_variable_get :@surface
+
+    assert_equal rgba(0, 0, 255, 255), surface[0, 0]
+    assert_equal rgba(255, 0, 0, 255), surface[1, 1]
+    assert_equal rgba(255, 0, 0, 255), surface[2, 1]
+    assert_equal rgba(0, 0, 255, 255), surface[3, 2]
+
+    assert_raises(IndexError) { surface[4, 0] }
+    assert_raises(IndexError) { surface[0, -1] }
+  end
+
+  def test_pixels
+    skip "needs IO::Buffer" unless defined? IO::Buffer
+
+    surface = sprite.instance_variable_get :@surface
+
+    surface.pixels do |buffer, pitch|
+      assert_equal 4 * 4, pitch
+      assert_equal 3 * pitch, buffer.size
+      assert_equal surface[1, 1], buffer.get_value(:u32, pitch + 4)
+      assert_equal surface[3, 2], buffer.get_value(:u32, 2 * pitch + 12)
+    end
+  end
+
+  def test_read_pixels
+    renderer = sprite
+    blue     = [0, 0, 255, 255].pack "C4"
+    red      = [255, 0, 0, 255].pack "C4"
+
+    assert_equal 4 * 3 * 4, renderer.read_pixels.bytesize
+    assert_equal blue + red * 2 + blue, renderer.read_pixels(0, 1, 4, 1)
+    assert_equal red + blue, renderer.read_pixels(2, 1)[0, 8]
+
+    assert_raises(IndexError) { renderer.read_pixels 3, 0, 2, 1 }
+    assert_raises(IndexError) { renderer.read_pixels(-1, 0) }
+    assert_raises(ArgumentError) { renderer.read_pixels 0, 0, 0, 1 }
+  end
+
+  def coverage renderer, *rect
+    renderer.read_pixels(*rect).unpack("C*").each_slice(4).sum { |*, a| a }
+  end
+
+  def blank w, h
+    renderer = FakeSimulation.new.renderer.sprite w, h
+    renderer.clear rgba(0, 0, 0, 0)
+    renderer
+  end
+
+  def test_draw_stroke_aa
+    white = rgba(255, 255, 255, 255)
+
+    thin = blank 32, 9
+    thin.draw_stroke [2, 4.5, 30, 4.5], white, aa: true
+
+    assert_in_delta 255, coverage(thin, 16, 0, 1, 9), 32 # one pixel's worth
+    assert_equal 0, coverage(thin, 16, 0, 1, 3)
+    assert_equal 0, coverage(thin, 16, 6, 1, 3)
+
+    wide = blank 32, 9
+    wide.draw_stroke [2, 4.5, 30, 4.5], white, aa: true, width: 5
+
+    assert_in_delta 5 * 255, coverage(wide, 16, 0, 1, 9), 32
+    assert_equal 0, coverage(wide, 16, 0, 1, 1)
+  end
+
+  def test_draw_polygon_concave
+    white = rgba(255, 255, 255, 255)
+    l     = blank 32, 32
+
+    # An L starting at its inner corner, so a fan from the first point
+    # would cover the notch.
+    l.draw_polygon [28, 10, 10, 2, 2, 28], [10, 10, 28, 28, 2, 2], white, fill: true
+
+    assert_equal white, l[5, 20]
+    assert_equal white, l[20, 5]
+    assert_equal 0, coverage(l, 14, 14, 14, 14) # the notch
+    area = 26 * 8 + 8 * 18
+    assert_in_delta area * 255, coverage(l), 255 * 16
+  end
+
+  def test_draw_field
+    red, green, blue = rgba(255, 0, 0, 255), rgba(0, 255, 0, 255), rgba(0, 0, 255, 255)
+    values = [0.0, 1.0].pack "f*"
+
+    auto = blank 2, 1
+    auto.draw_field values, 2, 1, colormap: [red, green, blue]
+
+    assert_equal [red, blue].pack("L*"), auto.read_pixels
+
+    given = blank 2, 1
+    given.draw_field values, 2, 1, colormap: [red, green, blue], min: 0, max: 2
+
+    assert_equal [red, green].pack("L*"), given.read_pixels
+  end
+
+  def test_draw_arc_and_rounded_rect_aa
+    white = rgba(255, 255, 255, 255)
+
+    arc = blank 32, 32
+    arc.draw_arc 16, 16, 10, 0, 360, white, aa: true
+
+    assert_in_delta 2 * Math::PI * 10 * 255, coverage(arc), 0.1 * 16_000
+
+    rect = blank 32, 32
+    rect.draw_rounded_rect 4, 4, 24, 24, 6, white, aa: true
+
+    perimeter = 4 * 24 - 8 * 6 + 2 * Math::PI * 6
+    assert_in_delta perimeter * 255, coverage(rect), 0.1 * 21_000
+  end
+
+  # Each shape drawn from a stamp, and again with stamps off, straight
+  # through SDL2_gfx. Blending in a different order can be off by a bit.
+  def assert_same_as_direct
+    tint = rgba(255, 128, 0, 255)
+
+    [5, 33].product([false, true], [false, true]) do |r, aa, fill|
+      stamped, direct = 2.times.map { |i|
+        renderer = blank 72, 72
+        renderer.stamps = i.zero?
+        yield renderer, r, tint, aa, fill
+        renderer.read_pixels.unpack "C*"
+      }
+
+      off = stamped.zip(direct).map { |a, b| (a - b).abs }.max
+
+      assert_operator off, :<=, 3, "r=#{r} aa=#{aa} fill=#{fill}"
+      assert_operator stamped.count(&:nonzero?), :>, 0
+    end
+  end
+
+  def test_draw_circle_stamps
+    assert_same_as_direct do |renderer, r, c, aa, fill|
+      renderer.draw_circle 35, 35, r, c, aa, fill
+    end
+  end
+
+  def test_draw_ellipse_stamps
+    assert_same_as_direct do |renderer, r, c, aa, fill|
+      renderer.draw_ellipse 35, 35, r, r / 2 + 1, c, aa, fill
+    end
+  end
+
+  def test_flood_fill
+    surface = SDL::Surface.load BODY
+    red     = [255, 0, 0, 255].pack("C4").unpack1 "L"
+
+    n = surface.flood_fill 0, 0, red
+
+    assert_operator n, :>, 0
+    assert_operator n, :<, surface.w * surface.h
+    assert_equal n, surface.flood_fill(0, 0, red) # the same region
+    assert_equal surface.w * surface.h, surface.flood_fill(0, 0, red, tolerance: 255)
+
+    assert_raises ArgumentError do
+      surface.flood_fill 0, 0, red, tolerance: 256
+    end
+  end
+end
+
+class TestBundle < Minitest::Test
+  BODY = TestSurface::BODY
+
+  def test_build_and_open
+    require "tmpdir"
+
+    Dir.mktmpdir do |dir|
+      path = File.join dir, "test.bundle"
+      SDL::Bundle.build path, [BODY, __FILE__]
+
+      bundle = SDL::Bundle.open path
+      assert_equal [BODY], bundle.names
+
+      exp = SDL::Surface.load BODY
+      img = bundle.image BODY
+
+      assert_equal [exp.w, exp.h], [img.w, img.h]
+      assert_equal exp.to_rgba32, img.to_rgba32
+      assert_equal exp.make_collision_map.dump, bundle.collision_map(BODY).dump
+
+      assert_raises KeyError do
+        bundle.image "nope.png"
+      end
+    end
+  end
+end
+
+class TestRecorder < Minitest::Test
+  attr_accessor :t
+
+  def setup
+    require "tmpdir"
+    self.t = FakeSimulation.new
+  end
+
+  def record format, n, **options
+    Dir.mktmpdir do |dir|
+      path = File.join dir, "out.#{format}"
+
+      t.start_recording path, format: format, **options
+      n.times { t.renderer.present }
+      rec = t.stop_recording
+
+      yield rec, path
+    end
+  end
+
+  def test_record_raw
+    record :raw, 3, depth: 2, policy: :block, threads: 1 do |rec, path|
+      assert_equal 3, rec.frames
+      assert_equal 0, rec.dropped
+      assert_equal 0, rec.failed
+      assert_equal 3 * 4 * t.w * t.h, File.size(path)
+    end
+  end
+
+  def test_record_y4m
+    record :y4m, 2, policy: :block do |rec, path|
+      assert_equal 2, rec.frames
+      assert_match(/\AYUV4MPEG2 W#{t.w} H#{t.h} F60:1 /, File.open(path, &:gets))
+    end
+  end
+
+  def test_record_drop
+    record :raw, 20, depth: 1, threads: 1 do |rec, _|
+      assert_equal 20, rec.frames + rec.dropped
+      assert_equal 0, rec.failed
+    end
+  end
+
+  def test_stop_recording
+    assert_nil t.stop_recording
+
+    record :raw, 1 do |rec, _|
+      assert_nil t.stop_recording
+      assert_same rec, rec.stop # already stopped
+      assert_equal 1, rec.frames
+    end
+  end
+
+  def test_start_recording_bad_options
+    Dir.mktmpdir do |dir|
+      path = File.join dir, "out"
+
+      assert_raises(ArgumentError) { t.start_recording path, format: :gif }
+      assert_raises(ArgumentError) { t.start_recording path, policy: :wait }
+      assert_raises(ArgumentError) { t.start_recording path, depth: 0 }
+      assert_nil t.stop_recording
+    end
+  end
+end
+
 class TestSimulation < Minitest::Test
   class FakePixelFormat < SDL::PixelFormat
     def initialize
@@ -372,10 +1051,27 @@ class TestSimulation < Minitest::Test
                    [:draw_line, 50, h-50, 50+d45, h-50-d45, white, true])
   end
 
+  def test_arc
+    t.arc 50, 50, 10, 0, 90, :white, width: 3
+
+    assert_drawing [:draw_arc, 50, 50, 10, 0, 90, white,
+                    { width: 3, cap: :butt, aa: true, h: h }]
+  end
+
   def test_bezier
     t.bezier 50, 50, 25, 25, 100, 25, :white
 
-    assert_drawing [:draw_bezier, [50, 25, 100], [h-50, h-25, h-25], 5, white]
+    assert_drawing [:draw_bezier, [50, 50, 25, 25, 100, 25], white,
+                    { h: h, aa: false }]
+  end
+
+  def test_bezier_path
+    points = [0, 0, 10, 10, 20, 10, 30, 0, 40, -10, 50, -10, 60, 0]
+
+    t.bezier_path points, :white, aa: false
+
+    assert_drawing [:draw_bezier, points, white,
+                    { degree: 3, h: h, aa: false }]
   end
 
   def test_blit
@@ -414,6 +1110,16 @@ class TestSimulation < Minitest::Test
                    [:draw_circle, 50, 149, 25, white, false, :filled])
   end
 
+  def test_circles
+    t.circles [[10, 20], V[30, 40]], 5, :white, :filled
+    t.circles [1, 2, 3, 4], 5, [:white, :black]
+
+    assert_drawing([:draw_circles, [10, 20, 30, 40], 5, white,
+                    { aa: true, fill: :filled, h: h }],
+                   [:draw_circles, [1, 2, 3, 4], 5, [white, black],
+                    { aa: true, fill: false, h: h }])
+  end
+
   def test_clear
     t.clear
     t.clear :white
@@ -434,6 +1140,30 @@ class TestSimulation < Minitest::Test
     assert_drawing [:draw_ellipse, 0, h, 25, 25, t.color[:white], true, false]
   end
 
+  def test_ellipses
+    t.ellipses [10, 20], 5, 3, :white
+
+    assert_drawing [:draw_ellipses, [10, 20], 5, 3, white,
+                    { aa: true, fill: false, h: h }]
+  end
+
+  def test_draw_framebuffer
+    t.draw_framebuffer :fb
+
+    assert_drawing [:draw_framebuffer, :fb, true]
+  end
+
+  def test_draw_field
+    values = [0.0, 0.5, 1.0, 0.5].pack "f*"
+
+    t.draw_field values, 2, 2
+    t.draw_field values, 2, 2, colormap: :cubehelix, max: 2
+
+    assert_drawing([:draw_field, values, 2, 2, { flip: true }],
+                   [:draw_field, values, 2, 2,
+                    { flip: true, colormap: :cubehelix, max: 2 }])
+  end
+
   def test_fast_rect
     t.fast_rect 25, 25,  10,  20, :white
     t.fast_rect  0,  0, 100, 100, :white
@@ -491,6 +1221,20 @@ class TestSimulation < Minitest::Test
                    [:draw_line, 0, 0, 25,   25, t.color[:white], true])
   end
 
+  def test_polygon
+    points = [[0, 0], V[10, 0], [10, 10]]
+
+    t.polygon(*points, :white)
+    t.polygon(*points, :white, fill: true, aa: false)
+
+    assert_equal 3, points.size
+
+    assert_drawing([:draw_polygon, [0, 10, 10], [h, h, h-10], white,
+                    { fill: false, aa: true }],
+                   [:draw_polygon, [0, 10, 10], [h, h, h-10], white,
+                    { fill: true, aa: false }])
+  end
+
   def test_point
     t.point 2, 10, :white
 
@@ -514,10 +1258,52 @@ class TestSimulation < Minitest::Test
                    [:draw_rect, 25, h+1-25-20,  10,  20, white, :filled])
   end
 
+  def test_rounded_rect
+    t.rounded_rect 10, 20, 30, 40, 5, :white, aa: false
+
+    assert_drawing [:draw_rounded_rect, 10, 20, 30, 40, 5, white,
+                    { width: 1, aa: false, h: h }]
+  end
+
+  def test_stroke
+    t.stroke [[0, 0], V[10, 0], [10, 10]], :white, width: 4, join: :round
+    t.stroke [0, 0, 10, 0], :white, cap: :square, aa: false
+
+    assert_drawing([:draw_stroke, [0, 0, 10, 0, 10, 10], white,
+                    { width: 4, join: :round, cap: :butt, closed: false,
+                      aa: true, h: h }],
+                   [:draw_stroke, [0, 0, 10, 0], white,
+                    { width: 1, join: :miter, cap: :square, closed: false,
+                      aa: false, h: h }])
+  end
+
   def test_register_color
     skip "not done yet"
   end
 
+  def test_color_ramps
+    fmt = t.renderer.instance_variable_get :@format
+
+    assert_equal fmt.map_rgba(127, 127, 127, 255), t.color[:gray50]
+    assert_equal fmt.map_rgba(0, 0, 127, 255),     t.color[:blue127]
+    assert_equal fmt.map_rgba(254, 0, 254, 255),   t.color[:magenta254]
+    assert_equal t.color[:gray50], t.color[:gray50]
+
+    assert_nil t.color[:gray256]
+    assert_nil t.color[:purple50]
+    refute t.color.key?(:purple50)
+  end
+
+  def test_register_color_ramps
+    refute t.color.key?(:gray42)
+
+    t.register_color_ramps
+
+    assert t.color.key?(:gray42)
+    assert t.color.key?(:yellow255)
+    assert_equal 7 * (100 + 256), t.color.keys.grep(/\d\z/).size
+  end
+
   def test_render_text
     s = t.render_text("blah", :black)
 
@@ -611,14 +1397,328 @@ class TestGraphics < Minitest::Test
     assert_equal @t.color[:green], @t.color[:spectrum_120]
     assert_equal @t.color[:blue], @t.color[:spectrum_240]
   end
+
+  def test_rainbow_palette
+    spectrum = Graphics::Hue.new
+
+    assert_equal 256, spectrum.palette.size
+    assert_equal [spectrum.color(0), spectrum.color(360)], spectrum.palette(2)
+    assert_equal [spectrum.color(0)], spectrum.palette(1)
+    assert_raises(ArgumentError) { spectrum.palette 0 }
+  end
+
+  def test_framebuffer_palette_eq
+    fb = @t.renderer.new_indexed_framebuffer 4, 4, 8
+
+    fb.palette = [1, 2]
+    assert_equal [1, 2, 0], fb.palette.first(3)
+
+    fb.palette = [3].pack "L"
+    assert_equal [3, 0], fb.palette.first(2)
+
+    assert_raises(TypeError) { fb.palette = 5 }
+  end
+
+  def test_framebuffer_flood_fill_indexed
+    [8, 16].each do |bits|
+      fb = @t.renderer.new_indexed_framebuffer 4, 4, bits
+      fb.palette = [0x000000ff, 0x030303ff, 0x0000ffff]
+      fb[1, 1] = 1
+
+      assert_equal 15, fb.flood_fill(0, 0, 2)
+      assert_equal 1, fb[1, 1]
+      assert_equal 16, fb.flood_fill(0, 0, 0, tolerance: 255)
+
+      fb[1, 1] = 1
+      assert_equal 16, fb.flood_fill(0, 0, (1 << bits) - 1, tolerance: 3)
+      assert_equal((1 << bits) - 1, fb[1, 1])
+
+      assert_raises(RangeError) { fb.flood_fill 0, 0, 1 << bits }
+      assert_raises(RangeError) { fb.flood_fill 0, 0, 300 + (1 << bits) }
+    end
+  end
+
+  def test_draw_bezier_overshoot
+    r     = @t.renderer.sprite 128, 5
+    white = [255, 255, 255, 255].pack("C4").unpack1 "L"
+    lit   = ->(x) { r.read_pixels(x, 0, 1, 5).unpack("C*").any?(&:nonzero?) }
+
+    r.clear 0
+    r.draw_bezier [0, 2, 100, 2, 10, 2], white # collinear, but turns back at x=52.6
+
+    assert lit[50]
+    refute lit[60]
+  end
+
+  def test_draw_bezier_many_points
+    r      = @t.renderer.sprite 64, 64
+    white  = [255, 255, 255, 255].pack("C4").unpack1 "L"
+    points = (0..20).flat_map { |i| [i * 3, i.even? ? 0 : 60] }
+
+    r.clear 0
+    r.draw_bezier points, white # 21 control points, one curve
+    refute_equal "\0" * (64 * 64 * 4), r.read_pixels
+
+    assert_raises ArgumentError do
+      r.draw_bezier points, white, degree: 20 # paths are up to degree 15
+    end
+  end
+
+  def test_event_drain
+    events = SDL::Event.drain
+
+    assert_kind_of Array, events
+    assert events.all?(&:frozen?)
+    assert_empty SDL::Event.drain(false) # nothing left
+  end
+
+  def test_key_bindings
+    keys = SDL::Key::Bindings.new
+    a    = proc {}
+    b    = proc {}
+
+    keys.bind SDL::Key::A, a
+    keys.bind SDL::Key::A, b, on: :pressed, mod: SDL::Key::MOD_CTRL
+    keys.bind SDL::Key::B, a
+    assert_equal 3, keys.size
+
+    assert_empty keys.update # nothing held
+    refute keys.held? SDL::Key::A
+
+    keys.unbind SDL::Key::A, b
+    assert_equal 2, keys.size
+
+    keys.unbind nil
+    assert_equal 0, keys.size
+
+    assert_raises ArgumentError do
+      keys.bind SDL::Key::A, a, on: :bogus
+    end
+  end
+
+  def test_key_bindings_unmapped
+    keys     = SDL::Key::Bindings.new
+    unmapped = 0x4000_0000 | 0xFFFF # a keycode with no scancode
+    a        = proc {}
+
+    keys.bind unmapped, a # like add_key_handler, doesn't care
+    keys.bind SDL::Key::A, a
+    assert_equal 2, keys.size
+
+    assert_empty keys.update # and never fires
+    refute keys.held? unmapped
+
+    keys.unbind unmapped
+    assert_equal 1, keys.size # only that keycode's binding
+  end
+
+  def test_add_key_handler
+    @t.add_key_handler(:A) { }
+    @t.add_key_handler(:A) { }
+    assert_equal 2, @t.key_handler.size
+
+    @t.add_key_handler(:A, :remove) { }
+    assert_equal 1, @t.key_handler.size
+  end
+
+  def test_texture_budget
+    r = @t.renderer
+    a = SDL::Surface.load TestSurface::BODY
+    b = SDL::Surface.load TestSurface::BODY
+
+    r.texture_budget = 0
+
+    r.blit a, 0, 0, nil, nil, nil, nil
+    used = r.texture_usage
+    assert_operator used, :>, 0
+
+    r.blit b, 0, 0, nil, nil, nil, nil
+    assert_equal used, r.texture_usage # a's texture was evicted
+
+    r.blit a, 0, 0, nil, nil, nil, nil # and comes back
+    assert_equal used, r.texture_usage
+  end
+
+  def test_texture_memsize
+    require "objspace"
+
+    sprite  = @t.renderer.sprite 16, 8
+    texture = sprite.new_texture
+
+    assert_operator ObjectSpace.memsize_of(texture), :>=, 16 * 8 * 4
+  end
+
+  def test_upload_after_eviction
+    r = @t.renderer
+    SDL::Surface.clear_cache
+
+    loader = SDL::Surface.load_async [TestSurface::BODY]
+    loader.wait
+    assert_equal 1, loader.upload(r)
+    assert_operator r.texture_usage, :>, 0
+    assert_equal 0, SDL::Surface.load_async([TestSurface::BODY]).upload(r)
+
+    r.texture_budget = 0
+    r.texture_budget = 1 << 20
+    assert_equal 0, r.texture_usage
+
+    loader = SDL::Surface.load_async [TestSurface::BODY]
+    assert_equal 1, loader.upload(r) # evicted, so uploaded again
+    assert_operator r.texture_usage, :>, 0
+  end
 end
 
-# class TestTrail < Minitest::Test
-#   def test_draw
-#     raise NotImplementedError, 'Need to write test_draw'
-#   end
-#
-#   def test_lt2
-#     raise NotImplementedError, 'Need to write test_lt2'
-#   end
-# end
+class TestDrawing < Minitest::Test
+  class FakeDrawing < Graphics::Drawing
+    CLEAR_COLOR = :white
+
+    def initialize
+      SDL.init SDL::INIT_VIDEO
+      super 30, 20
+    end
+  end
+
+  def setup
+    @t = FakeDrawing.new
+  end
+
+  def test_shadow
+    canvas = @t.shadow
+
+    assert_same canvas, @t.shadow
+    assert_equal @t.color[:white], @t.point(5, 5) # copied from the texture
+
+    @t.point 5, 5, :red
+    assert_equal @t.color[:red], @t.point(5, 5)
+    assert_equal @t.color[:red], canvas[5, @t.h-5-1]
+
+    @t.clear :black
+    assert_equal @t.color[:black], @t.point(5, 5)
+  end
+
+  def test_shadow_off_canvas
+    @t.shadow
+
+    assert_nil @t.point(-1, 5)
+    assert_nil @t.point(5, @t.h)
+    @t.point(-1, 5, :red) # dropped
+  end
+
+  def test_shadow_restores_target
+    r = @t.renderer
+    other = r.new_texture
+    r.target = other
+
+    @t.shadow
+
+    assert_same other, r.target
+  ensure
+    r.target = nil
+  end
+
+  def test_shadow_keeps_renderer_drawing
+    @t.shadow
+
+    def @t.draw n
+      fast_rect 20, 10, 5, 5, :blue # renderer only
+      point 2, 2, :red               # canvas only
+    end
+
+    @t.draw_and_flip 1
+
+    r = @t.renderer
+    r.target = @t.texture
+
+    assert_equal @t.color[:blue], r[22, @t.h-12-1]
+    assert_equal @t.color[:red],  r[2,  @t.h-2-1]
+    assert_equal @t.color[:white], r[10, 5]
+  ensure
+    r.target = nil if r
+  end
+
+  def test_flood_fill
+    @t.shadow
+    @t.clear :black
+    (0...@t.h).each { |y| @t.point 10, y, :white } # a wall
+
+    assert_equal 10 * @t.h, @t.flood_fill(5, 5, :red)
+    assert_equal @t.color[:red],   @t.point(0, 0)
+    assert_equal @t.color[:white], @t.point(10, 0)
+    assert_equal @t.color[:black], @t.point(11, 0)
+
+    assert_equal 0, @t.flood_fill(-1, 5, :red)
+  end
+
+  def test_flood_fill_needs_canvas
+    assert_raises RuntimeError do
+      @t.flood_fill 5, 5, :red
+    end
+
+    assert_nil @t.canvas # didn't turn it on behind our back
+  end
+
+  def test_flood_fill_tolerance
+    @t.shadow
+    @t.clear :black
+    @t.register_color :almost_black, 3, 3, 3
+    @t.point 1, 1, :almost_black
+
+    assert_equal @t.w * @t.h - 1, @t.flood_fill(0, 0, :red)
+    assert_equal @t.color[:almost_black], @t.point(1, 1)
+
+    assert_equal @t.w * @t.h, @t.flood_fill(0, 0, :black, tolerance: 255)
+  end
+end
+
+require "graphics/trail"
+class TestTrail < Minitest::Test
+  Point = Struct.new :x, :y
+
+  def setup
+    @t     = FakeSimulation.new
+    @trail = Graphics::Trail.new @t, 3, :green
+  end
+
+  def test_draw
+    @trail << Point.new(10, 10)
+    @trail << Point.new(20, 20)
+    @trail << Point.new(30, 10)
+
+    assert_nil @trail.draw
+    assert_equal 100 * 4, @trail.c.bytesize
+  end
+
+  def test_lt2
+    (1..4).each { |n| @trail << Point.new(n, n * 10) }
+
+    assert_equal [[2, 20], [3, 30], [4, 40]], @trail.a
+    assert_equal 3, @trail.trail.size
+  end
+
+  def test_one_point
+    trail = Graphics::Trail.new @t, 1
+
+    trail << Point.new(1, 1)
+    trail << Point.new(2, 2)
+
+    assert_equal [[2, 2]], trail.a
+    assert_nil trail.draw
+
+    assert_raises(ArgumentError) { Graphics::Trail.new @t, 0 }
+  end
+
+  def test_ramps_per_renderer
+    other = FakeSimulation.new
+
+    assert_same @trail.c, Graphics::Trail.new(@t, 3, :green).c
+    refute_same @trail.c, Graphics::Trail.new(other, 3, :green).c
+  end
+
+  def test_max_eq
+    (1..3).each { |n| @trail << Point.new(n, n) }
+    @trail.max = 2
+
+    assert_equal 2, @trail.max
+    assert_equal [[2, 2], [3, 3]], @trail.a
+  end
+end
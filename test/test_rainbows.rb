@@ -46,6 +46,15 @@ class RainbowsTest < Minitest::Test
     assert_equal [255, 255, 255], @greyscale.color(1000, 0, 100)
   end
 
+  def test_palette
+    palette = @greyscale.palette 256
+
+    assert_equal 256,             palette.size
+    assert_equal [0, 0, 0],       palette.first
+    assert_equal [255, 255, 255], palette.last
+    assert_equal @hue.color(180), @hue.palette(3)[1]
+  end
+
   def test_hue
     assert_equal [255, 0, 0],   @hue.color(0)   # Red
     assert_equal [255, 127, 0], @hue.color(30)  # Orange